@@ -0,0 +1,683 @@
+// Load generator: N concurrent sessions, each with its own connection to S1, run a weighted
+// mix of operations on synthetic files they upload themselves, and the per-operation
+// throughput and latency quantiles are printed as JSON so runs of different builds can be
+// compared. Everything runs against the four servers on localhost.
+//
+// Usage: w25bench [-c sessions] [-d seconds | -n ops_per_session] [-m mix] [-s sizes]
+//                 [-t types] [-p prefill] [-z] [-k] [-o output.json]
+//   -m uploadf=30,downlf=55,removef=10,dispfnames=4,downltar=1   relative operation weights
+//   -s 4K=40,64K-1M=45,8M=15    file sizes (a range is drawn uniformly) with their weights
+//   -t .pdf,.txt,.c,.zip        file types, picked uniformly
+//   -z                          negotiate LZ4 wire compression with S1
+//   -k                          keep the uploaded files instead of removing them at the end
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#include <pthread.h>
+#include <time.h>
+
+#define S1_PORT 7040
+#define BUFFER_SIZE 4096
+#define CHUNK_SIZE 65536
+#define DEBUG 1
+#define BENCH_DIR "~S1/bench"        // each session works under BENCH_DIR/s<session>
+#define MAX_SIZE_CLASSES 16
+#define MAX_TYPES 4
+
+#define debug_print(fmt, ...) \
+    do { if (DEBUG) fprintf(stderr, "[BENCH] %s(): " fmt, __func__, ##__VA_ARGS__); } while (0)
+
+#define handle_error(en, msg) \
+    do { debug_print("ERROR: %s - %s\n", msg, strerror(en)); exit(EXIT_FAILURE); } while (0)
+
+// Wire protocol: every message is a 16-byte header followed by `length` payload bytes.
+// Header (network byte order): version(1) opcode(1) flags(2) req_id(4) length(8)
+#define PROTO_VERSION 1
+#define FRAME_HDR_SIZE 16
+
+typedef enum {OP_CMD = 1, OP_RESP, OP_ERROR, OP_DATA, OP_END} frame_op;
+
+// DATA frame flag: the payload is LZ4-compressed; on a command: the reply may be (see send_data)
+#define FLAG_LZ4 0x0002
+
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint32_t req_id;
+    uint64_t length;
+} frame_hdr;
+
+// Frame I/O helpers
+int send_all(int sock, const void *buf, size_t len, int flags) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, flags | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+int recv_all(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+int send_frame_hdr(int sock, uint8_t opcode, uint16_t flags, uint32_t req_id, uint64_t length) {
+    unsigned char hdr[FRAME_HDR_SIZE];
+    uint16_t f = htons(flags);
+    uint32_t id = htonl(req_id);
+    uint64_t len = htobe64(length);
+    hdr[0] = PROTO_VERSION; hdr[1] = opcode;
+    memcpy(hdr + 2, &f, 2); memcpy(hdr + 4, &id, 4); memcpy(hdr + 8, &len, 8);
+    return send_all(sock, hdr, FRAME_HDR_SIZE, length ? MSG_MORE : 0);
+}
+
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint32_t req_id, const void *payload, uint64_t length) {
+    if (send_frame_hdr(sock, opcode, flags, req_id, length) < 0) return -1;
+    return length ? send_all(sock, payload, length, 0) : 0;
+}
+
+int recv_frame_hdr(int sock, frame_hdr *hdr) {
+    unsigned char raw[FRAME_HDR_SIZE];
+    if (recv_all(sock, raw, FRAME_HDR_SIZE) < 0) return -1;
+
+    uint16_t f; uint32_t id; uint64_t len;
+    memcpy(&f, raw + 2, 2); memcpy(&id, raw + 4, 4); memcpy(&len, raw + 8, 8);
+    hdr->version = raw[0]; hdr->opcode = raw[1];
+    hdr->flags = ntohs(f); hdr->req_id = ntohl(id); hdr->length = be64toh(len);
+    return hdr->version == PROTO_VERSION ? 0 : -1;
+}
+
+// Discards `length` payload bytes that the caller has no use for
+int skip_payload(int sock, uint64_t length) {
+    char buffer[CHUNK_SIZE];
+    while (length > 0) {
+        size_t n = length < CHUNK_SIZE ? length : CHUNK_SIZE;
+        if (recv_all(sock, buffer, n) < 0) return -1;
+        length -= n;
+    }
+    return 0;
+}
+
+// Reads one frame and stores its payload as a NUL-terminated string (truncated to fit)
+int recv_msg(int sock, frame_hdr *hdr, char *buf, size_t size) {
+    if (recv_frame_hdr(sock, hdr) < 0) return -1;
+    size_t n = hdr->length < size - 1 ? hdr->length : size - 1;
+    if (recv_all(sock, buf, n) < 0) return -1;
+    buf[n] = '\0';
+    return skip_payload(sock, hdr->length - n);
+}
+
+// Wire compression, as in w25clients.c: a DATA frame flagged FLAG_LZ4 carries a 4-byte raw
+// length followed by one LZ4 block of at most LZ4_BLOCK raw bytes. Downloads are never
+// decoded here; only the raw length is read so that throughput counts file bytes.
+#define LZ4_BLOCK 65536
+#define LZ4_HASH_LOG 12
+
+size_t lz4_put_length(unsigned char *op, size_t len) {
+    size_t n = 0;
+    for (; len >= 255; len -= 255) op[n++] = 255;
+    op[n++] = len;
+    return n;
+}
+
+// Compresses src[0..n) (n <= LZ4_BLOCK) into dst; returns the block size, or 0 if it would
+// not fit in `cap` bytes
+size_t lz4_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    uint16_t table[1 << LZ4_HASH_LOG] = {0};
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    // The format requires the last 5 bytes to be literals and no match to start in the last 12
+    while (n > 12 && ip < end - 12) {
+        uint32_t seq, cand;
+        memcpy(&seq, ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+        const unsigned char *ref = src + table[h];
+        table[h] = ip - src;
+        memcpy(&cand, ref, 4);
+        if (ref >= ip || cand != seq) { ip++; continue; }
+
+        const unsigned char *mend = ip + 4;
+        while (mend < end - 5 && *mend == ref[mend - ip]) mend++;
+        size_t lit = ip - anchor, mlen = mend - ip - 4;
+        if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return 0;
+        unsigned char *token = op++;
+        *token = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+        if (lit >= 15) op += lz4_put_length(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        if (mlen >= 15) op += lz4_put_length(op, mlen - 15);
+        ip = anchor = mend;
+    }
+
+    size_t lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op += lz4_put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    return op + lit - dst;
+}
+
+// Sends one DATA frame, LZ4-compressed while *compress is set; compression is switched off
+// for the rest of the stream once a block fails to shrink by at least an eighth
+int send_data(int sock, uint32_t req_id, const void *data, size_t n, int *compress) {
+    if (*compress && n > 0) {
+        unsigned char out[4 + LZ4_BLOCK];
+        size_t c = lz4_compress(data, n, out + 4, n - n / 8);
+        if (c > 0) {
+            uint32_t raw = htonl(n);
+            memcpy(out, &raw, 4);
+            return send_frame(sock, OP_DATA, FLAG_LZ4, req_id, out, c + 4);
+        }
+        *compress = 0;
+    }
+    return send_frame(sock, OP_DATA, 0, req_id, data, n);
+}
+
+// Latency histograms: log-linear (HDR-style) buckets, METRIC_SUB_BUCKETS per power of two of
+// microseconds, so the quantiles reported are within ~6% of the measured latencies
+#define METRIC_SUB_BITS 4
+#define METRIC_SUB_BUCKETS (1 << METRIC_SUB_BITS)
+#define METRIC_BUCKETS (33 * METRIC_SUB_BUCKETS)     // latencies up to 2^36 us (~19 h)
+
+typedef enum {BENCH_UPLOADF, BENCH_DOWNLF, BENCH_REMOVEF, BENCH_DISPFNAMES, BENCH_DOWNLTAR, BENCH_OPS} bench_op;
+const char *op_names[BENCH_OPS] = { "uploadf", "downlf", "removef", "dispfnames", "downltar" };
+
+typedef struct {
+    unsigned long long ops, errors, bytes, sum_us, max_us;
+    unsigned long long buckets[METRIC_BUCKETS];
+} op_stats;
+
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int metric_bucket(uint64_t us) {
+    if (us < METRIC_SUB_BUCKETS) return us;
+    int e = 63 - __builtin_clzll(us);
+    int b = (e - METRIC_SUB_BITS + 1) * METRIC_SUB_BUCKETS + (int)((us >> (e - METRIC_SUB_BITS)) & (METRIC_SUB_BUCKETS - 1));
+    return b < METRIC_BUCKETS ? b : METRIC_BUCKETS - 1;
+}
+
+// Smallest latency above bucket `b`
+uint64_t metric_bucket_limit(int b) {
+    if (b < METRIC_SUB_BUCKETS) return b + 1;
+    return (uint64_t)(METRIC_SUB_BUCKETS + b % METRIC_SUB_BUCKETS + 1) << (b / METRIC_SUB_BUCKETS - 1);
+}
+
+// Upper bound of the q-quantile latency, in microseconds
+uint64_t metric_quantile(const op_stats *s, double q) {
+    unsigned long long total = 0, seen = 0;
+    for (int b = 0; b < METRIC_BUCKETS; b++) total += s->buckets[b];
+    if (total == 0) return 0;
+    unsigned long long rank = (unsigned long long)(q * total + 0.5);
+    if (rank == 0) rank = 1;
+    for (int b = 0; b < METRIC_BUCKETS; b++) {
+        seen += s->buckets[b];
+        if (seen >= rank) return metric_bucket_limit(b) - 1 < s->max_us ? metric_bucket_limit(b) - 1 : s->max_us;
+    }
+    return s->max_us;
+}
+
+void stats_record(op_stats *s, uint64_t started_us, uint64_t bytes, int failed) {
+    uint64_t us = now_us() - started_us;
+    s->ops++;
+    if (failed) s->errors++;
+    s->bytes += bytes;
+    s->sum_us += us;
+    s->buckets[metric_bucket(us)]++;
+    if (us > s->max_us) s->max_us = us;
+}
+
+void stats_merge(op_stats *into, const op_stats *from) {
+    into->ops += from->ops;
+    into->errors += from->errors;
+    into->bytes += from->bytes;
+    into->sum_us += from->sum_us;
+    if (from->max_us > into->max_us) into->max_us = from->max_us;
+    for (int b = 0; b < METRIC_BUCKETS; b++) into->buckets[b] += from->buckets[b];
+}
+
+// Benchmark configuration, parsed from the command line
+typedef struct {
+    uint64_t min, max;
+    unsigned weight;
+} size_class;
+
+int session_count = 8;
+double duration_secs = 10;
+unsigned long ops_per_session = 0;   // when set, replaces the duration
+unsigned prefill = 8;                // files each session uploads before measuring starts
+int want_lz4 = 0, keep_files = 0;
+unsigned op_weights[BENCH_OPS] = { 30, 55, 10, 4, 1 };
+size_class size_classes[MAX_SIZE_CLASSES] = { { 4096, 4096, 40 }, { 65536, 1048576, 45 }, { 8388608, 8388608, 15 } };
+int size_class_count = 3;
+const char *types[MAX_TYPES] = { ".pdf", ".txt", ".c", ".zip" };
+int type_count = 4;
+const char *mix_arg = "uploadf=30,downlf=55,removef=10,dispfnames=4,downltar=1";
+const char *sizes_arg = "4K=40,64K-1M=45,8M=15";
+const char *types_arg = ".pdf,.txt,.c,.zip";
+
+pthread_barrier_t start_barrier;
+
+// A file uploaded by a session and not yet removed
+typedef struct {
+    char name[32];
+    uint64_t size;
+} bench_file;
+
+typedef struct {
+    int id;
+    int sock;
+    int lz4;                     // S1 agreed to LZ4 frames on this connection
+    uint32_t next_req_id;
+    uint64_t rng;
+    unsigned next_file;
+    bench_file *files;
+    size_t file_count, file_cap;
+    uint64_t finished_us;        // when the measured operations ended
+    op_stats stats[BENCH_OPS];
+} session;
+
+uint64_t next_random(session *s) {
+    s->rng ^= s->rng << 13;
+    s->rng ^= s->rng >> 7;
+    s->rng ^= s->rng << 17;
+    return s->rng;
+}
+
+// Synthetic file content: word salad for .txt/.c, so that compression has something to do,
+// and random bytes for .pdf/.zip
+void fill_content(session *s, const char *type, char *buf, size_t n) {
+    static const char *words[] = {
+        "int ", "return ", "the ", "file ", "server ", "data ", "(void) ", "{ ", "} ", "0; ", "size ", "buffer ",
+        "while ", "if ", "else ", "for ", "char ", "*p ", "= ", "+ ", "index ", "path ", "error ", "\n",
+    };
+    if (strcmp(type, ".txt") == 0 || strcmp(type, ".c") == 0) {
+        size_t i = 0;
+        while (i < n) {
+            const char *w = words[next_random(s) % (sizeof(words) / sizeof(words[0]))];
+            for (; *w && i < n; w++) buf[i++] = *w;
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; i += 8) {
+        uint64_t r = next_random(s);
+        memcpy(buf + i, &r, n - i < 8 ? n - i : 8);
+    }
+}
+
+int open_session(session *s) {
+    struct sockaddr_in serv_addr = {0};
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(S1_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
+
+    s->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (s->sock < 0) return -1;
+    if (connect(s->sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(s->sock);
+        s->sock = -1;
+        return -1;
+    }
+    int one = 1;
+    setsockopt(s->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    s->lz4 = 0;
+    if (want_lz4) {
+        char response[BUFFER_SIZE];
+        frame_hdr hdr;
+        if (send_frame(s->sock, OP_CMD, 0, ++s->next_req_id, "HELLO lz4", 9) < 0 ||
+            recv_msg(s->sock, &hdr, response, sizeof(response)) < 0) {
+            close(s->sock);
+            s->sock = -1;
+            return -1;
+        }
+        s->lz4 = hdr.opcode == OP_RESP && strstr(response, "lz4") != NULL;
+    }
+    return 0;
+}
+
+// After a broken exchange the stream can't be resynchronised, so the session reconnects
+void reset_session(session *s) {
+    if (s->sock >= 0) close(s->sock);
+    s->sock = -1;
+    if (open_session(s) < 0) debug_print("Session %d could not reconnect: %s\n", s->id, strerror(errno));
+}
+
+int send_command(session *s, const char *command) {
+    uint16_t flags = s->lz4 ? FLAG_LZ4 : 0;
+    return send_frame(s->sock, OP_CMD, flags, ++s->next_req_id, command, strlen(command));
+}
+
+// Reads a one-frame reply; returns 0 for RESP, 1 for ERROR and -1 if the connection failed
+int recv_reply(session *s, uint64_t *length) {
+    frame_hdr hdr;
+    if (recv_frame_hdr(s->sock, &hdr) < 0 || hdr.req_id != s->next_req_id) return -1;
+    if (skip_payload(s->sock, hdr.length) < 0) return -1;
+    if (length) *length = hdr.length;
+    return hdr.opcode == OP_RESP ? 0 : 1;
+}
+
+// Drains DATA frames until END; returns 0 on END, 1 on ERROR and -1 if the connection failed.
+// *bytes gets the raw (uncompressed) size of the data.
+int recv_stream(session *s, uint64_t *bytes) {
+    frame_hdr hdr;
+    *bytes = 0;
+    while (recv_frame_hdr(s->sock, &hdr) == 0 && hdr.req_id == s->next_req_id) {
+        if (hdr.opcode == OP_END) return 0;
+        if (hdr.opcode == OP_ERROR) return skip_payload(s->sock, hdr.length) < 0 ? -1 : 1;
+        if (hdr.opcode != OP_DATA) return -1;
+        if (hdr.flags & FLAG_LZ4) {
+            uint32_t raw;
+            if (hdr.length < 4 || recv_all(s->sock, &raw, 4) < 0 || skip_payload(s->sock, hdr.length - 4) < 0) return -1;
+            *bytes += ntohl(raw);
+        } else {
+            if (skip_payload(s->sock, hdr.length) < 0) return -1;
+            *bytes += hdr.length;
+        }
+    }
+    return -1;
+}
+
+uint64_t pick_size(session *s) {
+    unsigned total = 0;
+    for (int i = 0; i < size_class_count; i++) total += size_classes[i].weight;
+    unsigned r = next_random(s) % total;
+    const size_class *c = &size_classes[0];
+    for (int i = 0; i < size_class_count; i++) {
+        if (r < size_classes[i].weight) { c = &size_classes[i]; break; }
+        r -= size_classes[i].weight;
+    }
+    return c->min + (c->max > c->min ? next_random(s) % (c->max - c->min + 1) : 0);
+}
+
+// Uploads a new synthetic file; returns 0 if S1 stored it, 1 if it refused and -1 if the
+// connection failed
+int do_upload(session *s, uint64_t *bytes) {
+    char buffer[CHUNK_SIZE], command[BUFFER_SIZE];
+    const char *type = types[next_random(s) % type_count];
+    uint64_t size = pick_size(s);
+    bench_file f;
+    snprintf(f.name, sizeof(f.name), "f%u%s", s->next_file++, type);
+    f.size = size;
+
+    snprintf(command, sizeof(command), "uploadf %s %s/s%d/%s", f.name, BENCH_DIR, s->id, f.name);
+    if (send_command(s, command) < 0) return -1;
+    int compress = s->lz4 && strcmp(type, ".zip") != 0;
+    for (uint64_t sent = 0; sent < size; ) {
+        size_t n = size - sent < CHUNK_SIZE ? size - sent : CHUNK_SIZE;
+        fill_content(s, type, buffer, n);
+        if (send_data(s->sock, s->next_req_id, buffer, n, &compress) < 0) return -1;
+        sent += n;
+    }
+    if (send_frame(s->sock, OP_END, 0, s->next_req_id, NULL, 0) < 0) return -1;
+    *bytes = size;
+
+    int rc = recv_reply(s, NULL);
+    if (rc != 0) return rc;
+    if (s->file_count == s->file_cap) {
+        size_t cap = s->file_cap ? s->file_cap * 2 : 64;
+        bench_file *files = realloc(s->files, cap * sizeof(*files));
+        if (!files) handle_error(ENOMEM, "Out of memory");
+        s->files = files;
+        s->file_cap = cap;
+    }
+    s->files[s->file_count++] = f;
+    return 0;
+}
+
+int do_download(session *s, const bench_file *f, uint64_t *bytes) {
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "downlf %s/s%d/%s", BENCH_DIR, s->id, f->name);
+    if (send_command(s, command) < 0) return -1;
+    int rc = recv_stream(s, bytes);
+    return rc == 0 && *bytes != f->size ? 1 : rc;
+}
+
+int do_remove(session *s, size_t index) {
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "removef %s/s%d/%s", BENCH_DIR, s->id, s->files[index].name);
+    s->files[index] = s->files[--s->file_count];
+    if (send_command(s, command) < 0) return -1;
+    return recv_reply(s, NULL);
+}
+
+int do_dispfnames(session *s, uint64_t *bytes) {
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "dispfnames %s/s%d", BENCH_DIR, s->id);
+    if (send_command(s, command) < 0) return -1;
+    return recv_reply(s, bytes);
+}
+
+// Archives one of the benchmarked types; S1 only builds .c, .pdf and .txt archives
+int do_downltar(session *s, uint64_t *bytes) {
+    const char *tar_types[MAX_TYPES];
+    int n = 0;
+    for (int i = 0; i < type_count; i++)
+        if (strcmp(types[i], ".zip") != 0) tar_types[n++] = types[i];
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "downltar %s", n ? tar_types[next_random(s) % n] : ".c");
+    if (send_command(s, command) < 0) return -1;
+    return recv_stream(s, bytes);
+}
+
+bench_op pick_op(session *s) {
+    unsigned total = 0;
+    for (int i = 0; i < BENCH_OPS; i++) total += op_weights[i];
+    unsigned r = next_random(s) % total;
+    for (int i = 0; i < BENCH_OPS; i++) {
+        if (r < op_weights[i]) return i;
+        r -= op_weights[i];
+    }
+    return BENCH_UPLOADF;
+}
+
+// Runs one operation and records it; downloads and removals of a session without files
+// upload one instead
+void run_op(session *s, bench_op op, int record) {
+    if ((op == BENCH_DOWNLF || op == BENCH_REMOVEF) && s->file_count == 0) op = BENCH_UPLOADF;
+    uint64_t started = now_us(), bytes = 0;
+    int rc;
+    switch (op) {
+    case BENCH_UPLOADF: rc = do_upload(s, &bytes); break;
+    case BENCH_DOWNLF: rc = do_download(s, &s->files[next_random(s) % s->file_count], &bytes); break;
+    case BENCH_REMOVEF: rc = do_remove(s, next_random(s) % s->file_count); break;
+    case BENCH_DISPFNAMES: rc = do_dispfnames(s, &bytes); break;
+    default: rc = do_downltar(s, &bytes); break;
+    }
+    if (record) stats_record(&s->stats[op], started, bytes, rc != 0);
+    if (rc < 0) reset_session(s);
+}
+
+void *session_main(void *arg) {
+    session *s = arg;
+    for (unsigned i = 0; i < prefill && s->sock >= 0; i++) run_op(s, BENCH_UPLOADF, 0);
+    pthread_barrier_wait(&start_barrier);
+
+    uint64_t deadline = now_us() + (uint64_t)(duration_secs * 1e6);
+    for (unsigned long done = 0; s->sock >= 0; done++) {
+        if (ops_per_session ? done >= ops_per_session : now_us() >= deadline) break;
+        run_op(s, pick_op(s), 1);
+    }
+    s->finished_us = now_us();
+
+    while (!keep_files && s->file_count > 0 && s->sock >= 0) run_op(s, BENCH_REMOVEF, 0);
+    return NULL;
+}
+
+// "4K", "1M", "2G" or plain bytes
+int parse_size(const char *arg, uint64_t *value) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (errno || end == arg) return -1;
+    if (*end == 'K' || *end == 'k') { v <<= 10; end++; }
+    else if (*end == 'M' || *end == 'm') { v <<= 20; end++; }
+    else if (*end == 'G' || *end == 'g') { v <<= 30; end++; }
+    if (*end) return -1;
+    *value = v;
+    return 0;
+}
+
+// -m: "name=weight,..."; operations left out get weight 0
+int parse_mix(char *arg) {
+    unsigned weights[BENCH_OPS] = {0}, total = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(arg, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        int op = -1;
+        for (int i = 0; i < BENCH_OPS; i++) if (strcmp(item, op_names[i]) == 0) op = i;
+        if (op < 0) return -1;
+        weights[op] = atoi(eq + 1);
+        total += weights[op];
+    }
+    if (total == 0) return -1;
+    memcpy(op_weights, weights, sizeof(weights));
+    return 0;
+}
+
+// -s: "size=weight,..." where size is one size or "min-max"
+int parse_sizes(char *arg) {
+    int count = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(arg, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq || count == MAX_SIZE_CLASSES) return -1;
+        *eq = '\0';
+        size_class c = { .weight = atoi(eq + 1) };
+        char *dash = strchr(item, '-');
+        if (dash) *dash = '\0';
+        if (parse_size(item, &c.min) < 0 || parse_size(dash ? dash + 1 : item, &c.max) < 0 || c.max < c.min || !c.weight)
+            return -1;
+        size_classes[count++] = c;
+    }
+    if (count == 0) return -1;
+    size_class_count = count;
+    return 0;
+}
+
+// -t: ".pdf,.txt,..."
+int parse_types(char *arg) {
+    static const char *known[] = { ".pdf", ".txt", ".c", ".zip" };
+    int count = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(arg, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        int found = -1;
+        for (int i = 0; i < MAX_TYPES; i++) if (strcmp(item, known[i]) == 0) found = i;
+        if (found < 0 || count == MAX_TYPES) return -1;
+        types[count++] = known[found];
+    }
+    if (count == 0) return -1;
+    type_count = count;
+    return 0;
+}
+
+void print_op(FILE *out, const char *name, const op_stats *s, double elapsed, int last) {
+    fprintf(out, "    \"%s\": {\"ops\": %llu, \"errors\": %llu, \"bytes\": %llu, \"ops_per_sec\": %.1f, "
+                 "\"mb_per_sec\": %.2f, \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, "
+                 "\"max_ms\": %.3f}%s\n",
+            name, s->ops, s->errors, s->bytes, s->ops / elapsed, s->bytes / elapsed / 1e6,
+            s->ops ? s->sum_us / 1e3 / s->ops : 0.0, metric_quantile(s, 0.5) / 1e3, metric_quantile(s, 0.99) / 1e3,
+            metric_quantile(s, 0.999) / 1e3, s->max_us / 1e3, last ? "" : ",");
+}
+
+void usage(void) {
+    fprintf(stderr, "Usage: w25bench [-c sessions] [-d seconds | -n ops_per_session] [-m mix] [-s sizes]\n"
+                    "                [-t types] [-p prefill] [-z] [-k] [-o output.json]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *output = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:n:m:s:t:p:zko:")) != -1) {
+        switch (opt) {
+        case 'c': session_count = atoi(optarg); break;
+        case 'd': duration_secs = atof(optarg); break;
+        case 'n': ops_per_session = strtoul(optarg, NULL, 10); break;
+        case 'm': mix_arg = strdup(optarg); if (parse_mix(optarg) < 0) usage(); break;
+        case 's': sizes_arg = strdup(optarg); if (parse_sizes(optarg) < 0) usage(); break;
+        case 't': types_arg = strdup(optarg); if (parse_types(optarg) < 0) usage(); break;
+        case 'p': prefill = atoi(optarg); break;
+        case 'z': want_lz4 = 1; break;
+        case 'k': keep_files = 1; break;
+        case 'o': output = optarg; break;
+        default: usage();
+        }
+    }
+    if (session_count <= 0 || (duration_secs <= 0 && !ops_per_session)) usage();
+
+    session *sessions = calloc(session_count, sizeof(*sessions));
+    pthread_t *threads = calloc(session_count, sizeof(*threads));
+    if (!sessions || !threads) handle_error(ENOMEM, "Out of memory");
+    pthread_barrier_init(&start_barrier, NULL, session_count + 1);
+
+    uint64_t seed = now_us() | 1;
+    for (int i = 0; i < session_count; i++) {
+        session *s = &sessions[i];
+        s->id = i;
+        s->rng = seed * (2 * i + 1) | 1;
+        if (open_session(s) < 0) handle_error(errno, "Connection to S1 failed");
+        int err = pthread_create(&threads[i], NULL, session_main, s);
+        if (err) handle_error(err, "pthread_create failed");
+    }
+
+    // Measurement starts once every session has finished uploading its prefill
+    pthread_barrier_wait(&start_barrier);
+    uint64_t started = now_us(), finished = started;
+    debug_print("Running %d sessions\n", session_count);
+    op_stats totals[BENCH_OPS] = {0}, all = {0};
+    for (int i = 0; i < session_count; i++) {
+        pthread_join(threads[i], NULL);
+        for (int op = 0; op < BENCH_OPS; op++) stats_merge(&totals[op], &sessions[i].stats[op]);
+        if (sessions[i].finished_us > finished) finished = sessions[i].finished_us;
+        if (sessions[i].sock >= 0) close(sessions[i].sock);
+        free(sessions[i].files);
+    }
+    uint64_t elapsed_us = finished > started ? finished - started : 1;
+    for (int op = 0; op < BENCH_OPS; op++) stats_merge(&all, &totals[op]);
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) handle_error(errno, "Cannot open output file");
+    double elapsed = elapsed_us / 1e6;
+    fprintf(out, "{\n  \"config\": {\"sessions\": %d, \"duration_sec\": %.1f, \"ops_per_session\": %lu, \"mix\": \"%s\", "
+                 "\"sizes\": \"%s\", \"types\": \"%s\", \"prefill\": %u, \"compression\": %s},\n",
+            session_count, ops_per_session ? 0 : duration_secs, ops_per_session, mix_arg, sizes_arg, types_arg, prefill,
+            want_lz4 ? "true" : "false");
+    fprintf(out, "  \"elapsed_sec\": %.3f,\n  \"operations\": {\n", elapsed);
+    for (int op = 0; op < BENCH_OPS; op++) print_op(out, op_names[op], &totals[op], elapsed, 0);
+    print_op(out, "all", &all, elapsed, 1);
+    fprintf(out, "  }\n}\n");
+    if (output) fclose(out);
+
+    free(sessions);
+    free(threads);
+    return all.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
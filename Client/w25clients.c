@@ -8,10 +8,19 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#include <pthread.h>
+#include <glob.h>
 
 #define S1_PORT 7040
 #define BUFFER_SIZE 4096
+#define CHUNK_SIZE 65536
 #define DEBUG 1
+#define PART_SIZE (8 * 1024 * 1024)           // bytes per part of a multi-part upload
+#define PART_UPLOAD_MIN (32 * 1024 * 1024)    // files at least this large are uploaded in parts
+#define UPLOAD_STREAMS 4                      // connections a multi-part upload is spread over
+#define PIPELINE_WINDOW 64                    // pipelined commands awaiting a reply at once
 
 // Debug printing macro
 #define debug_print(fmt, ...) \
@@ -22,7 +31,286 @@
 #define handle_error(en, msg) \
     do { debug_print("ERROR: %s - %s\n", msg, strerror(en)); exit(EXIT_FAILURE); } while (0)
 
+// Wire protocol: every message is a 16-byte header followed by `length` payload bytes.
+// Header (network byte order): version(1) opcode(1) flags(2) req_id(4) length(8)
+#define PROTO_VERSION 1
+#define FRAME_HDR_SIZE 16
+
+typedef enum {OP_CMD = 1, OP_RESP, OP_ERROR, OP_DATA, OP_END} frame_op;
+
+// DATA frame flag: this frame completes one archive entry (see send_tar_stream)
+#define FLAG_ENTRY_END 0x0001
+// DATA frame flag: the payload is LZ4-compressed; on a command: the reply may be (see send_data)
+#define FLAG_LZ4 0x0002
+
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint32_t req_id;
+    uint64_t length;
+} frame_hdr;
+
 int sock = 0;
+uint32_t next_req_id = 0;
+int lz4_enabled = 0;  // S1 answered HELLO with lz4
+int pipeline_enabled = 0;  // S1 accepts further commands before replying to earlier ones
+
+// Frame I/O helpers
+int send_all(int sock, const void *buf, size_t len, int flags) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, flags | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+int recv_all(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+int send_frame_hdr(int sock, uint8_t opcode, uint16_t flags, uint32_t req_id, uint64_t length) {
+    unsigned char hdr[FRAME_HDR_SIZE];
+    uint16_t f = htons(flags);
+    uint32_t id = htonl(req_id);
+    uint64_t len = htobe64(length);
+    hdr[0] = PROTO_VERSION; hdr[1] = opcode;
+    memcpy(hdr + 2, &f, 2); memcpy(hdr + 4, &id, 4); memcpy(hdr + 8, &len, 8);
+    return send_all(sock, hdr, FRAME_HDR_SIZE, length ? MSG_MORE : 0);
+}
+
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint32_t req_id, const void *payload, uint64_t length) {
+    if (send_frame_hdr(sock, opcode, flags, req_id, length) < 0) return -1;
+    return length ? send_all(sock, payload, length, 0) : 0;
+}
+
+int send_text(int sock, uint8_t opcode, uint32_t req_id, const char *text) {
+    return send_frame(sock, opcode, 0, req_id, text, strlen(text));
+}
+
+int recv_frame_hdr(int sock, frame_hdr *hdr) {
+    unsigned char raw[FRAME_HDR_SIZE];
+    if (recv_all(sock, raw, FRAME_HDR_SIZE) < 0) return -1;
+
+    uint16_t f; uint32_t id; uint64_t len;
+    memcpy(&f, raw + 2, 2); memcpy(&id, raw + 4, 4); memcpy(&len, raw + 8, 8);
+    hdr->version = raw[0]; hdr->opcode = raw[1];
+    hdr->flags = ntohs(f); hdr->req_id = ntohl(id); hdr->length = be64toh(len);
+
+    if (hdr->version != PROTO_VERSION) {
+        debug_print("Unsupported protocol version %u\n", hdr->version);
+        return -1;
+    }
+    return 0;
+}
+
+// Discards `length` payload bytes that the caller has no use for
+int skip_payload(int sock, uint64_t length) {
+    char buffer[BUFFER_SIZE];
+    while (length > 0) {
+        size_t n = length < BUFFER_SIZE ? length : BUFFER_SIZE;
+        if (recv_all(sock, buffer, n) < 0) return -1;
+        length -= n;
+    }
+    return 0;
+}
+
+// Reads one frame and stores its payload as a NUL-terminated string (truncated to fit)
+int recv_msg(int sock, frame_hdr *hdr, char *buf, size_t size) {
+    if (recv_frame_hdr(sock, hdr) < 0) return -1;
+    size_t n = hdr->length < size - 1 ? hdr->length : size - 1;
+    if (recv_all(sock, buf, n) < 0) return -1;
+    buf[n] = '\0';
+    return skip_payload(sock, hdr->length - n);
+}
+
+// Wire compression: a DATA frame flagged FLAG_LZ4 carries a 4-byte raw length followed by
+// one LZ4 block (the standard block format) of at most LZ4_BLOCK raw bytes. Peers learn
+// whether the other side decodes these with a HELLO exchange, and a command frame flagged
+// FLAG_LZ4 tells the receiver it may compress the DATA frames of its reply.
+#define LZ4_BLOCK 65536      // raw bytes per compressed frame; positions must fit in 16 bits
+#define LZ4_HASH_LOG 12
+
+size_t lz4_put_length(unsigned char *op, size_t len) {
+    size_t n = 0;
+    for (; len >= 255; len -= 255) op[n++] = 255;
+    op[n++] = len;
+    return n;
+}
+
+// Compresses n <= LZ4_BLOCK bytes into dst; returns 0 if the result would not fit in cap
+size_t lz4_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    uint16_t table[1 << LZ4_HASH_LOG] = {0};
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    // The format requires the last 5 bytes to be literals and no match to start in the last 12
+    while (n > 12 && ip < end - 12) {
+        uint32_t seq, cand;
+        memcpy(&seq, ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+        const unsigned char *ref = src + table[h];
+        table[h] = ip - src;
+        memcpy(&cand, ref, 4);
+        if (ref >= ip || cand != seq) { ip++; continue; }
+
+        const unsigned char *mend = ip + 4;
+        while (mend < end - 5 && *mend == ref[mend - ip]) mend++;
+        size_t lit = ip - anchor, mlen = mend - ip - 4;
+        if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return 0;
+        unsigned char *token = op++;
+        *token = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+        if (lit >= 15) op += lz4_put_length(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        if (mlen >= 15) op += lz4_put_length(op, mlen - 15);
+        ip = anchor = mend;
+    }
+
+    size_t lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op += lz4_put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    return op + lit - dst;
+}
+
+// Decodes one block into dst; returns the decoded size, or -1 if the block is malformed
+// or decodes to more than cap bytes
+long lz4_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, mlen = token & 15;
+        if (lit == 15) {
+            unsigned b;
+            do { if (ip >= iend) return -1; b = *ip++; lit += b; } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;  // the last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        if (mlen == 15) {
+            unsigned b;
+            do { if (ip >= iend) return -1; b = *ip++; mlen += b; } while (b == 255);
+        }
+        mlen += 4;
+        if ((size_t)(oend - op) < mlen) return -1;
+        for (const unsigned char *ref = op - offset; mlen > 0; mlen--) *op++ = *ref++;  // may overlap
+    }
+    return op - dst;
+}
+
+// Sends one DATA frame of at most LZ4_BLOCK bytes, compressed if *compress is set and the
+// block shrinks by at least 1/8. The first block that does not clears *compress, so data
+// that is already compressed costs a single trial.
+int send_data(int sock, uint32_t req_id, const void *data, size_t n, int *compress) {
+    if (*compress && n > 0) {
+        unsigned char out[4 + LZ4_BLOCK];
+        size_t c = lz4_compress(data, n, out + 4, n - n / 8);
+        if (c > 0) {
+            uint32_t raw = htonl(n);
+            memcpy(out, &raw, 4);
+            return send_frame(sock, OP_DATA, FLAG_LZ4, req_id, out, c + 4);
+        }
+        *compress = 0;
+    }
+    return send_frame(sock, OP_DATA, 0, req_id, data, n);
+}
+
+// Reads the payload of a FLAG_LZ4 DATA frame and decodes it into out (LZ4_BLOCK bytes).
+// Returns the raw length, -1 if the connection failed and -2 if the block was corrupt.
+long recv_lz4(int sock, uint64_t length, void *out) {
+    unsigned char in[4 + LZ4_BLOCK];
+    if (length < 4 || length > sizeof(in)) return skip_payload(sock, length) < 0 ? -1 : -2;
+    if (recv_all(sock, in, length) < 0) return -1;
+    uint32_t raw;
+    memcpy(&raw, in, 4);
+    raw = ntohl(raw);
+    if (raw > LZ4_BLOCK || lz4_decompress(in + 4, length - 4, out, raw) != (long)raw) return -2;
+    return raw;
+}
+
+// Sends the rest of `file` as DATA frames followed by END, LZ4-compressed if `compress` is set
+// and the data turns out to compress
+int send_file_stream(int sock, uint32_t req_id, FILE *file, int compress) {
+    char buffer[CHUNK_SIZE];
+    size_t bytes;
+    while ((bytes = fread(buffer, 1, CHUNK_SIZE, file)) > 0)
+        if (send_data(sock, req_id, buffer, bytes, &compress) < 0) return -1;
+    return send_frame(sock, OP_END, 0, req_id, NULL, 0);
+}
+
+// Receives DATA frames until END, writing them to `file` (or discarding them if NULL).
+// Returns 0 on END, -1 on a broken connection, -2 if the peer sent an ERROR frame
+// (its text is copied into `err`) and -3 if the stream was drained but a write failed.
+int recv_file_stream(int sock, FILE *file, char *err, size_t err_size) {
+    char buffer[CHUNK_SIZE];
+    frame_hdr hdr;
+    int write_failed = 0;
+    while (recv_frame_hdr(sock, &hdr) == 0) {
+        if (hdr.opcode == OP_END) return write_failed ? -3 : 0;
+        if (hdr.opcode == OP_ERROR) {
+            size_t n = (err && hdr.length < err_size - 1) ? hdr.length : (err ? err_size - 1 : 0);
+            if (recv_all(sock, err, n) < 0) return -1;
+            if (err) err[n] = '\0';
+            return skip_payload(sock, hdr.length - n) < 0 ? -1 : -2;
+        }
+        if (hdr.opcode != OP_DATA) return -1;
+        if (hdr.flags & FLAG_LZ4) {
+            long n = recv_lz4(sock, hdr.length, buffer);
+            if (n == -1) return -1;
+            if (n < 0 || (file && !write_failed && fwrite(buffer, 1, n, file) != (size_t)n)) write_failed = 1;
+            continue;
+        }
+
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t n = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+            if (recv_all(sock, buffer, n) < 0) return -1;
+            if (file && !write_failed && fwrite(buffer, 1, n, file) != n) write_failed = 1;
+            remaining -= n;
+        }
+    }
+    return -1;
+}
+
+
+// Opens another connection to S1; -1 on failure
+int open_connection(void) {
+    struct sockaddr_in serv_addr = {0};
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(S1_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s >= 0 && connect(s, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(s);
+        s = -1;
+    }
+    return s;
+}
 
 void connect_to_server() {
     struct sockaddr_in serv_addr;
@@ -45,20 +333,143 @@ void connect_to_server() {
     debug_print("Connected to S1 successfully\n", 0);
 }
 
+// Whether uploads of this file are worth trying to compress: only if S1 decodes LZ4, and
+// never for .zip, which is compressed already (other data is judged by its first block)
+int compressible(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    return lz4_enabled && !(ext && strcmp(ext, ".zip") == 0);
+}
+
+// Asks S1 which optional protocol features it supports; servers without HELLO support none
+void negotiate(void) {
+    char response[BUFFER_SIZE];
+    frame_hdr hdr;
+    if (send_text(sock, OP_CMD, ++next_req_id, "HELLO lz4 pipeline") < 0 || recv_msg(sock, &hdr, response, sizeof(response)) < 0) {
+        handle_error(errno, "Handshake failed");
+    }
+    lz4_enabled = hdr.opcode == OP_RESP && strstr(response, "lz4") != NULL;
+    pipeline_enabled = hdr.opcode == OP_RESP && strstr(response, "pipeline") != NULL;
+    debug_print("Wire compression %s\n", lz4_enabled ? "enabled" : "not supported by S1");
+}
+
 void send_command(const char* command) {
     debug_print("Sending command: %s\n", command);
-    if (send(sock, command, strlen(command), 0) < 0) {
+    uint16_t flags = lz4_enabled ? FLAG_LZ4 : 0;  // replies may come compressed
+    if (send_frame(sock, OP_CMD, flags, ++next_req_id, command, strlen(command)) < 0) {
         handle_error(errno, "Send failed");
     }
 }
 
-void receive_response(char* buffer, size_t size) {
-    memset(buffer, 0, size);
-    ssize_t bytes_received = recv(sock, buffer, size - 1, 0);
-    if (bytes_received < 0) {
+int receive_response(char* buffer, size_t size) {
+    frame_hdr hdr;
+    if (recv_msg(sock, &hdr, buffer, size) < 0) {
         handle_error(errno, "Receive failed");
     }
     debug_print("Received response: %s\n", buffer);
+    return hdr.opcode;
+}
+
+// A multi-part upload shared by the threads sending its parts
+typedef struct {
+    const char *filename;
+    const char *upload_id;
+    uint64_t size;
+    uint32_t parts, next_part;
+    int failed;
+    char error[BUFFER_SIZE];
+    pthread_mutex_t lock;
+} part_job;
+
+// Sends one part's body as DATA frames followed by END
+int send_part(int s, uint32_t req_id, int fd, uint64_t offset, uint64_t length, int compress) {
+    char buffer[CHUNK_SIZE];
+    while (length > 0) {
+        ssize_t n = pread(fd, buffer, length < CHUNK_SIZE ? length : CHUNK_SIZE, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        if (send_data(s, req_id, buffer, n, &compress) < 0) return -1;
+        offset += n;
+        length -= n;
+    }
+    return send_frame(s, OP_END, 0, req_id, NULL, 0);
+}
+
+void part_failed(part_job *job, const char *error) {
+    pthread_mutex_lock(&job->lock);
+    if (!job->failed) snprintf(job->error, sizeof(job->error), "%s", error);
+    job->failed = 1;
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Thread body: sends parts over its own connection to S1 until none are left
+void *part_worker(void *arg) {
+    part_job *job = arg;
+    int s = open_connection();
+    int fd = open(job->filename, O_RDONLY);
+    if (s < 0) part_failed(job, "ERROR: Could not open an upload connection");
+    if (fd < 0) part_failed(job, "ERROR: File open failed");
+
+    uint32_t req_id = 0;
+    while (s >= 0 && fd >= 0) {
+        pthread_mutex_lock(&job->lock);
+        uint32_t index = job->failed ? job->parts : job->next_part++;
+        pthread_mutex_unlock(&job->lock);
+        if (index >= job->parts) break;
+
+        char command[BUFFER_SIZE], response[BUFFER_SIZE];
+        uint64_t offset = (uint64_t)index * PART_SIZE;
+        uint64_t length = job->size - offset < PART_SIZE ? job->size - offset : PART_SIZE;
+        snprintf(command, sizeof(command), "uploadpart %s %u", job->upload_id, index);
+        frame_hdr hdr;
+        if (send_text(s, OP_CMD, ++req_id, command) < 0 || send_part(s, req_id, fd, offset, length, compressible(job->filename)) < 0 ||
+            recv_msg(s, &hdr, response, sizeof(response)) < 0) {
+            part_failed(job, "ERROR: Connection to S1 lost");
+            break;
+        }
+        if (hdr.opcode != OP_RESP) {
+            part_failed(job, response);
+            break;
+        }
+    }
+    if (fd >= 0) close(fd);
+    if (s >= 0) close(s);
+    return NULL;
+}
+
+// Large files go up as PART_SIZE parts sent concurrently over UPLOAD_STREAMS connections;
+// S1 (or the storage server behind it) writes each part at its offset and only commits the
+// file once all of them have arrived
+void handle_part_upload(const char* filename, const char* dest_path, uint64_t size) {
+    char command[BUFFER_SIZE], response[BUFFER_SIZE], upload_id[64];
+    snprintf(command, BUFFER_SIZE, "uploadp %s %llu %d", dest_path, (unsigned long long)size, PART_SIZE);
+    send_command(command);
+    if (receive_response(response, BUFFER_SIZE) != OP_RESP || sscanf(response, "UPLOAD_ID %63s", upload_id) != 1) {
+        printf("Upload result: %s\n", response);
+        return;
+    }
+
+    part_job job = {.filename = filename, .upload_id = upload_id, .size = size,
+                    .parts = size / PART_SIZE + (size % PART_SIZE != 0), .lock = PTHREAD_MUTEX_INITIALIZER};
+    pthread_t threads[UPLOAD_STREAMS];
+    int started = 0;
+    for (uint32_t i = 0; i < UPLOAD_STREAMS && i < job.parts; i++) {
+        if (pthread_create(&threads[started], NULL, part_worker, &job) != 0) break;
+        started++;
+    }
+    if (started == 0) part_failed(&job, "ERROR: Could not start upload threads");
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    if (job.failed) {
+        snprintf(command, BUFFER_SIZE, "uploadabort %s", upload_id);
+        send_command(command);
+        receive_response(response, BUFFER_SIZE);
+        printf("Upload result: %s\n", job.error);
+        return;
+    }
+    snprintf(command, BUFFER_SIZE, "uploadcommit %s", upload_id);
+    send_command(command);
+    receive_response(response, BUFFER_SIZE);
+    printf("Upload result: %s\n", response);
 }
 
 void handle_upload(const char* filename, const char* dest_path) {
@@ -77,6 +488,11 @@ void handle_upload(const char* filename, const char* dest_path) {
 }
 
 
+    if (st.st_size >= PART_UPLOAD_MIN) {
+        handle_part_upload(filename, dest_path, st.st_size);
+        return;
+    }
+
     char command[BUFFER_SIZE];
     snprintf(command, BUFFER_SIZE, "uploadf %s %s", filename, dest_path);
     send_command(command);
@@ -87,89 +503,110 @@ void handle_upload(const char* filename, const char* dest_path) {
         handle_error(errno, "File open failed");
     }
 
-    char file_buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(file_buffer, 1, BUFFER_SIZE, file)) > 0) {
-        if (send(sock, file_buffer, bytes_read, 0) < 0) {
-            handle_error(errno, "File send failed");
-        }
+    if (send_file_stream(sock, next_req_id, file, compressible(filename)) < 0) {
+        handle_error(errno, "File send failed");
     }
     fclose(file);
-    
-    // Sending end of file marker
-    char eof_marker[] = "EOF_FILE_TRANSFER";
-    send(sock, eof_marker, strlen(eof_marker), 0);
-    
+
     char response[BUFFER_SIZE];
     receive_response(response, BUFFER_SIZE);
     printf("Upload result: %s\n", response);
 }
 
 void handle_download(const char* remote_path) {
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "downlf %s", remote_path);
+    // Ask for the server's size and mtime first: a partial download of the same version is
+    // resumed from where it stopped instead of being fetched again from byte 0
+    char command[BUFFER_SIZE], response[BUFFER_SIZE];
+    snprintf(command, BUFFER_SIZE, "statf %s", remote_path);
     send_command(command);
+    if (receive_response(response, BUFFER_SIZE) != OP_RESP) {
+        printf("Download failed: %s\n", response);
+        return;
+    }
+    unsigned long long size = 0;
+    long long mtime = 0;
+    sscanf(response, "SIZE %llu MTIME %lld", &size, &mtime);
 
     const char* filename = strrchr(remote_path, '/');
     filename = filename ? filename + 1 : remote_path;
 
     mkdir("downloads", 0777);  // ensure folder exists
-    char full_path[BUFFER_SIZE];
+    char full_path[BUFFER_SIZE], marker_path[BUFFER_SIZE];
     snprintf(full_path, BUFFER_SIZE, "downloads/%s", filename);
+    snprintf(marker_path, BUFFER_SIZE, "downloads/.%s.part", filename);
 
-    FILE* file = fopen(full_path, "wb");
-    if (!file) {
-        handle_error(errno, "File creation failed");
+    // The marker records which version full_path is a prefix of while a download is in progress
+    unsigned long long offset = 0, marked_size;
+    long long marked_mtime;
+    struct stat st;
+    FILE* marker = fopen(marker_path, "r");
+    if (marker) {
+        if (fscanf(marker, "%llu %lld", &marked_size, &marked_mtime) == 2 && marked_size == size &&
+            marked_mtime == mtime && stat(full_path, &st) == 0 && (unsigned long long)st.st_size <= size)
+            offset = st.st_size;
+        fclose(marker);
+    }
+    if (offset == 0 && (marker = fopen(marker_path, "w"))) {
+        fprintf(marker, "%llu %lld\n", size, mtime);
+        fclose(marker);
     }
+    if (offset > 0) printf("Resuming %s at byte %llu of %llu\n", full_path, offset, size);
 
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-    int eof_received = 0;
-
-    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        char* eof_marker = strstr(buffer, "EOF_FILE_TRANSFER");
-        if (eof_marker) {
-            size_t valid_bytes = eof_marker - buffer;
-            if (valid_bytes > 0) {
-                fwrite(buffer, 1, valid_bytes, file);
-            }
-            eof_received = 1;
-            break;
-        }
-        fwrite(buffer, 1, bytes_received, file);
+    snprintf(command, BUFFER_SIZE, "downlf %s %llu", remote_path, offset);
+    send_command(command);
+
+    FILE* file = fopen(full_path, offset > 0 ? "ab" : "wb");
+    if (!file) {
+        handle_error(errno, "File creation failed");
     }
 
+    char err[BUFFER_SIZE];
+    int rc = recv_file_stream(sock, file, err, sizeof(err));
     fclose(file);
 
-    if (eof_received) {
+    if (rc == 0) {
+        remove(marker_path);
         printf("File downloaded successfully as %s\n", full_path);
+    } else if (rc == -2) {
+        remove(full_path);
+        remove(marker_path);
+        printf("Download failed: %s\n", err);
+    } else if (rc == -3) {
+        printf("Download failed: could not write %s\n", full_path);
     } else {
-        printf("Download failed: Did not receive EOF marker.\n");
+        handle_error(errno, "Connection to S1 lost");
     }
 }
 
-void handle_remove(const char* remote_path) {
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "removef %s", remote_path);
-    send_command(command);
-    
-    char response[BUFFER_SIZE];
-    receive_response(response, BUFFER_SIZE);
-    printf("Remove operation result: %s\n", response);
+// Removes each of `paths`. With pipelining up to PIPELINE_WINDOW removefs are in flight at
+// once; replies may arrive in any order and are matched to their paths by req_id.
+void handle_remove(char **paths, int count) {
+    uint32_t first = next_req_id + 1;
+    int window = pipeline_enabled ? PIPELINE_WINDOW : 1;
+    int sent = 0, done = 0;
+    while (done < count) {
+        char command[BUFFER_SIZE], response[BUFFER_SIZE];
+        for (; sent < count && sent - done < window; sent++) {
+            snprintf(command, BUFFER_SIZE, "removef %s", paths[sent]);
+            send_command(command);
+        }
+
+        frame_hdr hdr;
+        if (recv_msg(sock, &hdr, response, sizeof(response)) < 0) {
+            handle_error(errno, "Receive failed");
+        }
+        uint32_t i = hdr.req_id - first;
+        if (i >= (uint32_t)sent) continue;
+        if (count == 1) printf("Remove operation result: %s\n", response);
+        else printf("Remove %s: %s\n", paths[i], response);
+        done++;
+    }
 }
 
 void handle_downltar(const char* filetype) {
     char command[BUFFER_SIZE];
     snprintf(command, BUFFER_SIZE, "downltar %s", filetype);
     send_command(command);
-    
-    char response[BUFFER_SIZE];
-    receive_response(response, BUFFER_SIZE);
-    
-    if (strncmp(response, "ERROR", 5) == 0) {
-        printf("Tar creation failed: %s\n", response);
-        return;
-    }
 
     char tar_filename[BUFFER_SIZE];
     snprintf(tar_filename, BUFFER_SIZE, "%sfiles.tar", filetype);
@@ -179,35 +616,189 @@ void handle_downltar(const char* filetype) {
         handle_error(errno, "Tar file creation failed");
     }
 
-    char file_buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-    while (bytes_received = recv(sock, file_buffer, BUFFER_SIZE, 0)) {
-        if (strstr(file_buffer, "EOF_FILE_TRANSFER")) break;
-        fwrite(file_buffer, 1, bytes_received, file);
-    }
-    
+    char err[BUFFER_SIZE];
+    int rc = recv_file_stream(sock, file, err, sizeof(err));
     fclose(file);
+
+    if (rc == -2) {
+        remove(tar_filename);
+        printf("Tar creation failed: %s\n", err);
+        return;
+    }
+    if (rc == -1) {
+        handle_error(errno, "Connection to S1 lost");
+    }
     printf("Tar archive downloaded as %s\n", tar_filename);
 }
 
+// Prints a text reply of any size as it arrives, after `heading`, or the error it carries
+void print_text_reply(const char *heading, const char *failure) {
+    frame_hdr hdr;
+    if (recv_frame_hdr(sock, &hdr) < 0) {
+        handle_error(errno, "Receive failed");
+    }
+    if (hdr.opcode != OP_RESP) {
+        char response[BUFFER_SIZE] = "";
+        size_t n = hdr.length < BUFFER_SIZE - 1 ? hdr.length : BUFFER_SIZE - 1;
+        if (recv_all(sock, response, n) < 0 || skip_payload(sock, hdr.length - n) < 0) {
+            handle_error(errno, "Receive failed");
+        }
+        response[n] = '\0';
+        printf("%s: %s\n", failure, response);
+        return;
+    }
+
+    if (heading) printf("%s\n", heading);
+    char chunk[BUFFER_SIZE];
+    for (uint64_t left = hdr.length; left > 0; ) {
+        size_t n = left < sizeof(chunk) ? left : sizeof(chunk);
+        if (recv_all(sock, chunk, n) < 0) {
+            handle_error(errno, "Receive failed");
+        }
+        fwrite(chunk, 1, n, stdout);
+        left -= n;
+    }
+    printf("\n");
+}
+
 void handle_dispfnames(const char* pathname) {
     char command[BUFFER_SIZE];
     snprintf(command, BUFFER_SIZE, "dispfnames %s", pathname);
     send_command(command);
 
+    char heading[BUFFER_SIZE];
+    snprintf(heading, sizeof(heading), "Files in %s:", pathname);
+    print_text_reply(heading, "Directory listing failed");
+}
+
+// Metrics of S1, or of the storage server named by `server`, in Prometheus text format
+void handle_stats(const char *server) {
+    char command[BUFFER_SIZE];
+    if (server) snprintf(command, BUFFER_SIZE, "stats %s", server);
+    else snprintf(command, BUFFER_SIZE, "stats");
+    send_command(command);
+    print_text_reply(NULL, "Stats request failed");
+}
+
+// Prints the counters of S1's hot-object cache
+void handle_cachestats(void) {
+    send_command("cachestats");
+    print_text_reply(NULL, "Cache stats request failed");
+}
+
+// Has S1 re-read its shard list and move files onto the shards that now own them
+void handle_rebalance(void) {
+    send_command("rebalance");
     char response[BUFFER_SIZE];
     receive_response(response, BUFFER_SIZE);
-    
-    if (strncmp(response, "ERROR", 5) == 0) {
-        printf("Directory listing failed: %s\n", response);
-        return;
+    printf("Rebalance result: %s\n", response);
+}
+
+// Has S1 bring every file back to its full replica count right away instead of at the next
+// periodic repair pass
+void handle_repair(void) {
+    send_command("repair");
+    char response[BUFFER_SIZE];
+    receive_response(response, BUFFER_SIZE);
+    printf("Repair result: %s\n", response);
+}
+
+// Uploads every file matching `patterns` into dest_dir with a single uploadb: each file goes
+// out as a command frame naming its destination followed by its body, and S1 replies once
+// for the whole batch
+void handle_batch_upload(const char *dest_dir, char **patterns, int count) {
+    glob_t matches;
+    int flags = 0;
+    for (int i = 0; i < count; i++) {
+        if (glob(patterns[i], flags | GLOB_NOCHECK, NULL, &matches) != 0) {
+            fprintf(stderr, "Error: Cannot expand '%s'\n", patterns[i]);
+            if (flags) globfree(&matches);
+            return;
+        }
+        flags = GLOB_APPEND;
     }
 
-    printf("Files in %s:\n%s\n", pathname, response);
+    send_command("uploadb");
+    uint32_t req_id = next_req_id;
+    for (size_t i = 0; i < matches.gl_pathc; i++) {
+        const char *filename = matches.gl_pathv[i];
+        const char *ext = strrchr(filename, '.');
+        struct stat st;
+        FILE *file = NULL;
+        if (!ext || (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 &&
+                     strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0))
+            fprintf(stderr, "Skipping %s: invalid file extension\n", filename);
+        else if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode) || !(file = fopen(filename, "rb")))
+            fprintf(stderr, "Skipping %s: not a readable file\n", filename);
+        if (!file) continue;
+
+        const char *base = strrchr(filename, '/');
+        char dest[BUFFER_SIZE];
+        snprintf(dest, sizeof(dest), "%s/%s", dest_dir, base ? base + 1 : filename);
+        if (send_text(sock, OP_CMD, req_id, dest) < 0 || send_file_stream(sock, req_id, file, compressible(filename)) < 0) {
+            handle_error(errno, "File send failed");
+        }
+        fclose(file);
+    }
+    globfree(&matches);
+    if (send_frame(sock, OP_END, 0, req_id, NULL, 0) < 0) {
+        handle_error(errno, "Send failed");
+    }
+    print_text_reply("Batch upload result:", "Batch upload failed");
+}
+
+// Downloads all of `paths` into downloads/ with a single downlb: S1 answers with each file in
+// turn, a frame naming it followed by its contents or its error
+void handle_batch_download(char **paths, int count) {
+    send_command("downlb");
+    uint32_t req_id = next_req_id;
+    for (int i = 0; i < count; i++) {
+        if (send_text(sock, OP_CMD, req_id, paths[i]) < 0) {
+            handle_error(errno, "Send failed");
+        }
+    }
+    if (send_frame(sock, OP_END, 0, req_id, NULL, 0) < 0) {
+        handle_error(errno, "Send failed");
+    }
+
+    mkdir("downloads", 0777);
+    int ok = 0, failed = 0;
+    while (1) {
+        char remote_path[BUFFER_SIZE];
+        frame_hdr hdr;
+        if (recv_msg(sock, &hdr, remote_path, sizeof(remote_path)) < 0) {
+            handle_error(errno, "Connection to S1 lost");
+        }
+        if (hdr.opcode == OP_END) break;
+        if (hdr.opcode != OP_RESP) {
+            printf("Batch download failed: %s\n", remote_path);
+            return;
+        }
+
+        const char *filename = strrchr(remote_path, '/');
+        char full_path[BUFFER_SIZE], err[BUFFER_SIZE];
+        snprintf(full_path, BUFFER_SIZE, "downloads/%s", filename ? filename + 1 : remote_path);
+        FILE *file = fopen(full_path, "wb");
+        int rc = recv_file_stream(sock, file, err, sizeof(err));
+        if (file) fclose(file);
+        if (rc == -1) {
+            handle_error(errno, "Connection to S1 lost");
+        }
+        if (rc == 0 && file) {
+            printf("%s -> %s\n", remote_path, full_path);
+            ok++;
+            continue;
+        }
+        if (file) remove(full_path);
+        printf("%s: %s\n", remote_path, rc == -2 ? err : "could not write file");
+        failed++;
+    }
+    printf("Batch download: %d downloaded, %d failed\n", ok, failed);
 }
 
 int main() {
     connect_to_server();
+    negotiate();
 
     while(1) {
         printf("w25client$ ");
@@ -237,18 +828,41 @@ int main() {
             }
             handle_download(remote_path);
         }
+        else if (strcmp(cmd, "uploadb") == 0) {
+            char *dest_dir = strtok(NULL, " ");
+            char *patterns[BUFFER_SIZE / 2];
+            int count = 0;
+            while ((patterns[count] = strtok(NULL, " "))) count++;
+            if (!dest_dir || count == 0) {
+                fprintf(stderr, "Invalid syntax. Usage: uploadb destination_dir file [file ...]\n");
+                continue;
+            }
+            handle_batch_upload(dest_dir, patterns, count);
+        }
+        else if (strcmp(cmd, "downlb") == 0) {
+            char *paths[BUFFER_SIZE / 2];
+            int count = 0;
+            while ((paths[count] = strtok(NULL, " "))) count++;
+            if (count == 0) {
+                fprintf(stderr, "Invalid syntax. Usage: downlb remote_path [remote_path ...]\n");
+                continue;
+            }
+            handle_batch_download(paths, count);
+        }
         else if (strcmp(cmd, "removef") == 0) {
-            char *remote_path = strtok(NULL, " ");
-            if (!remote_path) {
-                fprintf(stderr, "Invalid syntax. Usage: removef remote_path\n");
+            char *paths[BUFFER_SIZE / 2];
+            int count = 0;
+            while ((paths[count] = strtok(NULL, " "))) count++;
+            if (count == 0) {
+                fprintf(stderr, "Invalid syntax. Usage: removef remote_path [remote_path ...]\n");
                 continue;
             }
-            handle_remove(remote_path);
+            handle_remove(paths, count);
         }
         else if (strcmp(cmd, "downltar") == 0) {
             char *filetype = strtok(NULL, " ");
             if (!filetype) {
-                fprintf(stderr, "Invalid syntax. Usage: downltar filetype\n");
+                fprintf(stderr, "Invalid syntax. Usage: downltar filetype|all\n");
                 continue;
             }
             handle_downltar(filetype);
@@ -261,12 +875,24 @@ int main() {
             }
             handle_dispfnames(pathname);
         }
+        else if (strcmp(cmd, "stats") == 0) {
+            handle_stats(strtok(NULL, " "));
+        }
+        else if (strcmp(cmd, "cachestats") == 0) {
+            handle_cachestats();
+        }
+        else if (strcmp(cmd, "rebalance") == 0) {
+            handle_rebalance();
+        }
+        else if (strcmp(cmd, "repair") == 0) {
+            handle_repair();
+        }
         else if (strcmp(cmd, "exit") == 0) {
             break;
         }
         else {
             fprintf(stderr, "Invalid command. Available commands:\n");
-            fprintf(stderr, "uploadf, downlf, removef, downltar, dispfnames, exit\n");
+            fprintf(stderr, "uploadf, uploadb, downlf, downlb, removef, downltar, dispfnames, stats, cachestats, rebalance, repair, exit\n");
         }
     }
 
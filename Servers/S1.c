@@ -1,27 +1,57 @@
 // All includes and definitions
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <libgen.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <search.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <endian.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <time.h>
 
 #define PORT 7040
 #define S2_PORT 7041
 #define S3_PORT 7042
 #define S4_PORT 7043
 #define BUFFER_SIZE 4096
+#define CHUNK_SIZE 65536
 #define DEBUG 1
+#define ZERO_COPY 1
 #define BASE_DIR_NAME "S1"
+#define TAR_TYPE ".c" // the type S1 archives from its own store
+#define RELAY_PIPE_SIZE (1024 * 1024)
+#define POOL_SIZE 16             // idle connections kept per storage server
+#define POOL_PING_IDLE_SECS 30   // connections idle longer than this are PINGed before reuse
+#define MAX_CONNECTIONS 10000     // default limit on concurrently open client connections
+#define WORKER_THREADS 16         // default number of threads executing client commands
+#define MAX_EVENTS 256
+#define CLIENT_IO_TIMEOUT_SECS 60 // a stalled client can hold a worker at most this long per call
+#define CACHE_BYTES (256UL * 1024 * 1024) // default memory for the hot-object cache (see cache_lookup)
 char base_dir[256];
 
+typedef struct {
+    unsigned long long zero_copy_bytes;
+    unsigned long long copied_bytes;
+} relay_counters;
+relay_counters relay_stats;
+
 #define debug_print(fmt, ...) \
     do { if (DEBUG) fprintf(stderr, "[S1 DEBUG] %s:%d:%s(): " fmt, __FILE__, __LINE__, __func__, ##__VA_ARGS__); } while (0)
 
@@ -30,15 +60,133 @@ char base_dir[256];
 
 typedef enum {PDF, TXT, ZIP, C_FILE} file_type;
 
+// Wire protocol: every message is a 16-byte header followed by `length` payload bytes.
+// Header (network byte order): version(1) opcode(1) flags(2) req_id(4) length(8)
+#define PROTO_VERSION 1
+#define FRAME_HDR_SIZE 16
+
+typedef enum {OP_CMD = 1, OP_RESP, OP_ERROR, OP_DATA, OP_END} frame_op;
+
+// DATA frame flag: this frame completes one archive entry (see send_tar_stream)
+#define FLAG_ENTRY_END 0x0001
+// DATA frame flag: the payload is LZ4-compressed; on a command: the reply may be (see send_data)
+#define FLAG_LZ4 0x0002
+
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint32_t req_id;
+    uint64_t length;
+} frame_hdr;
+
 // Function declarations
-void prcclient(int client_sock);
+int process_command(int client_sock, uint32_t req_id, uint16_t flags, char *buffer);
+int handle_uploadf(int client_sock, uint32_t req_id, const char *filename, const char *dest_path);
 file_type get_file_type(const char *filename);
 void create_directory(const char *path);
-void forward_file(const char *filename, const char *dest_path, file_type type);
-void handle_downlf(int client_sock, const char *filepath);
-void handle_removef(int client_sock, const char *filepath);
-void handle_downltar(int client_sock, const char *filetype);
-void handle_dispfnames(int client_sock, const char *dirpath);
+void tar_cache_note(const char *path);
+int forward_file(int client_sock, uint32_t req_id, const char *rel_path, file_type type);
+void handle_downlf(int client_sock, uint32_t req_id, const char *filepath, const char *offset_arg, const char *length_arg, int compress);
+void handle_statf(int client_sock, uint32_t req_id, const char *filepath);
+void handle_removef(int client_sock, uint32_t req_id, const char *filepath);
+void handle_downltar(int client_sock, uint32_t req_id, const char *filetype);
+void handle_dispfnames(int client_sock, uint32_t req_id, const char *dirpath);
+void handle_stats(int client_sock, uint32_t req_id, const char *server);
+
+// Metrics: counters are bumped with relaxed atomics on the hot path and never take a lock.
+// Command latencies go into log-linear (HDR-style) histograms: every power of two of
+// microseconds is split into METRIC_SUB_BUCKETS linear buckets, so a quantile read back from
+// the histogram is within ~6% of the true value anywhere from 1 us to hours. The totals are
+// exposed by the stats command and as Prometheus text on 127.0.0.1:METRICS_PORT.
+#define METRICS_PORT 7140                            // S2-S4 listen on 7141-7143
+#define METRIC_SUB_BITS 4
+#define METRIC_SUB_BUCKETS (1 << METRIC_SUB_BITS)
+#define METRIC_BUCKETS (33 * METRIC_SUB_BUCKETS)     // latencies up to 2^36 us (~19 h)
+
+typedef struct {
+    const char *name;
+    unsigned long long count, errors, sum_us, max_us;
+    unsigned long long buckets[METRIC_BUCKETS];
+} command_metric;
+
+command_metric command_metrics[] = {
+    { .name = "uploadf" }, { .name = "uploadpart" }, { .name = "uploadb" }, { .name = "downlf" },
+    { .name = "downlb" }, { .name = "statf" }, { .name = "removef" }, { .name = "downltar" },
+    { .name = "dispfnames" },
+};
+
+struct {
+    unsigned long long bytes_in, bytes_out;   // on every socket, client and backend alike
+    unsigned long long backend_errors;        // failed connects or handshakes to S2/S3/S4
+    unsigned long long hedged_reads;          // downloads also sent to a second replica (see replica_retrieve)
+    unsigned long long repair_copies;         // replicas brought up to date by shard_reconcile
+    unsigned long long journal_commits, journal_files;
+    unsigned long long tar_hits, tar_updates, tar_rebuilds;  // see tar_cache_get()
+} metrics;
+
+__thread int command_failed;  // set when the command running on this thread replies with an error
+
+// The client socket of the command running on this thread. Pipelined commands share it, so
+// a reply takes the connection's reply_lock with its first frame and keeps it until the
+// command ends (see worker_main); frames of different replies never interleave.
+__thread int reply_fd = -1;
+__thread pthread_mutex_t *reply_lock;
+__thread int reply_locked;
+
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int metric_bucket(uint64_t us) {
+    if (us < METRIC_SUB_BUCKETS) return us;
+    int e = 63 - __builtin_clzll(us);
+    int b = (e - METRIC_SUB_BITS + 1) * METRIC_SUB_BUCKETS + (int)((us >> (e - METRIC_SUB_BITS)) & (METRIC_SUB_BUCKETS - 1));
+    return b < METRIC_BUCKETS ? b : METRIC_BUCKETS - 1;
+}
+
+// Smallest latency above bucket `b`
+uint64_t metric_bucket_limit(int b) {
+    if (b < METRIC_SUB_BUCKETS) return b + 1;
+    return (uint64_t)(METRIC_SUB_BUCKETS + b % METRIC_SUB_BUCKETS + 1) << (b / METRIC_SUB_BUCKETS - 1);
+}
+
+// The histogram for a command line, looked up by its first word; NULL for untracked commands
+command_metric *metric_for(const char *command) {
+    size_t len = strcspn(command, " ");
+    for (size_t i = 0; i < sizeof(command_metrics) / sizeof(command_metrics[0]); i++)
+        if (strlen(command_metrics[i].name) == len && strncmp(command_metrics[i].name, command, len) == 0)
+            return &command_metrics[i];
+    return NULL;
+}
+
+void metric_record(command_metric *m, uint64_t started_us, int failed) {
+    if (!m) return;
+    uint64_t us = now_us() - started_us;
+    __atomic_add_fetch(&m->count, 1, __ATOMIC_RELAXED);
+    if (failed) __atomic_add_fetch(&m->errors, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->buckets[metric_bucket(us)], 1, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&m->max_us, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&m->max_us, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Upper bound of the q-quantile latency, in microseconds
+uint64_t metric_quantile(const command_metric *m, double q) {
+    unsigned long long counts[METRIC_BUCKETS], total = 0;
+    for (int b = 0; b < METRIC_BUCKETS; b++) total += counts[b] = __atomic_load_n(&m->buckets[b], __ATOMIC_RELAXED);
+    if (total == 0) return 0;
+    unsigned long long rank = (unsigned long long)(q * total + 0.5), seen = 0;
+    if (rank == 0) rank = 1;
+    uint64_t max = __atomic_load_n(&m->max_us, __ATOMIC_RELAXED);
+    for (int b = 0; b < METRIC_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen >= rank) return metric_bucket_limit(b) - 1 < max ? metric_bucket_limit(b) - 1 : max;
+    }
+    return max;
+}
 
 // Utility functions
 char* expand_path(const char* path) {
@@ -53,330 +201,4136 @@ char* expand_path(const char* path) {
     return strdup(path);
 }
 
-// void create_directory(const char *path) {
-//     struct stat st;
-//     if (stat(path, &st) == 0) return;
-//     if (mkdir(path, 0777) == -1 && errno != EEXIST) handle_error(errno, "mkdir failed");
-// }
-void create_directory(const char *path) {
-    char tmp[256];
-    snprintf(tmp, sizeof(tmp), "%s", path);
+// Frame I/O helpers
+int send_all(int sock, const void *buf, size_t len, int flags) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, flags | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n; len -= n;
+        __atomic_add_fetch(&metrics.bytes_out, n, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
 
-    char *p = tmp;
-    while (*p == '/') p++;  // Skip leading slashes
+int recv_all(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; len -= n;
+        __atomic_add_fetch(&metrics.bytes_in, n, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
 
-    for (; *p; p++) {
-        if (*p == '/') {
-            *p = '\0';
-            mkdir(tmp, 0777);
-            *p = '/';
-        }
+int send_frame_hdr(int sock, uint8_t opcode, uint16_t flags, uint32_t req_id, uint64_t length) {
+    unsigned char hdr[FRAME_HDR_SIZE];
+    uint16_t f = htons(flags);
+    uint32_t id = htonl(req_id);
+    uint64_t len = htobe64(length);
+    hdr[0] = PROTO_VERSION; hdr[1] = opcode;
+    memcpy(hdr + 2, &f, 2); memcpy(hdr + 4, &id, 4); memcpy(hdr + 8, &len, 8);
+    if (opcode == OP_ERROR) command_failed = 1;
+    if (sock == reply_fd && !reply_locked) {
+        pthread_mutex_lock(reply_lock);
+        reply_locked = 1;
     }
-    mkdir(tmp, 0777);
+    return send_all(sock, hdr, FRAME_HDR_SIZE, length ? MSG_MORE : 0);
 }
 
-file_type get_file_type(const char *filename){
-    const char *ext = strrchr(filename, '.');
-    if (!ext) return C_FILE;
-    if (strcmp(ext, ".pdf") == 0) return PDF;
-    if (strcmp(ext, ".txt") == 0) return TXT;
-    if (strcmp(ext, ".zip") == 0) return ZIP;
-    return C_FILE;
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint32_t req_id, const void *payload, uint64_t length) {
+    if (send_frame_hdr(sock, opcode, flags, req_id, length) < 0) return -1;
+    return length ? send_all(sock, payload, length, 0) : 0;
 }
 
-void send_command_to_storage(int sock, const char *command) {
-    send(sock, command, strlen(command), 0);
-    char ack[10]; recv(sock, ack, sizeof(ack), 0);
+int send_text(int sock, uint8_t opcode, uint32_t req_id, const char *text) {
+    return send_frame(sock, opcode, 0, req_id, text, strlen(text));
 }
 
-void forward_file(const char *filename, const char *dest_path, file_type type){
-    int port = (type == PDF) ? S2_PORT : (type == TXT) ? S3_PORT : S4_PORT;
+int decode_frame_hdr(const unsigned char *raw, frame_hdr *hdr) {
+    uint16_t f; uint32_t id; uint64_t len;
+    memcpy(&f, raw + 2, 2); memcpy(&id, raw + 4, 4); memcpy(&len, raw + 8, 8);
+    hdr->version = raw[0]; hdr->opcode = raw[1];
+    hdr->flags = ntohs(f); hdr->req_id = ntohl(id); hdr->length = be64toh(len);
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in serv_addr = { .sin_family = AF_INET, .sin_port = htons(port) };
-    inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
-    connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+    if (hdr->version != PROTO_VERSION) {
+        debug_print("Unsupported protocol version %u\n", hdr->version);
+        return -1;
+    }
+    return 0;
+}
 
-    char *dc1 = expand_path(dest_path), *dc2 = expand_path(dest_path);
-    char *file_part = basename(dc1), *dir_part = dirname(dc2);
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "STORE %s %s", dir_part, file_part);
-    send_command_to_storage(sock, command);
+int recv_frame_hdr(int sock, frame_hdr *hdr) {
+    unsigned char raw[FRAME_HDR_SIZE];
+    if (recv_all(sock, raw, FRAME_HDR_SIZE) < 0) return -1;
+    return decode_frame_hdr(raw, hdr);
+}
 
-    FILE *file = fopen(filename, "rb");
+// Discards `length` payload bytes that the caller has no use for
+int skip_payload(int sock, uint64_t length) {
     char buffer[BUFFER_SIZE];
-    size_t bytes;
-    while ((bytes = fread(buffer, 1, BUFFER_SIZE, file)) > 0) send(sock, buffer, bytes, 0);
-    send(sock, "EOF_FILE_TRANSFER", 17, 0);
+    while (length > 0) {
+        size_t n = length < BUFFER_SIZE ? length : BUFFER_SIZE;
+        if (recv_all(sock, buffer, n) < 0) return -1;
+        length -= n;
+    }
+    return 0;
+}
 
-    fclose(file); close(sock); free(dc1); free(dc2);
+// Reads one frame and stores its payload as a NUL-terminated string (truncated to fit)
+int recv_msg(int sock, frame_hdr *hdr, char *buf, size_t size) {
+    if (recv_frame_hdr(sock, hdr) < 0) return -1;
+    size_t n = hdr->length < size - 1 ? hdr->length : size - 1;
+    if (recv_all(sock, buf, n) < 0) return -1;
+    buf[n] = '\0';
+    return skip_payload(sock, hdr->length - n);
 }
 
-// Command Handlers
-void handle_downlf(int client_sock, const char *filepath) {
-    if (!filepath) { send(client_sock, "ERROR: Invalid syntax", 22, 0); return; }
+// Wire compression: a DATA frame flagged FLAG_LZ4 carries a 4-byte raw length followed by
+// one LZ4 block (the standard block format) of at most LZ4_BLOCK raw bytes. Peers learn
+// whether the other side decodes these with a HELLO exchange, and a command frame flagged
+// FLAG_LZ4 tells the receiver it may compress the DATA frames of its reply.
+#define LZ4_BLOCK 65536      // raw bytes per compressed frame; positions must fit in 16 bits
+#define LZ4_HASH_LOG 12
 
-    char path[BUFFER_SIZE];
-    strncpy(path, filepath, BUFFER_SIZE);
-    if (strncmp(path, "~S1/", 4) == 0) memmove(path, path + 4, strlen(path) - 3);
+size_t lz4_put_length(unsigned char *op, size_t len) {
+    size_t n = 0;
+    for (; len >= 255; len -= 255) op[n++] = 255;
+    op[n++] = len;
+    return n;
+}
 
-    file_type type = get_file_type(path);
-    char full_path[BUFFER_SIZE]; snprintf(full_path, BUFFER_SIZE, "%s/%s", base_dir, path);
+// Compresses n <= LZ4_BLOCK bytes into dst; returns 0 if the result would not fit in cap
+size_t lz4_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    uint16_t table[1 << LZ4_HASH_LOG] = {0};
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
 
-    if (type == C_FILE) {
-        FILE *file = fopen(full_path, "rb");
-        if (!file) { send(client_sock, "ERROR: File not found", 22, 0); return; }
-
-        char buffer[BUFFER_SIZE];
-        size_t bytes;
-        while ((bytes = fread(buffer, 1, BUFFER_SIZE, file)) > 0) send(client_sock, buffer, bytes, 0);
-        send(client_sock, "EOF_FILE_TRANSFER", 17, 0);
-        fclose(file);
-    } else {
-        int port = (type == PDF) ? S2_PORT : (type == TXT) ? S3_PORT : S4_PORT;
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(port) };
-        inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
-        connect(sock, (struct sockaddr*)&sa, sizeof(sa));
+    // The format requires the last 5 bytes to be literals and no match to start in the last 12
+    while (n > 12 && ip < end - 12) {
+        uint32_t seq, cand;
+        memcpy(&seq, ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+        const unsigned char *ref = src + table[h];
+        table[h] = ip - src;
+        memcpy(&cand, ref, 4);
+        if (ref >= ip || cand != seq) { ip++; continue; }
 
-        char command[BUFFER_SIZE]; snprintf(command, BUFFER_SIZE, "RETRIEVE %s", path);
-        send(sock, command, strlen(command), 0);
+        const unsigned char *mend = ip + 4;
+        while (mend < end - 5 && *mend == ref[mend - ip]) mend++;
+        size_t lit = ip - anchor, mlen = mend - ip - 4;
+        if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return 0;
+        unsigned char *token = op++;
+        *token = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+        if (lit >= 15) op += lz4_put_length(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        if (mlen >= 15) op += lz4_put_length(op, mlen - 15);
+        ip = anchor = mend;
+    }
+
+    size_t lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op += lz4_put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    return op + lit - dst;
+}
 
-        char buffer[BUFFER_SIZE]; ssize_t r;
-        while ((r = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-            send(client_sock, buffer, r, 0);
-            if (strstr(buffer, "EOF_FILE_TRANSFER")) break;
+// Decodes one block into dst; returns the decoded size, or -1 if the block is malformed
+// or decodes to more than cap bytes
+long lz4_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, mlen = token & 15;
+        if (lit == 15) {
+            unsigned b;
+            do { if (ip >= iend) return -1; b = *ip++; lit += b; } while (b == 255);
         }
-        close(sock);
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;  // the last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        if (mlen == 15) {
+            unsigned b;
+            do { if (ip >= iend) return -1; b = *ip++; mlen += b; } while (b == 255);
+        }
+        mlen += 4;
+        if ((size_t)(oend - op) < mlen) return -1;
+        for (const unsigned char *ref = op - offset; mlen > 0; mlen--) *op++ = *ref++;  // may overlap
     }
+    return op - dst;
 }
 
-void handle_removef(int client_sock, const char *filepath) {
-    if (!filepath) { send(client_sock, "ERROR: Invalid syntax", 22, 0); return; }
+// Sends one DATA frame of at most LZ4_BLOCK bytes, compressed if *compress is set and the
+// block shrinks by at least 1/8. The first block that does not clears *compress, so data
+// that is already compressed costs a single trial.
+int send_data(int sock, uint32_t req_id, const void *data, size_t n, int *compress) {
+    if (*compress && n > 0) {
+        unsigned char out[4 + LZ4_BLOCK];
+        size_t c = lz4_compress(data, n, out + 4, n - n / 8);
+        if (c > 0) {
+            uint32_t raw = htonl(n);
+            memcpy(out, &raw, 4);
+            return send_frame(sock, OP_DATA, FLAG_LZ4, req_id, out, c + 4);
+        }
+        *compress = 0;
+    }
+    return send_frame(sock, OP_DATA, 0, req_id, data, n);
+}
 
-    char path[BUFFER_SIZE];
-    strncpy(path, filepath, BUFFER_SIZE);
-    if (strncmp(path, "~S1/", 4) == 0) memmove(path, path + 4, strlen(path) - 3);
+// Decodes the payload of a FLAG_LZ4 DATA frame (raw length, then the block) into out
+// (LZ4_BLOCK bytes). Returns the raw length, or -2 if the block was corrupt.
+long lz4_unframe(const unsigned char *in, uint64_t length, void *out) {
+    uint32_t raw;
+    if (length < 4) return -2;
+    memcpy(&raw, in, 4);
+    raw = ntohl(raw);
+    if (raw > LZ4_BLOCK || lz4_decompress(in + 4, length - 4, out, raw) != (long)raw) return -2;
+    return raw;
+}
 
-    file_type type = get_file_type(path);
-    char full_path[BUFFER_SIZE]; snprintf(full_path, BUFFER_SIZE, "%s/%s", base_dir, path);
+// Reads the payload of a FLAG_LZ4 DATA frame and decodes it into out (LZ4_BLOCK bytes).
+// Returns the raw length, -1 if the connection failed and -2 if the block was corrupt.
+long recv_lz4(int sock, uint64_t length, void *out) {
+    unsigned char in[4 + LZ4_BLOCK];
+    if (length < 4 || length > sizeof(in)) return skip_payload(sock, length) < 0 ? -1 : -2;
+    if (recv_all(sock, in, length) < 0) return -1;
+    return lz4_unframe(in, length, out);
+}
 
-    if (type == C_FILE) {
-        if (remove(full_path) == 0) send(client_sock, "REMOVE_SUCCESS", 14, 0);
-        else send(client_sock, "ERROR: Deletion failed", 23, 0);
-    } else {
-        int port = (type == PDF) ? S2_PORT : (type == TXT) ? S3_PORT : S4_PORT;
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(port) };
-        inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
-        connect(sock, (struct sockaddr*)&sa, sizeof(sa));
+// Sends `length` bytes (all if negative) of an open file from `offset`, followed by END.
+// With `compress` the leading blocks go out as LZ4 frames while they keep shrinking; the
+// rest is one raw DATA frame, sent straight from the page cache with sendfile() under
+// ZERO_COPY, or with pread()+send() when that is disabled or unsupported for this fd.
+int send_file_zero_copy(int sock, uint32_t req_id, int fd, uint64_t offset, int64_t length, int compress) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        send_text(sock, OP_ERROR, req_id, "ERROR: Not a regular file");
+        return -1;
+    }
+    uint64_t size = st.st_size;
+    if (offset > size) {
+        send_text(sock, OP_ERROR, req_id, "ERROR: Invalid range");
+        return -1;
+    }
+    uint64_t count = length < 0 || (uint64_t)length > size - offset ? size - offset : (uint64_t)length;
+    char buffer[CHUNK_SIZE];
+    off_t pos = offset, end = offset + count;
+    // Compressed frames while the data keeps shrinking, then the rest as one raw frame
+    while (compress && pos < end) {
+        ssize_t n = pread(fd, buffer, end - pos < LZ4_BLOCK ? end - pos : LZ4_BLOCK, pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || send_data(sock, req_id, buffer, n, &compress) < 0) {
+            shutdown(sock, SHUT_RDWR);
+            return -1;
+        }
+        pos += n;
+    }
+    count = end - pos;
+    if (count > 0 && send_frame_hdr(sock, OP_DATA, 0, req_id, count) < 0) return -1;
 
-        char command[BUFFER_SIZE]; snprintf(command, BUFFER_SIZE, "DELETE %s", path);
-        send(sock, command, strlen(command), 0);
-        char response[64]; recv(sock, response, sizeof(response), 0);
-        send(client_sock, response, strlen(response), 0);
-        close(sock);
+    int use_sendfile = ZERO_COPY;
+    while (pos < end) {
+        ssize_t n;
+        if (use_sendfile) {
+            n = sendfile(sock, fd, &pos, end - pos);
+            if (n > 0) __atomic_add_fetch(&metrics.bytes_out, n, __ATOMIC_RELAXED);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) { use_sendfile = 0; continue; }
+        } else {
+            size_t want = end - pos < CHUNK_SIZE ? end - pos : CHUNK_SIZE;
+            n = pread(fd, buffer, want, pos);
+            if (n > 0 && send_all(sock, buffer, n, 0) < 0) n = -1;
+            if (n > 0) pos += n;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            // The file shrank or the socket failed mid-frame; the stream can't be resynchronised
+            debug_print("File transfer aborted at offset %lld\n", (long long)pos);
+            shutdown(sock, SHUT_RDWR);
+            return -1;
+        }
     }
+    return send_frame(sock, OP_END, 0, req_id, NULL, 0);
+}
+
+// Tar streaming: archives are generated on the fly from the store, with no temp files.
+// Every entry is a DATA frame holding its 512-byte ustar header followed by one DATA frame
+// holding the body padded to whole blocks (sent with sendfile); the last frame of each entry
+// carries FLAG_ENTRY_END so a relay can tell where entries start and end. Names too long
+// for ustar and sizes of 8 GiB or more are described by a preceding pax 'x' header.
+#define TAR_BLOCK 512
+
+typedef struct {
+    char name[100], mode[8], uid[8], gid[8], size[12], mtime[12], chksum[8], typeflag;
+    char linkname[100], magic[6], version[2], uname[32], gname[32], devmajor[8], devminor[8];
+    char prefix[155], pad[12];
+} tar_header;
+
+// One archived file as the tar cache remembers it
+typedef struct {
+    char *path;             // entry name, relative to the store
+    uint64_t size;          // in dedup mode the content's size, not the manifest's
+    time_t mtime;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+} tar_item;
+
+void tar_octal(char *field, size_t width, unsigned long long value) {
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "%0*llo", (int)width - 1, value);
+    memcpy(field, tmp, width - 1);
 }
 
-void handle_downltar(int client_sock, const char *ftype) {
-    if (!ftype || (strcmp(ftype, ".c") && strcmp(ftype, ".pdf") && strcmp(ftype, ".txt"))) {
-        send(client_sock, "ERROR: Invalid filetype", 24, 0); return;
+void tar_finish_header(tar_header *h) {
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(*h); i++) sum += ((unsigned char *)h)[i];
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+    h->chksum[7] = ' ';
+}
+
+// Appends one "<len> key=value\n" pax record; the length counts its own digits
+size_t pax_record(char *out, size_t room, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;  // ' ', '=', '\n'
+    size_t len = body + 1;
+    while (snprintf(NULL, 0, "%zu", len) + body != len) len++;
+    if (len >= room) return 0;
+    snprintf(out, room, "%zu %s=%s\n", len, key, value);
+    return len;
+}
+
+// Streams one stored file as a tar entry, with the name and metadata the tar cache has for it
+int tar_send_entry(int sock, uint32_t req_id, const char *full_path, const tar_item *item) {
+    int fd = open(full_path, O_RDONLY);
+    if (fd < 0) return 0;  // removed since the list was made; skip it
+    const char *name = item->path;
+    struct stat st = { .st_size = item->size, .st_mtime = item->mtime, .st_mode = item->mode,
+                       .st_uid = item->uid, .st_gid = item->gid };
+
+    tar_header h;
+    memset(&h, 0, sizeof(h));
+    char pax[BUFFER_SIZE + 64];
+    size_t pax_len = 0;
+    size_t name_len = strlen(name);
+    const char *split = NULL;
+    if (name_len > sizeof(h.name)) {
+        // ustar can hold up to 155 + 1 + 100 characters if the name splits at a '/'
+        for (const char *p = strchr(name, '/'); p; p = strchr(p + 1, '/'))
+            if ((size_t)(p - name) <= sizeof(h.prefix) && name_len - (p - name) - 1 <= sizeof(h.name)) { split = p; break; }
+        if (!split) pax_len += pax_record(pax + pax_len, sizeof(pax) - pax_len, "path", name);
+    }
+    if ((unsigned long long)st.st_size >= 077777777777ULL) {
+        char size[32];
+        snprintf(size, sizeof(size), "%lld", (long long)st.st_size);
+        pax_len += pax_record(pax + pax_len, sizeof(pax) - pax_len, "size", size);
     }
 
-    if (strcmp(ftype, ".c") == 0) {
-        system("tar -cf /tmp/cfiles.tar -C $HOME/S1 . --exclude='*.pdf' --exclude='*.txt' --exclude='*.zip'");
-        FILE *file = fopen("/tmp/cfiles.tar", "rb");
-        if (!file) { send(client_sock, "ERROR: Could not create tar", 27, 0); return; }
+    if (pax_len > 0) {
+        tar_header x;
+        memset(&x, 0, sizeof(x));
+        snprintf(x.name, sizeof(x.name), "PaxHeaders/%.80s", strrchr(name, '/') ? strrchr(name, '/') + 1 : name);
+        tar_octal(x.mode, sizeof(x.mode), 0644);
+        tar_octal(x.uid, sizeof(x.uid), 0);
+        tar_octal(x.gid, sizeof(x.gid), 0);
+        tar_octal(x.size, sizeof(x.size), pax_len);
+        tar_octal(x.mtime, sizeof(x.mtime), st.st_mtime);
+        x.typeflag = 'x';
+        tar_finish_header(&x);
+
+        char block[TAR_BLOCK + sizeof(pax)];
+        size_t padded = (pax_len + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        memcpy(block, &x, TAR_BLOCK);
+        memset(block + TAR_BLOCK, 0, padded);
+        memcpy(block + TAR_BLOCK, pax, pax_len);
+        if (send_frame(sock, OP_DATA, 0, req_id, block, TAR_BLOCK + padded) < 0) { close(fd); return -1; }
+    }
 
-        char buffer[BUFFER_SIZE]; size_t bytes;
-        while ((bytes = fread(buffer, 1, BUFFER_SIZE, file)) > 0) send(client_sock, buffer, bytes, 0);
-        send(client_sock, "EOF_FILE_TRANSFER", 17, 0); fclose(file);
+    if (split) {
+        memcpy(h.prefix, name, split - name);
+        memcpy(h.name, split + 1, name_len - (split - name) - 1);
     } else {
-        int port = (strcmp(ftype, ".pdf") == 0) ? S2_PORT : S3_PORT;
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(port) };
-        inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
-        connect(sock, (struct sockaddr*)&sa, sizeof(sa));
+        memcpy(h.name, name, name_len < sizeof(h.name) ? name_len : sizeof(h.name));
+    }
+    tar_octal(h.mode, sizeof(h.mode), st.st_mode & 07777);
+    tar_octal(h.uid, sizeof(h.uid), st.st_uid);
+    tar_octal(h.gid, sizeof(h.gid), st.st_gid);
+    tar_octal(h.size, sizeof(h.size), (unsigned long long)st.st_size < 077777777777ULL ? st.st_size : 0);
+    tar_octal(h.mtime, sizeof(h.mtime), st.st_mtime);
+    h.typeflag = '0';
+    tar_finish_header(&h);
 
-        char command[BUFFER_SIZE]; snprintf(command, BUFFER_SIZE, "SENDTAR %s", ftype);
-        send(sock, command, strlen(command), 0);
+    if (st.st_size == 0) {
+        close(fd);
+        return send_frame(sock, OP_DATA, FLAG_ENTRY_END, req_id, &h, TAR_BLOCK);
+    }
+    if (send_frame(sock, OP_DATA, 0, req_id, &h, TAR_BLOCK) < 0) { close(fd); return -1; }
 
-        char buffer[BUFFER_SIZE]; ssize_t r;
-        while ((r = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-            send(client_sock, buffer, r, 0);
-            if (strstr(buffer, "EOF_FILE_TRANSFER")) break;
+    // Body: announced as size rounded up to a block; a file that shrinks meanwhile is
+    // zero-filled (as tar(1) does) so the archive stays well-formed
+    uint64_t padded = ((uint64_t)st.st_size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    if (send_frame_hdr(sock, OP_DATA, FLAG_ENTRY_END, req_id, padded) < 0) { close(fd); return -1; }
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        ssize_t n = sendfile(sock, fd, &offset, st.st_size - offset);
+        if (n > 0) __atomic_add_fetch(&metrics.bytes_out, n, __ATOMIC_RELAXED);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            char buffer[CHUNK_SIZE];
+            n = pread(fd, buffer, st.st_size - offset < CHUNK_SIZE ? st.st_size - offset : CHUNK_SIZE, offset);
+            if (n > 0 && send_all(sock, buffer, n, 0) < 0) { close(fd); return -1; }
+            if (n > 0) offset += n;
         }
-        close(sock);
+        if (n < 0 && errno != EINVAL && errno != ENOSYS) { close(fd); return -1; }
+        if (n == 0) break;
     }
+    close(fd);
+
+    char zeros[TAR_BLOCK] = {0};
+    for (uint64_t left = padded - offset; left > 0; ) {
+        size_t n = left < TAR_BLOCK ? left : TAR_BLOCK;
+        if (send_all(sock, zeros, n, 0) < 0) return -1;
+        left -= n;
+    }
+    return 0;
+}
+
+int has_extension(const char *name, const char *ext) {
+    size_t n = strlen(name), e = strlen(ext);
+    return n > e && strcmp(name + n - e, ext) == 0;
 }
+// Namespace index: every stored file (size, mtime) and every directory's sorted file names,
+// kept in one hash table keyed by path relative to base_dir, so listings and existence
+// checks are answered from memory. It is persisted as a snapshot (<base_dir>.index) plus an
+// append-only change log (<base_dir>.index.log); startup loads the snapshot and replays the log,
+// and only a missing snapshot forces a walk of the tree.
+#define INDEX_BUCKETS 4096       // initial hash table size, doubled as the index grows
+#define INDEX_LOG_COMPACT 10000  // log records before they are folded into a new snapshot
 
-void handle_dispfnames(int client_sock, const char *dirpath) {
-    if (!dirpath) { send(client_sock, "ERROR: Invalid syntax", 22, 0); return; }
+typedef struct index_node {
+    char *path;                 // "" is the store root
+    int is_dir;
+    uint64_t size;
+    time_t mtime;
+    const char **names;         // directories: sorted file names, pointing into the file nodes
+    size_t count, capacity;
+    struct index_node *next;    // hash chain
+} index_node;
 
-    char path[BUFFER_SIZE]; strncpy(path, dirpath, BUFFER_SIZE);
-    if (strncmp(path, "~S1/", 4) == 0) memmove(path, path + 4, strlen(path) - 3);
+index_node **index_table;
+size_t index_buckets, index_nodes;
+pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+char index_path[300], index_log_path[300];
+FILE *index_log;
+size_t index_log_records;
 
-    char full_path[BUFFER_SIZE]; snprintf(full_path, BUFFER_SIZE, "%s/%s", base_dir, path);
-    DIR *dir = opendir(full_path);
-    if (!dir) { send(client_sock, "ERROR: Directory not found", 26, 0); return; }
+// Canonical form of a client-supplied path: no empty, "." or ".." components and no leading
+// or trailing '/'. Returns -1 if the path would leave the store or does not fit.
+int index_normalize(const char *in, char *out, size_t size) {
+    size_t len = 0;
+    out[0] = '\0';
+    while (*in) {
+        while (*in == '/') in++;
+        const char *end = strchr(in, '/');
+        if (!end) end = in + strlen(in);
+        size_t n = end - in;
+        if (n == 2 && in[0] == '.' && in[1] == '.') {
+            if (len == 0) return -1;
+            while (len > 0 && out[len - 1] != '/') len--;
+            if (len > 0) len--;
+            out[len] = '\0';
+        } else if (n > 0 && !(n == 1 && in[0] == '.')) {
+            if (len + (len > 0) + n >= size) return -1;
+            if (len > 0) out[len++] = '/';
+            memcpy(out + len, in, n);
+            out[len += n] = '\0';
+        }
+        in = end;
+    }
+    return 0;
+}
+
+uint64_t index_hash(const char *s) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    while (*s) h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+index_node *index_find(const char *path) {
+    if (!index_table) return NULL;
+    for (index_node *n = index_table[index_hash(path) & (index_buckets - 1)]; n; n = n->next)
+        if (strcmp(n->path, path) == 0) return n;
+    return NULL;
+}
+
+index_node *index_insert(const char *path, int is_dir) {
+    if (index_nodes >= index_buckets) {
+        size_t buckets = index_buckets ? index_buckets * 2 : INDEX_BUCKETS;
+        index_node **table = calloc(buckets, sizeof(*table));
+        if (!table) { perror("calloc failed"); exit(EXIT_FAILURE); }
+        for (size_t i = 0; i < index_buckets; i++) {
+            for (index_node *n = index_table[i], *next; n; n = next) {
+                next = n->next;
+                size_t b = index_hash(n->path) & (buckets - 1);
+                n->next = table[b];
+                table[b] = n;
+            }
+        }
+        free(index_table);
+        index_table = table;
+        index_buckets = buckets;
+    }
+    index_node *node = calloc(1, sizeof(*node));
+    if (!node || !(node->path = strdup(path))) { perror("malloc failed"); exit(EXIT_FAILURE); }
+    node->is_dir = is_dir;
+    size_t b = index_hash(path) & (index_buckets - 1);
+    node->next = index_table[b];
+    index_table[b] = node;
+    index_nodes++;
+    return node;
+}
+
+// Directory node for `path`, created along with its ancestors if missing
+index_node *index_dir(const char *path) {
+    index_node *dir = index_find(path);
+    if (dir) return dir->is_dir ? dir : NULL;
+    if (*path) {
+        char parent[BUFFER_SIZE];
+        const char *slash = strrchr(path, '/');
+        snprintf(parent, sizeof(parent), "%.*s", slash ? (int)(slash - path) : 0, path);
+        if (!index_dir(parent)) return NULL;
+    }
+    return index_insert(path, 1);
+}
+
+// Parent directory of a file node and the slot of its name there (or where it would go)
+index_node *index_parent(index_node *file, size_t *slot, int *found) {
+    char dir_path[BUFFER_SIZE];
+    const char *slash = strrchr(file->path, '/');
+    const char *name = slash ? slash + 1 : file->path;
+    snprintf(dir_path, sizeof(dir_path), "%.*s", slash ? (int)(slash - file->path) : 0, file->path);
+    index_node *dir = index_dir(dir_path);
+    if (!dir) return NULL;
+
+    size_t lo = 0, hi = dir->count;
+    *found = 0;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(dir->names[mid], name);
+        if (c == 0) { *found = 1; lo = mid; break; }
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    *slot = lo;
+    return dir;
+}
+
+void index_apply_add(const char *path, uint64_t size, time_t mtime) {
+    index_node *node = index_find(path);
+    if (node && node->is_dir) return;
+    if (!node) {
+        node = index_insert(path, 0);
+        size_t slot;
+        int found;
+        index_node *dir = index_parent(node, &slot, &found);
+        if (dir && !found) {
+            if (dir->count == dir->capacity) {
+                dir->capacity = dir->capacity ? dir->capacity * 2 : 16;
+                dir->names = realloc(dir->names, dir->capacity * sizeof(char *));
+                if (!dir->names) { perror("realloc failed"); exit(EXIT_FAILURE); }
+            }
+            memmove(dir->names + slot + 1, dir->names + slot, (dir->count - slot) * sizeof(char *));
+            const char *slash = strrchr(node->path, '/');
+            dir->names[slot] = slash ? slash + 1 : node->path;
+            dir->count++;
+        }
+    }
+    node->size = size;
+    node->mtime = mtime;
+}
+
+void index_apply_remove(const char *path) {
+    index_node *node = index_find(path);
+    if (!node || node->is_dir) return;
+    size_t slot;
+    int found;
+    index_node *dir = index_parent(node, &slot, &found);
+    if (dir && found) {
+        memmove(dir->names + slot, dir->names + slot + 1, (dir->count - slot - 1) * sizeof(char *));
+        dir->count--;
+    }
+    index_node **link = &index_table[index_hash(path) & (index_buckets - 1)];
+    while (*link != node) link = &(*link)->next;
+    *link = node->next;
+    index_nodes--;
+    free(node->path);
+    free(node);
+}
+
+// Rewrites the snapshot from memory and starts an empty log (caller holds the write lock)
+void index_save(void) {
+    char tmp_path[sizeof(index_path) + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+    FILE *snap = fopen(tmp_path, "w");
+    if (!snap) { debug_print("Index snapshot failed: %s\n", strerror(errno)); return; }
+    for (size_t i = 0; i < index_buckets; i++) {
+        for (index_node *n = index_table[i]; n; n = n->next) {
+            if (n->is_dir) fprintf(snap, "d %s\n", n->path);
+            else fprintf(snap, "+ %llu %lld %s\n", (unsigned long long)n->size, (long long)n->mtime, n->path);
+        }
+    }
+    int failed = fflush(snap) != 0 || fsync(fileno(snap)) != 0;
+    if (fclose(snap) != 0 || failed || rename(tmp_path, index_path) != 0) {
+        debug_print("Index snapshot failed: %s\n", strerror(errno));
+        remove(tmp_path);
+        return;
+    }
+
+    // Everything logged so far is in the snapshot; replaying it again would be harmless
+    if (index_log) fclose(index_log);
+    index_log = fopen(index_log_path, "w");
+    index_log_records = 0;
+}
+
+// Applies snapshot or log records; a torn last line from a crash is ignored
+int index_replay(const char *file) {
+    FILE *in = fopen(file, "r");
+    if (!in) return -1;
+    char line[BUFFER_SIZE + 64];
+    while (fgets(line, sizeof(line), in)) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') break;
+        line[len - 1] = '\0';
+        unsigned long long size;
+        long long mtime;
+        int at = 0;
+        if (sscanf(line, "+ %llu %lld%n", &size, &mtime, &at) == 2 && line[at] == ' ')
+            index_apply_add(line + at + 1, size, mtime);
+        else if (strncmp(line, "- ", 2) == 0) index_apply_remove(line + 2);
+        else if (strncmp(line, "d ", 2) == 0) index_dir(line + 2);
+    }
+    fclose(in);
+    return 0;
+}
+
+// Walks the store below rel, removing the temp files of uploads a crash cut short (see
+// stage_path()) and, with `add`, indexing every other regular file
+void index_walk(const char *rel, int add) {
+    char dir_path[BUFFER_SIZE];
+    if (snprintf(dir_path, sizeof(dir_path), "%s%s%s", base_dir, *rel ? "/" : "", rel) >= (int)sizeof(dir_path)) return;
+    DIR *dir = opendir(dir_path);
+    if (!dir) return;
+    if (add) index_dir(rel);
 
     struct dirent *entry;
-    char files[BUFFER_SIZE * 2] = "";
     while ((entry = readdir(dir))) {
-        if (entry->d_type == DT_REG && strstr(entry->d_name, ".c")) {
-            strcat(files, entry->d_name); strcat(files, "\n");
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char path[BUFFER_SIZE], full_path[BUFFER_SIZE];
+        if (snprintf(path, sizeof(path), "%s%s%s", rel, *rel ? "/" : "", entry->d_name) >= (int)sizeof(path) ||
+            snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, path) >= (int)sizeof(full_path)) {
+            debug_print("Skipping %s/%s: path too long\n", dir_path, entry->d_name);
+            continue;
+        }
+        struct stat st;
+        // Sweeping alone only needs the type, which readdir() usually has already
+        if (add || entry->d_type == DT_UNKNOWN) {
+            if (lstat(full_path, &st) < 0) continue;
+        } else {
+            st.st_mode = DTTOIF(entry->d_type);
+        }
+        if (S_ISDIR(st.st_mode)) {
+            index_walk(path, add);
+        } else if (!S_ISREG(st.st_mode)) {
+            continue;
+        } else if (has_extension(entry->d_name, ".tmp")) {
+            debug_print("Removing stale upload %s\n", full_path);
+            unlink(full_path);
+        } else if (add) {
+            index_apply_add(path, st.st_size, st.st_mtime);
         }
     }
     closedir(dir);
+}
 
-    int ports[] = { S2_PORT, S3_PORT, S4_PORT };
-    for (int i = 0; i < 3; i++) {
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(ports[i]) };
-        inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
-        if (connect(sock, (struct sockaddr*)&sa, sizeof(sa)) == 0) {
-            char command[BUFFER_SIZE]; snprintf(command, BUFFER_SIZE, "LIST %s", path);
-            send(sock, command, strlen(command), 0);
-            char buffer[BUFFER_SIZE]; ssize_t r = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-            if (r > 0) { buffer[r] = '\0'; strcat(files, buffer); }
-            close(sock);
+void index_load(void) {
+    snprintf(index_path, sizeof(index_path), "%s.index", base_dir);
+    snprintf(index_log_path, sizeof(index_log_path), "%s.index.log", base_dir);
+    pthread_rwlock_wrlock(&index_lock);
+    index_dir("");
+    int scan = index_replay(index_path) != 0;
+    if (scan) debug_print("No index snapshot, scanning %s\n", base_dir);
+    else index_replay(index_log_path);
+    index_walk("", scan);
+    index_save();
+    pthread_rwlock_unlock(&index_lock);
+    debug_print("Index loaded: %zu entries\n", index_nodes);
+}
+
+void index_logged(void) {
+    if (index_log) fflush(index_log);
+    if (++index_log_records >= INDEX_LOG_COMPACT) index_save();
+}
+
+void index_add(const char *path, uint64_t size, time_t mtime) {
+    pthread_rwlock_wrlock(&index_lock);
+    index_apply_add(path, size, mtime);
+    if (index_log) fprintf(index_log, "+ %llu %lld %s\n", (unsigned long long)size, (long long)mtime, path);
+    index_logged();
+    pthread_rwlock_unlock(&index_lock);
+    tar_cache_note(path);
+}
+
+void index_remove(const char *path) {
+    pthread_rwlock_wrlock(&index_lock);
+    index_apply_remove(path);
+    if (index_log) fprintf(index_log, "- %s\n", path);
+    index_logged();
+    pthread_rwlock_unlock(&index_lock);
+    tar_cache_note(path);
+}
+
+int index_lookup(const char *path, uint64_t *size, time_t *mtime) {
+    pthread_rwlock_rdlock(&index_lock);
+    index_node *node = index_find(path);
+    int found = node && !node->is_dir;
+    if (found && size) *size = node->size;
+    if (found && mtime) *mtime = node->mtime;
+    pthread_rwlock_unlock(&index_lock);
+    return found;
+}
+
+// Files directly in directory `path` (only names ending in `ext`, if given), sorted and
+// newline-terminated in one malloc'd buffer, or NULL if there is no such directory
+char *index_list(const char *path, const char *ext, size_t *length) {
+    pthread_rwlock_rdlock(&index_lock);
+    index_node *dir = index_find(path);
+    if (!dir || !dir->is_dir) { pthread_rwlock_unlock(&index_lock); return NULL; }
+
+    size_t total = 0;
+    for (size_t i = 0; i < dir->count; i++)
+        if (!ext || has_extension(dir->names[i], ext)) total += strlen(dir->names[i]) + 1;
+    char *list = malloc(total + 1), *p = list;
+    if (!list) { perror("malloc failed"); exit(EXIT_FAILURE); }
+    for (size_t i = 0; i < dir->count; i++) {
+        if (ext && !has_extension(dir->names[i], ext)) continue;
+        size_t n = strlen(dir->names[i]);
+        memcpy(p, dir->names[i], n);
+        p[n] = '\n';
+        p += n + 1;
+    }
+    *p = '\0';
+    pthread_rwlock_unlock(&index_lock);
+    *length = total;
+    return list;
+}
+
+// Tar cache for the .c archive, as in S2-S4: a repeated downltar .c should not have to find
+// and stat every file again. The entries of the last archive are kept sorted by path in a
+// refcounted list stamped with the store's tar generation, which every index_add() and
+// index_remove() of a TAR_TYPE file bumps, noting the path. A request at the current
+// generation is served from the list as is (bodies still go out with sendfile()); otherwise
+// the noted paths are merged into a new list, and only when more than TAR_CACHE_CHANGES
+// piled up is it rebuilt from the whole index.
+#define TAR_CACHE_CHANGES 1024
+
+typedef struct {
+    tar_item *items;
+    size_t count;
+    int refs;               // the cache's own reference plus one per archive being sent
+} tar_list;
+
+struct {
+    unsigned long long generation, built;   // built: the generation `list` describes
+    tar_list *list;
+    char *changed[TAR_CACHE_CHANGES];        // paths changed since the list was taken
+    size_t changes;
+    int overflow;
+} tar_cache;
+pthread_mutex_t tar_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t tar_build_lock = PTHREAD_MUTEX_INITIALIZER;  // one list is built at a time
+
+void tar_cache_note(const char *path) {
+    if (!has_extension(path, TAR_TYPE)) return;
+    char *copy = strdup(path);
+    if (!copy) { perror("strdup failed"); exit(EXIT_FAILURE); }
+    pthread_mutex_lock(&tar_cache_lock);
+    tar_cache.generation++;
+    if (tar_cache.changes == TAR_CACHE_CHANGES) tar_cache.overflow = 1;
+    if (tar_cache.overflow) free(copy);
+    else tar_cache.changed[tar_cache.changes++] = copy;
+    pthread_mutex_unlock(&tar_cache_lock);
+}
+
+void tar_list_release(tar_list *list) {
+    pthread_mutex_lock(&tar_cache_lock);
+    int last = --list->refs == 0;
+    pthread_mutex_unlock(&tar_cache_lock);
+    if (!last) return;
+    for (size_t i = 0; i < list->count; i++) free(list->items[i].path);
+    free(list->items);
+    free(list);
+}
+
+int tar_item_cmp(const void *a, const void *b) {
+    return strcmp(((const tar_item *)a)->path, ((const tar_item *)b)->path);
+}
+
+int tar_path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Fills `item` for a stored file from the index (size, mtime) and stat() (mode, owner);
+// -1 if it is not (or no longer) in the store. Takes ownership of `path`.
+int tar_item_load(char *path, tar_item *item) {
+    char full_path[BUFFER_SIZE];
+    snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, path);
+    struct stat st;
+    if (!index_lookup(path, &item->size, &item->mtime) || stat(full_path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        free(path);
+        return -1;
+    }
+    item->path = path;
+    item->mode = st.st_mode & 07777;
+    item->uid = st.st_uid;
+    item->gid = st.st_gid;
+    return 0;
+}
+
+void tar_list_add(tar_list *list, size_t *capacity, tar_item *item) {
+    if (list->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        list->items = realloc(list->items, *capacity * sizeof(tar_item));
+        if (!list->items) { perror("realloc failed"); exit(EXIT_FAILURE); }
+    }
+    list->items[list->count++] = *item;
+}
+
+// A new list of every TAR_TYPE file in the index
+tar_list *tar_list_build(void) {
+    char **paths = NULL;
+    size_t count = 0, capacity = 0;
+    pthread_rwlock_rdlock(&index_lock);
+    for (size_t i = 0; i < index_buckets; i++) {
+        for (index_node *n = index_table[i]; n; n = n->next) {
+            if (n->is_dir || !has_extension(n->path, TAR_TYPE)) continue;
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                paths = realloc(paths, capacity * sizeof(char *));
+                if (!paths) { perror("realloc failed"); exit(EXIT_FAILURE); }
+            }
+            paths[count] = strdup(n->path);
+            if (!paths[count++]) { perror("strdup failed"); exit(EXIT_FAILURE); }
         }
     }
-    send(client_sock, files, strlen(files), 0);
+    pthread_rwlock_unlock(&index_lock);
+    qsort(paths, count, sizeof(char *), tar_path_cmp);
+
+    tar_list *list = calloc(1, sizeof(tar_list));
+    if (!list) { perror("calloc failed"); exit(EXIT_FAILURE); }
+    size_t items = 0;
+    for (size_t i = 0; i < count; i++) {
+        tar_item item;
+        if (tar_item_load(paths[i], &item) == 0) tar_list_add(list, &items, &item);
+    }
+    free(paths);
+    return list;
 }
 
-void prcclient(int client_sock) {
-    char buffer[BUFFER_SIZE];
-    while (1) {
-        bzero(buffer, BUFFER_SIZE);
-        ssize_t bytes_read = read(client_sock, buffer, BUFFER_SIZE);
-        if (bytes_read <= 0) {
-            debug_print("Client disconnected\n");
-            break;
+// A new list made of `old` with the `count` changed paths (sorted, possibly repeated)
+// looked up again; only those are stat()ed
+tar_list *tar_list_merge(const tar_list *old, char **changed, size_t count) {
+    tar_list *list = calloc(1, sizeof(tar_list));
+    if (!list) { perror("calloc failed"); exit(EXIT_FAILURE); }
+    size_t items = 0, i = 0, j = 0;
+    while (i < old->count || j < count) {
+        int cmp = i == old->count ? 1 : j == count ? -1 : strcmp(old->items[i].path, changed[j]);
+        if (cmp < 0) {
+            tar_item item = old->items[i++];
+            item.path = strdup(item.path);
+            if (!item.path) { perror("strdup failed"); exit(EXIT_FAILURE); }
+            tar_list_add(list, &items, &item);
+            continue;
         }
+        if (cmp == 0) i++;  // replaced by the fresh lookup
+        tar_item item;
+        char *path = changed[j++];
+        while (j < count && strcmp(changed[j], path) == 0) free(changed[j++]);
+        if (tar_item_load(path, &item) == 0) tar_list_add(list, &items, &item);
+    }
+    return list;
+}
 
-        debug_print("Command: %s\n", buffer);
-        char *cmd = strtok(buffer, " ");
+// The list for the current generation, with a reference the caller must release
+tar_list *tar_cache_get(void) {
+    pthread_mutex_lock(&tar_build_lock);
+    pthread_mutex_lock(&tar_cache_lock);
+    tar_list *old = tar_cache.list;
+    if (old && tar_cache.built == tar_cache.generation) {
+        old->refs++;
+        pthread_mutex_unlock(&tar_cache_lock);
+        pthread_mutex_unlock(&tar_build_lock);
+        __atomic_add_fetch(&metrics.tar_hits, 1, __ATOMIC_RELAXED);
+        return old;
+    }
+    // Changes noted from here on are left for the next request
+    char **changed = malloc(TAR_CACHE_CHANGES * sizeof(char *));
+    if (!changed) { perror("malloc failed"); exit(EXIT_FAILURE); }
+    size_t count = tar_cache.changes;
+    memcpy(changed, tar_cache.changed, count * sizeof(char *));
+    int rebuild = !old || tar_cache.overflow;
+    unsigned long long generation = tar_cache.generation;
+    tar_cache.changes = 0;
+    tar_cache.overflow = 0;
+    if (old) old->refs++;
+    pthread_mutex_unlock(&tar_cache_lock);
 
-        if (strcmp(cmd, "uploadf") == 0) {
-            char *filename = strtok(NULL, " ");
-            char *dest_path = strtok(NULL, " ");
-            if (!filename || !dest_path) {
-                send(client_sock, "ERROR: Invalid syntax", 22, 0);
-                continue;
-            }
+    tar_list *list;
+    if (rebuild) {
+        for (size_t i = 0; i < count; i++) free(changed[i]);
+        list = tar_list_build();
+        __atomic_add_fetch(&metrics.tar_rebuilds, 1, __ATOMIC_RELAXED);
+    } else {
+        qsort(changed, count, sizeof(char *), tar_path_cmp);
+        list = tar_list_merge(old, changed, count);
+        __atomic_add_fetch(&metrics.tar_updates, 1, __ATOMIC_RELAXED);
+    }
+    free(changed);
+    list->refs = 2;  // the cache's and the caller's
 
-            char processed_path[BUFFER_SIZE];
-            strncpy(processed_path, dest_path, BUFFER_SIZE);
-            if (strncmp(processed_path, "~S1/", 4) == 0)
-                memmove(processed_path, processed_path + 4, strlen(processed_path) - 3);
-
-            char *dest_copy1 = strdup(processed_path);
-            char *dest_copy2 = strdup(processed_path);
-            char *dir_part = dirname(dest_copy1);
-            char *file_part = basename(dest_copy2);
-
-            char dir_path[BUFFER_SIZE];
-            snprintf(dir_path, BUFFER_SIZE, "%s/%s", base_dir, dir_part);
-            create_directory(dir_path);
-
-            char final_path[BUFFER_SIZE];
-            snprintf(final_path, BUFFER_SIZE, "%s/%s", dir_path, file_part);
-
-            char temp_path[BUFFER_SIZE];
-            snprintf(temp_path, BUFFER_SIZE, "%s.tmp", final_path);
-            FILE *file = fopen(temp_path, "wb");
-            if (!file) {
-                send(client_sock, "ERROR: File creation failed", 28, 0);
-                free(dest_copy1); free(dest_copy2);
-                continue;
-            }
+    pthread_mutex_lock(&tar_cache_lock);
+    tar_cache.list = list;
+    tar_cache.built = generation;
+    pthread_mutex_unlock(&tar_cache_lock);
+    pthread_mutex_unlock(&tar_build_lock);
+    if (old) {
+        tar_list_release(old);  // ours
+        tar_list_release(old);  // the cache's
+    }
+    return list;
+}
 
-            int eof_marker = 0;
-            while (!eof_marker && (bytes_read = read(client_sock, buffer, BUFFER_SIZE)) > 0) {
-                char *eof_pos = strstr(buffer, "EOF_FILE_TRANSFER");
-                if (eof_pos) {
-                    eof_marker = 1;
-                    size_t valid_bytes = eof_pos - buffer;
-                    if (valid_bytes > 0) fwrite(buffer, 1, valid_bytes, file);
-                } else {
-                    fwrite(buffer, 1, bytes_read, file);
-                }
-            }
-            fclose(file);
+// Streams a complete archive of the TAR_TYPE files in the store, then the end-of-archive blocks
+int send_tar_stream(int sock, uint32_t req_id) {
+    tar_list *list = tar_cache_get();
+    int rc = 0;
+    for (size_t i = 0; i < list->count && rc == 0; i++) {
+        char full_path[BUFFER_SIZE];
+        snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, list->items[i].path);
+        rc = tar_send_entry(sock, req_id, full_path, &list->items[i]);
+    }
+    tar_list_release(list);
+    if (rc < 0) {
+        shutdown(sock, SHUT_RDWR);
+        return -1;
+    }
+    char trailer[2 * TAR_BLOCK] = {0};
+    if (send_frame(sock, OP_DATA, FLAG_ENTRY_END, req_id, trailer, sizeof(trailer)) < 0) return -1;
+    return send_frame(sock, OP_END, 0, req_id, NULL, 0);
+}
 
-            if (rename(temp_path, final_path) != 0) {
-                send(client_sock, "ERROR: Save failed", 20, 0);
-                remove(temp_path);
-                free(dest_copy1); free(dest_copy2);
-                continue;
-            }
 
-            file_type type = get_file_type(final_path);
-            if (type != C_FILE) {
-                forward_file(final_path, processed_path, type);
-                remove(final_path);
-            }
 
-            send(client_sock, "UPLOAD_SUCCESS", 14, 0);
-            free(dest_copy1); free(dest_copy2);
-        } 
-        else if (strcmp(cmd, "downlf") == 0) {
-            char *filepath = strtok(NULL, " ");
-            handle_downlf(client_sock, filepath);
-        } 
-        else if (strcmp(cmd, "removef") == 0) {
-            char *filepath = strtok(NULL, " ");
-            handle_removef(client_sock, filepath);
-        } 
-        else if (strcmp(cmd, "downltar") == 0) {
-            char *filetype = strtok(NULL, " ");
-            handle_downltar(client_sock, filetype);
-        } 
-        else if (strcmp(cmd, "dispfnames") == 0) {
-            char *dirpath = strtok(NULL, " ");
-            handle_dispfnames(client_sock, dirpath);
-        } 
-        else {
-            send(client_sock, "ERROR: Unknown command", 22, 0);
-        }
-    }
-    close(client_sock);
-    exit(EXIT_SUCCESS);
+// Receives DATA frames until END, writing them to `file` (or discarding them if NULL).
+// Returns 0 on END, -1 on a broken connection, -2 if the peer sent an ERROR frame
+// (its text is copied into `err`) and -3 if the stream was drained but a write failed.
+int recv_file_stream(int sock, FILE *file, char *err, size_t err_size) {
+    char buffer[CHUNK_SIZE];
+    frame_hdr hdr;
+    int write_failed = 0;
+    while (recv_frame_hdr(sock, &hdr) == 0) {
+        if (hdr.opcode == OP_END) return write_failed ? -3 : 0;
+        if (hdr.opcode == OP_ERROR) {
+            size_t n = (err && hdr.length < err_size - 1) ? hdr.length : (err ? err_size - 1 : 0);
+            if (recv_all(sock, err, n) < 0) return -1;
+            if (err) err[n] = '\0';
+            return skip_payload(sock, hdr.length - n) < 0 ? -1 : -2;
+        }
+        if (hdr.opcode != OP_DATA) return -1;
+        if (hdr.flags & FLAG_LZ4) {
+            long n = recv_lz4(sock, hdr.length, buffer);
+            if (n == -1) return -1;
+            if (n < 0 || (file && !write_failed && fwrite(buffer, 1, n, file) != (size_t)n)) write_failed = 1;
+            continue;
+        }
+
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t n = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+            if (recv_all(sock, buffer, n) < 0) return -1;
+            if (file && !write_failed && fwrite(buffer, 1, n, file) != n) write_failed = 1;
+            remaining -= n;
+        }
+    }
+    return -1;
 }
 
+// Writes all of buf at `offset`; -1 on failure
+int pwrite_all(int fd, const char *buf, size_t n, uint64_t offset) {
+    while (n > 0) {
+        ssize_t w = pwrite(fd, buf, n, offset);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        buf += w; n -= w; offset += w;
+    }
+    return 0;
+}
 
-// Main function
-int main() {
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    snprintf(base_dir, sizeof(base_dir), "%s/%s", getenv("HOME"), BASE_DIR_NAME);
-    int opt = 1;
-    socklen_t addrlen = sizeof(address);
+// recv_file_stream() for one part of a multi-part upload: the data is written to fd at
+// `offset` and must come to exactly `length` bytes, otherwise the result is -3
+int recv_file_stream_at(int sock, int fd, uint64_t offset, uint64_t length, char *err, size_t err_size) {
+    char buffer[CHUNK_SIZE];
+    frame_hdr hdr;
+    uint64_t received = 0;
+    int write_failed = 0;
+    while (recv_frame_hdr(sock, &hdr) == 0) {
+        if (hdr.opcode == OP_END) return (write_failed || received != length) ? -3 : 0;
+        if (hdr.opcode == OP_ERROR) {
+            size_t n = (err && hdr.length < err_size - 1) ? hdr.length : (err ? err_size - 1 : 0);
+            if (recv_all(sock, err, n) < 0) return -1;
+            if (err) err[n] = '\0';
+            return skip_payload(sock, hdr.length - n) < 0 ? -1 : -2;
+        }
+        if (hdr.opcode != OP_DATA) return -1;
+        if (hdr.flags & FLAG_LZ4) {
+            long n = recv_lz4(sock, hdr.length, buffer);
+            if (n == -1) return -1;
+            if (n < 0 || received + n > length || (!write_failed && pwrite_all(fd, buffer, n, offset + received) < 0))
+                write_failed = 1;
+            if (n > 0) received += n;
+            continue;
+        }
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) handle_error(errno, "Socket failed");
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) handle_error(errno, "Setsockopt failed");
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t n = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+            if (recv_all(sock, buffer, n) < 0) return -1;
+            if (received + n > length) write_failed = 1;
+            if (!write_failed && pwrite_all(fd, buffer, n, offset + received) < 0) write_failed = 1;
+            received += n;
+            remaining -= n;
+        }
+    }
+    return -1;
+}
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+#ifdef USE_JOURNAL
+// Write-ahead journal for the .c files S1 stores itself (build with -DUSE_JOURNAL), the same
+// as S2-S4's: uploads are received into <base_dir>.journal.d, and the journal thread commits
+// them in groups with one syncfs() and one fdatasync() of <base_dir>.journal per round before
+// renaming them into place and letting uploadf reply. Startup replays a committed round and
+// discards anything else left in the staging directory.
+typedef struct journal_entry {
+    const char *staged;         // file to move into place, or NULL if it was written in place
+    const char *full_path, *rel_path;
+    uint64_t size;
+    time_t mtime;
+    int rc, done;               // rc is 0 once the file is durable in place
+    struct journal_entry *next;
+} journal_entry;
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) handle_error(errno, "Bind failed");
-    if (listen(server_fd, 5) < 0) handle_error(errno, "Listen failed");
+char journal_path[300], journal_dir[300];
+int journal_fd = -1;
+unsigned long long journal_seq;
+journal_entry *journal_head, *journal_tail;
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_work = PTHREAD_COND_INITIALIZER, journal_done = PTHREAD_COND_INITIALIZER;
 
-    debug_print("Server listening on port %d\n", PORT);
-    create_directory(base_dir);
+// Writes one round's records and trailer over the old journal; -1 if they may not be on disk
+int journal_write(journal_entry *batch) {
+    char *records = NULL;
+    size_t length = 0, count = 0;
+    FILE *out = open_memstream(&records, &length);
+    if (!out) return -1;
+    for (journal_entry *e = batch; e; e = e->next, count++)
+        fprintf(out, "%s\t%s\n", e->staged ? e->staged : "-", e->rel_path);
+    if (fclose(out) != 0) { free(records); return -1; }
+
+    char trailer[64];
+    int n = snprintf(trailer, sizeof(trailer), "commit %zu %016llx\n", count, (unsigned long long)index_hash(records));
+    int rc = (ftruncate(journal_fd, 0) != 0 || pwrite_all(journal_fd, records, length, 0) < 0 ||
+              pwrite_all(journal_fd, trailer, n, length) < 0 || fdatasync(journal_fd) != 0) ? -1 : 0;
+    free(records);
+    return rc;
+}
 
+void *journal_main(void *arg) {
+    (void)arg;
     while (1) {
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen)) < 0) continue;
-        pid_t pid = fork();
-        if (pid == 0) {
-            close(server_fd);
-            prcclient(new_socket);
-        } else {
-            close(new_socket);
-            waitpid(-1, NULL, WNOHANG);
+        pthread_mutex_lock(&journal_lock);
+        while (!journal_head) pthread_cond_wait(&journal_work, &journal_lock);
+        journal_entry *batch = journal_head;
+        journal_head = journal_tail = NULL;
+        pthread_mutex_unlock(&journal_lock);
+
+        // Flushes this round's files and the previous round's renames in one go
+        int rc = (syncfs(journal_fd) != 0 || journal_write(batch) < 0) ? -1 : 0;
+        if (rc < 0) debug_print("Journal commit failed: %s\n", strerror(errno));
+        __atomic_add_fetch(&metrics.journal_commits, 1, __ATOMIC_RELAXED);
+        for (journal_entry *e = batch; e; e = e->next) {
+            e->rc = rc;
+            if (e->staged && (rc < 0 || rename(e->staged, e->full_path) != 0)) {
+                remove(e->staged);
+                e->rc = -1;
+            }
+            if (e->rc == 0) index_add(e->rel_path, e->size, e->mtime);
+            __atomic_add_fetch(&metrics.journal_files, 1, __ATOMIC_RELAXED);
+        }
+
+        // Waiters cannot return (and take their entries with them) before the unlock
+        pthread_mutex_lock(&journal_lock);
+        for (journal_entry *e = batch; e; e = e->next) e->done = 1;
+        pthread_cond_broadcast(&journal_done);
+        pthread_mutex_unlock(&journal_lock);
+    }
+    return NULL;
+}
+
+// Hands a received file to the journal thread and waits for its group commit
+int journal_commit(const char *staged, const char *full_path, const char *rel_path, uint64_t size, time_t mtime) {
+    journal_entry e = { staged, full_path, rel_path, size, mtime, -1, 0, NULL };
+    pthread_mutex_lock(&journal_lock);
+    if (journal_tail) journal_tail->next = &e;
+    else journal_head = &e;
+    journal_tail = &e;
+    pthread_cond_signal(&journal_work);
+    while (!e.done) pthread_cond_wait(&journal_done, &journal_lock);
+    pthread_mutex_unlock(&journal_lock);
+    return e.rc;
+}
+
+// Replays the last round if its trailer checks out, clears the journal and the staging
+// directory, and starts the journal thread. Runs before part_load(), whose temp files
+// committed uploads may still have to be moved from.
+void journal_load(void) {
+    snprintf(journal_path, sizeof(journal_path), "%s.journal", base_dir);
+    snprintf(journal_dir, sizeof(journal_dir), "%s.journal.d", base_dir);
+    mkdir(journal_dir, 0755);
+    journal_fd = open(journal_path, O_RDWR | O_CREAT, 0644);
+    if (journal_fd < 0) handle_error(errno, "Journal open failed");
+
+    struct stat st;
+    char *text = NULL;
+    ssize_t n = -1;
+    if (fstat(journal_fd, &st) == 0 && (text = malloc(st.st_size + 1))) n = pread(journal_fd, text, st.st_size, 0);
+    size_t replayed = 0, discarded = 0;
+    if (n > 0 && text[n - 1] == '\n') {
+        text[n - 1] = '\0';
+        char *trailer = strrchr(text, '\n');
+        trailer = trailer ? trailer + 1 : text;
+        size_t count;
+        unsigned long long sum;
+        if (sscanf(trailer, "commit %zu %llx", &count, &sum) == 2) {
+            *trailer = '\0';
+            if (index_hash(text) != sum) trailer = NULL;
+        } else {
+            trailer = NULL;
+        }
+        for (char *line = text, *next; trailer && *line; line = next) {
+            next = strchr(line, '\n');
+            *next++ = '\0';
+            char *rel_path = strchr(line, '\t'), full_path[BUFFER_SIZE];
+            if (!rel_path) continue;
+            *rel_path++ = '\0';
+            snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, rel_path);
+            if (strcmp(line, "-") != 0) rename(line, full_path);
+            if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode)) {
+                index_add(rel_path, st.st_size, st.st_mtime);
+                replayed++;
+            }
+        }
+    }
+    free(text);
+    if (syncfs(journal_fd) != 0 || ftruncate(journal_fd, 0) != 0 || fdatasync(journal_fd) != 0)
+        handle_error(errno, "Journal reset failed");
+
+    DIR *dir = opendir(journal_dir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        char path[BUFFER_SIZE];
+        snprintf(path, sizeof(path), "%s/%s", journal_dir, entry->d_name);
+        if (remove(path) == 0) discarded++;
+    }
+    if (dir) closedir(dir);
+    debug_print("Journal: %zu files replayed, %zu uncommitted discarded\n", replayed, discarded);
+
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, journal_main, NULL);
+    if (err) handle_error(err, "pthread_create failed");
+    pthread_detach(tid);
+}
+#endif
+
+#ifndef USE_JOURNAL
+unsigned long long stage_seq;
+#endif
+
+// Where an upload body is written before store_commit(): a temp file of its own beside the
+// destination (swept by index_walk() if a crash leaves it behind), or with the journal a
+// fresh file in the staging directory. Returns -1 if the name does not fit in `size`.
+int stage_path(const char *full_path, char *path, size_t size) {
+#ifdef USE_JOURNAL
+    (void)full_path;
+    int n = snprintf(path, size, "%s/%llu", journal_dir, __atomic_add_fetch(&journal_seq, 1, __ATOMIC_RELAXED));
+#else
+    int n = snprintf(path, size, "%s.%llu.tmp", full_path, __atomic_add_fetch(&stage_seq, 1, __ATOMIC_RELAXED));
+#endif
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+// Makes a received file part of the store: moves it from `staged` to full_path and indexes
+// it. With the journal this returns once it is durable.
+int store_commit(const char *staged, const char *full_path, const char *rel_path, uint64_t size, time_t mtime) {
+#ifdef USE_JOURNAL
+    return journal_commit(staged, full_path, rel_path, size, mtime);
+#else
+    if (rename(staged, full_path) != 0) {
+        remove(staged);
+        return -1;
+    }
+    index_add(rel_path, size, mtime);
+    return 0;
+#endif
+}
+
+// Moves `length` payload bytes between sockets. With ZERO_COPY the bytes go source socket ->
+// pipe -> destination socket via splice() and never enter user space; if the kernel refuses
+// to splice these descriptors the rest is copied through a buffer. Returns 0 on success, -1 if
+// the source failed and -2 if the destination failed. With `drain` set, a destination failure
+// still consumes the rest of the payload from the source so its stream stays framed.
+int relay_payload(int from, int to, uint64_t length, int drain) {
+    char buffer[CHUNK_SIZE];
+    int pipefd[2] = {-1, -1};
+    if (ZERO_COPY && length > 0 && pipe(pipefd) == 0) fcntl(pipefd[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+
+    int rc = 0;
+    while (length > 0 && rc == 0) {
+        size_t want = length < RELAY_PIPE_SIZE ? length : RELAY_PIPE_SIZE;
+        if (pipefd[0] >= 0) {
+            ssize_t in = splice(from, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in < 0 && errno == EINTR) continue;
+            if (in < 0 && errno == EINVAL) {
+                close(pipefd[0]); close(pipefd[1]); pipefd[0] = pipefd[1] = -1;
+                continue;
+            }
+            if (in <= 0) { rc = -1; break; }
+            // Hint MORE only mid-payload; otherwise the tail can sit corked until the next write
+            unsigned int out_flags = (uint64_t)in < length ? SPLICE_F_MOVE | SPLICE_F_MORE : SPLICE_F_MOVE;
+            for (ssize_t left = in; left > 0; ) {
+                ssize_t out = splice(pipefd[0], NULL, to, NULL, left, out_flags);
+                if (out < 0 && errno == EINTR) continue;
+                if (out <= 0) { rc = -2; break; }
+                left -= out;
+                __atomic_add_fetch(&metrics.bytes_out, out, __ATOMIC_RELAXED);
+            }
+            if (rc == 0) __atomic_add_fetch(&relay_stats.zero_copy_bytes, in, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&metrics.bytes_in, in, __ATOMIC_RELAXED);
+            length -= in;
+        } else {
+            size_t n = want < CHUNK_SIZE ? want : CHUNK_SIZE;
+            if (recv_all(from, buffer, n) < 0) { rc = -1; break; }
+            if (send_all(to, buffer, n, 0) < 0) rc = -2;
+            else __atomic_add_fetch(&relay_stats.copied_bytes, n, __ATOMIC_RELAXED);
+            length -= n;
+        }
+    }
+    if (pipefd[0] >= 0) { close(pipefd[0]); close(pipefd[1]); }
+    if (rc == -2 && drain && skip_payload(from, length) < 0) rc = -1;
+    return rc;
+}
+
+// Forwards frames from a backend to the client until END or ERROR, re-tagging them with `req_id`.
+// Returns 0 after END, -2 after a relayed ERROR and -1 if the backend went away; in the latter
+// case a failure mid-payload leaves the client stream unframeable, so the client is shut down.
+int relay_stream(int from, int to, uint32_t req_id) {
+    frame_hdr hdr;
+    while (recv_frame_hdr(from, &hdr) == 0 && hdr.req_id == req_id) {
+        if (send_frame_hdr(to, hdr.opcode, hdr.flags, req_id, hdr.length) < 0) return -1;
+        if (relay_payload(from, to, hdr.length, 0) < 0) {
+            shutdown(to, SHUT_RDWR);
+            return -1;
+        }
+        if (hdr.opcode == OP_END) {
+            debug_print("Relay totals: %llu bytes zero-copy, %llu bytes copied\n",
+                        relay_stats.zero_copy_bytes, relay_stats.copied_bytes);
+            return 0;
+        }
+        if (hdr.opcode == OP_ERROR) return -2;
+    }
+    send_text(to, OP_ERROR, req_id, "ERROR: Storage server connection lost");
+    return -1;
+}
+
+// Connection pool: connected sockets to each storage server are kept open between requests.
+// A connection carries one tagged request at a time, so concurrent requests each take their
+// own pooled connection rather than interleaving large bodies on one socket. Storage servers
+// are known by their port, which is therefore unique across all instances (see shard_load);
+// entries are only ever added, so lookups need no lock.
+#define MAX_BACKENDS 64          // storage server instances across all types
+#define POOL_DOWN_SECS 5         // a server that refused a connection or stalled is avoided this long
+#define POOL_HELLO_TIMEOUT_MS 1000 // a server that accepts but does not answer HELLO counts as down
+#define POOL_IO_TIMEOUT_SECS 60  // a pooled connection that stalls this long mid-exchange is dropped
+
+typedef struct {
+    int port;
+    struct sockaddr_in addr;
+    int idle[POOL_SIZE];
+    time_t idle_since[POOL_SIZE];
+    int idle_count;
+    int lz4;                    // the server answered HELLO with lz4: it takes and sends LZ4 frames
+    int busy;                   // connections handed out and not yet released
+    time_t down_until;          // set when a connection attempt fails or a read stalls
+    pthread_mutex_t lock;
+} backend_pool;
+
+backend_pool pools[MAX_BACKENDS];
+int pool_count;
+pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;  // serialises additions
+
+backend_pool *pool_for_port(int port) {
+    int count = __atomic_load_n(&pool_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++)
+        if (pools[i].port == port) return &pools[i];
+    return NULL;
+}
+
+// Registers the storage server at host:port; returns NULL or the reason it cannot be used
+const char *pool_add(const char *host, int port) {
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(port) };
+    if (port <= 0 || port > 65535) return "invalid port";
+    if (inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+        struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res;
+        if (getaddrinfo(host, NULL, &hints, &res) != 0) return "unknown host";
+        sa.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+        freeaddrinfo(res);
+    }
+
+    pthread_mutex_lock(&pools_lock);
+    backend_pool *pool = pool_for_port(port);
+    const char *err = NULL;
+    if (pool && pool->addr.sin_addr.s_addr != sa.sin_addr.s_addr) err = "port already used by another host";
+    else if (!pool && pool_count == MAX_BACKENDS) err = "too many storage servers";
+    else if (!pool) {
+        pool = &pools[pool_count];
+        pool->port = port;
+        pool->addr = sa;
+        pool->idle_count = 0;
+        pool->busy = 0;
+        pool->down_until = 0;
+        pthread_mutex_init(&pool->lock, NULL);
+        __atomic_store_n(&pool_count, pool_count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pools_lock);
+    return err;
+}
+
+int connect_backend(int port) {
+    backend_pool *pool = pool_for_port(port);
+    int sock = pool ? socket(AF_INET, SOCK_STREAM, 0) : -1;
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr*)&pool->addr, sizeof(pool->addr)) < 0) {
+        debug_print("Connect to port %d failed: %s\n", port, strerror(errno));
+        __atomic_add_fetch(&metrics.backend_errors, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&pool->down_until, time(NULL) + POOL_DOWN_SECS, __ATOMIC_RELAXED);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// A backend that closed or reset an idle connection leaves it readable; anything else
+// unread means the stream is out of sync. Long-idle connections must also answer a PING.
+int pool_healthy(int sock, time_t idle_since) {
+    char c;
+    ssize_t n = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return 0;
+    if (time(NULL) - idle_since < POOL_PING_IDLE_SECS) return 1;
+
+    frame_hdr hdr;
+    char pong[16];
+    return send_text(sock, OP_CMD, 0, "PING") == 0 &&
+           recv_msg(sock, &hdr, pong, sizeof(pong)) == 0 && hdr.opcode == OP_RESP;
+}
+
+// Takes a healthy idle connection to `port` from the pool, or opens a new one
+int pool_acquire(int port) {
+    backend_pool *pool = pool_for_port(port);
+    while (pool) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->idle_count == 0) { pthread_mutex_unlock(&pool->lock); break; }
+        int sock = pool->idle[--pool->idle_count];
+        time_t since = pool->idle_since[pool->idle_count];
+        pthread_mutex_unlock(&pool->lock);
+
+        if (pool_healthy(sock, since)) {
+            __atomic_add_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
+            return sock;
+        }
+        debug_print("Dropping stale connection to port %d\n", port);
+        close(sock);
+    }
+    int sock = connect_backend(port);
+    if (sock >= 0 && pool) {
+        frame_hdr hdr;
+        char hello[64];
+        struct timeval tv = { POOL_HELLO_TIMEOUT_MS / 1000, POOL_HELLO_TIMEOUT_MS % 1000 * 1000 };
+        struct timeval io = { .tv_sec = POOL_IO_TIMEOUT_SECS };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (send_text(sock, OP_CMD, 0, "HELLO lz4") < 0 || recv_msg(sock, &hdr, hello, sizeof(hello)) < 0) {
+            __atomic_add_fetch(&metrics.backend_errors, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&pool->down_until, time(NULL) + POOL_DOWN_SECS, __ATOMIC_RELAXED);
+            close(sock);
+            return -1;
+        }
+        // A backend that accepts work and then stalls must not hold a worker forever: a recv or
+        // send that times out fails like a broken connection, which is never pooled again
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &io, sizeof(io));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &io, sizeof(io));
+        pool->lz4 = hdr.opcode == OP_RESP && strstr(hello, "lz4") != NULL;
+        __atomic_add_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
+    }
+    return sock;
+}
+
+// Hands a connection back; `reusable` must be 0 if the exchange ended with the stream out of sync
+void pool_release(int port, int sock, int reusable) {
+    if (sock < 0) return;
+    backend_pool *pool = pool_for_port(port);
+    if (pool) __atomic_sub_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
+    if (pool && reusable) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->idle_count < POOL_SIZE) {
+            pool->idle[pool->idle_count] = sock;
+            pool->idle_since[pool->idle_count++] = time(NULL);
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    close(sock);
+}
+
+// Runs a one-frame command/one-frame reply exchange on a pooled connection. If the
+// connection turns out to be dead the request is retried once on a fresh one; a server that
+// timed out is marked down instead of being waited on a second time.
+int backend_request(int port, uint32_t req_id, const char *command, frame_hdr *hdr, char *response, size_t size) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int sock = pool_acquire(port);
+        if (sock < 0) return -1;
+        errno = 0;
+        if (send_text(sock, OP_CMD, req_id, command) == 0 &&
+            recv_msg(sock, hdr, response, size) == 0 && hdr->req_id == req_id) {
+            pool_release(port, sock, 1);
+            return 0;
+        }
+        int stalled = errno == EAGAIN || errno == EWOULDBLOCK;
+        pool_release(port, sock, 0);
+        if (stalled) {
+            debug_print("Storage server on port %d timed out\n", port);
+            __atomic_add_fetch(&metrics.backend_errors, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&pool_for_port(port)->down_until, time(NULL) + POOL_DOWN_SECS, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Sharding: the files of each backend type are spread over any number of storage server
+// instances by a consistent-hash ring. Every instance owns SHARD_VNODES points on its type's
+// ring and a file belongs to the first point at or after the hash of its path, so adding an
+// instance only moves the files that land on its new points (about 1/n of them). Instances
+// are listed in <base_dir>.shards, one type per line:
+//     pdf 7041 7044 10.0.0.7:7045
+// with S2, S3 and S4 standing alone on any type that is not listed. `rebalance` re-reads the
+// file and moves files to their new owners.
+//
+// A "replicas <n>" line keeps every file on its owner and the next n-1 distinct instances
+// clockwise on the ring. Uploads go to all of them and succeed once a majority has the file;
+// downloads go to the least busy one (see replica_retrieve); a background pass copies files
+// to replicas that missed them (see shard_reconcile).
+#define SHARD_VNODES 128         // ring points per instance
+#define MAX_SHARDS 16            // instances per type
+#define MAX_REPLICAS 5           // copies of a file
+
+typedef struct {
+    uint64_t hash;
+    int port;
+} ring_point;
+
+typedef struct {
+    int ports[MAX_SHARDS];
+    int count;
+    ring_point *points;          // count * SHARD_VNODES, sorted by hash
+} shard_ring;
+
+shard_ring shard_rings[C_FILE];  // one per backend type
+int shard_replicas = 1;
+pthread_rwlock_t shard_lock = PTHREAD_RWLOCK_INITIALIZER;
+const char *shard_type_names[C_FILE] = { "pdf", "txt", "zip" };
+
+// FNV-1a spreads short similar strings poorly over the top bits; this finalizer (splitmix64) fixes that
+uint64_t shard_hash(const char *s) {
+    uint64_t h = index_hash(s);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+int ring_point_cmp(const void *a, const void *b) {
+    const ring_point *x = a, *y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash ? 1 : x->port - y->port;
+}
+
+// Storage servers holding rel_path, a backend-type file: its owner first, then the next
+// distinct instances clockwise. Returns how many (shard_replicas, or fewer for a small type).
+int shard_owners(file_type type, const char *rel_path, int *ports) {
+    uint64_t h = shard_hash(rel_path);
+    pthread_rwlock_rdlock(&shard_lock);
+    const shard_ring *ring = &shard_rings[type];
+    size_t points = (size_t)ring->count * SHARD_VNODES, lo = 0, hi = points;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ring->points[mid].hash < h) lo = mid + 1; else hi = mid;
+    }
+    int wanted = shard_replicas < ring->count ? shard_replicas : ring->count, count = 0;
+    for (size_t i = lo; count < wanted; i++) {
+        int port = ring->points[i % points].port, seen = 0;
+        for (int j = 0; j < count; j++) seen |= ports[j] == port;
+        if (!seen) ports[count++] = port;
+    }
+    pthread_rwlock_unlock(&shard_lock);
+    return count;
+}
+
+// Storage server owning rel_path, a backend-type file
+int shard_port(file_type type, const char *rel_path) {
+    int ports[MAX_REPLICAS];
+    shard_owners(type, rel_path, ports);
+    return ports[0];
+}
+
+// Copies of each file of `type`
+int shard_copies(file_type type) {
+    pthread_rwlock_rdlock(&shard_lock);
+    int copies = shard_replicas < shard_rings[type].count ? shard_replicas : shard_rings[type].count;
+    pthread_rwlock_unlock(&shard_lock);
+    return copies;
+}
+
+// Copies the instances of `type` into ports; returns how many there are
+int shard_list(file_type type, int *ports) {
+    pthread_rwlock_rdlock(&shard_lock);
+    int count = shard_rings[type].count;
+    memcpy(ports, shard_rings[type].ports, count * sizeof(int));
+    pthread_rwlock_unlock(&shard_lock);
+    return count;
+}
+
+// Builds the ring of `type` from its instances' ports
+void shard_build(shard_ring *ring, const int *ports, int count) {
+    ring->count = count;
+    memcpy(ring->ports, ports, count * sizeof(int));
+    ring->points = malloc((size_t)count * SHARD_VNODES * sizeof(ring_point));
+    if (!ring->points) { perror("malloc failed"); exit(EXIT_FAILURE); }
+    for (int i = 0; i < count; i++) {
+        for (int v = 0; v < SHARD_VNODES; v++) {
+            char name[32];
+            snprintf(name, sizeof(name), "%d#%d", ports[i], v);
+            ring->points[i * SHARD_VNODES + v] = (ring_point){ shard_hash(name), ports[i] };
+        }
+    }
+    qsort(ring->points, (size_t)count * SHARD_VNODES, sizeof(ring_point), ring_point_cmp);
+}
+
+// (Re)reads <base_dir>.shards and swaps in the new rings; returns NULL or what was wrong with
+// the file, in which case the rings are left as they were
+const char *shard_load(char *err, size_t size) {
+    int ports[C_FILE][MAX_SHARDS], counts[C_FILE] = { 0 }, replicas = 1;
+    char path[300], line[BUFFER_SIZE];
+    snprintf(path, sizeof(path), "%s.shards", base_dir);
+    FILE *file = fopen(path, "r");
+    for (int n = 1; file && fgets(line, sizeof(line), file); n++) {
+        char *save = NULL, *word = strtok_r(line, " \t\r\n", &save);
+        if (!word || word[0] == '#') continue;
+        if (strcmp(word, "replicas") == 0) {
+            word = strtok_r(NULL, " \t\r\n", &save);
+            replicas = word ? atoi(word) : 0;
+            if (replicas >= 1 && replicas <= MAX_REPLICAS) continue;
+            snprintf(err, size, "%s line %d: replicas must be 1 to %d", path, n, MAX_REPLICAS);
+            fclose(file);
+            return err;
+        }
+        int type = 0;
+        while (type < C_FILE && strcmp(word + (word[0] == '.'), shard_type_names[type]) != 0) type++;
+        const char *problem = type == C_FILE ? "unknown file type" : counts[type] ? "type listed twice" : NULL;
+        while (!problem && (word = strtok_r(NULL, " \t\r\n", &save))) {
+            char *colon = strrchr(word, ':');
+            if (colon) *colon = '\0';
+            if (counts[type] == MAX_SHARDS) problem = "too many instances";
+            else problem = pool_add(colon ? word : "127.0.0.1", atoi(colon ? colon + 1 : word));
+            if (!problem) ports[type][counts[type]++] = atoi(colon ? colon + 1 : word);
+        }
+        if (!problem && type < C_FILE && counts[type] == 0) problem = "no instances";
+        if (problem) {
+            snprintf(err, size, "%s line %d: %s", path, n, problem);
+            fclose(file);
+            return err;
+        }
+    }
+    if (file) fclose(file);
+
+    int defaults[C_FILE] = { S2_PORT, S3_PORT, S4_PORT };
+    shard_ring rings[C_FILE];
+    for (int type = 0; type < C_FILE; type++) {
+        if (counts[type] == 0) {
+            pool_add("127.0.0.1", defaults[type]);
+            ports[type][counts[type]++] = defaults[type];
+        }
+    }
+    // A storage server serves one type, so no port may appear twice
+    for (int type = 0; type < C_FILE; type++)
+        for (int i = 0; i < counts[type]; i++)
+            for (int other = type; other < C_FILE; other++)
+                for (int j = other == type ? i + 1 : 0; j < counts[other]; j++)
+                    if (ports[type][i] == ports[other][j]) {
+                        snprintf(err, size, "%s: port %d listed twice", path, ports[type][i]);
+                        return err;
+                    }
+
+    for (int type = 0; type < C_FILE; type++) shard_build(&rings[type], ports[type], counts[type]);
+    pthread_rwlock_wrlock(&shard_lock);
+    for (int type = 0; type < C_FILE; type++) {
+        free(shard_rings[type].points);
+        shard_rings[type] = rings[type];
+    }
+    shard_replicas = replicas;
+    pthread_rwlock_unlock(&shard_lock);
+    return NULL;
+}
+
+// void create_directory(const char *path) {
+//     struct stat st;
+//     if (stat(path, &st) == 0) return;
+//     if (mkdir(path, 0777) == -1 && errno != EEXIST) handle_error(errno, "mkdir failed");
+// }
+void create_directory(const char *path) {
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+
+    char *p = tmp;
+    while (*p == '/') p++;  // Skip leading slashes
+
+    for (; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(tmp, 0777);
+            *p = '/';
+        }
+    }
+    mkdir(tmp, 0777);
+}
+
+file_type get_file_type(const char *filename){
+    const char *ext = strrchr(filename, '.');
+    if (!ext) return C_FILE;
+    if (strcmp(ext, ".pdf") == 0) return PDF;
+    if (strcmp(ext, ".txt") == 0) return TXT;
+    if (strcmp(ext, ".zip") == 0) return ZIP;
+    return C_FILE;
+}
+
+// Sends a command frame to a storage server and waits for its acknowledgment. Returns 0 on
+// RESP, -2 if the server answered with an ERROR (copied into `reply`) and -1 if the exchange failed.
+int send_command_to_storage(int sock, uint32_t req_id, const char *command, char *reply, size_t size) {
+    frame_hdr hdr;
+    if (send_text(sock, OP_CMD, req_id, command) < 0) return -1;
+    if (recv_msg(sock, &hdr, reply, size) < 0 || hdr.req_id != req_id) return -1;
+    return hdr.opcode == OP_RESP ? 0 : -2;
+}
+
+// The STORE command for an upload to rel_path. It carries the upload's mtime, set by S1, so
+// that every replica of the file ends up with the same one.
+void store_command(const char *rel_path, time_t mtime, char *command, size_t size) {
+    char *dc1 = expand_path(rel_path), *dc2 = expand_path(rel_path);
+    snprintf(command, size, "STORE %s %s %lld", dirname(dc2), basename(dc1), (long long)mtime);
+    free(dc1); free(dc2);
+}
+
+#define STORE_LAG_MS 100         // a replica is waited for this long once a quorum has answered
+
+// A body transfer to the replicas of one file, or to the single server of a PPART
+typedef struct {
+    int count;
+    int ports[MAX_REPLICAS];
+    int socks[MAX_REPLICAS];     // -1 once that server has failed or answered
+} store_group;
+
+// Servers that must store a file before its upload succeeds: a majority of the group
+int store_quorum(const store_group *g) {
+    return g->count / 2 + 1;
+}
+
+// Gives up on member i mid-transfer; closing the connection makes it discard the partial file
+void store_drop(store_group *g, int i) {
+    if (g->socks[i] < 0) return;
+    debug_print("Storage server on port %d failed mid-upload\n", g->ports[i]);
+    pool_release(g->ports[i], g->socks[i], 0);
+    g->socks[i] = -1;
+}
+
+// Waits for a reply from the members in `pending` that have not answered yet, until all have
+// or `done` members have and another STORE_LAG_MS has passed (POOL_IO_TIMEOUT_SECS while no
+// member has). Returns the index of one that has something to read, or -1 when there is no
+// more to wait for.
+int store_wait(const store_group *g, const int *pending, int done) {
+    while (1) {
+        struct pollfd fds[MAX_REPLICAS];
+        int members[MAX_REPLICAS], n = 0;
+        for (int i = 0; i < g->count; i++)
+            if (pending[i] && g->socks[i] >= 0) { fds[n] = (struct pollfd){ .fd = g->socks[i], .events = POLLIN }; members[n++] = i; }
+        if (n == 0) return -1;
+        int ready = poll(fds, n, done ? STORE_LAG_MS : POOL_IO_TIMEOUT_SECS * 1000);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return -1;
+        for (int k = 0; k < n; k++)
+            if (fds[k].revents) return members[k];
+    }
+}
+
+// Opens a body transfer for `command` (STORE or PPART) on a pooled connection to each member,
+// all asked before any reply is read. Members that refuse, or lag behind a quorum, are left
+// out. Returns how many accepted, or 0 with the reason copied into `response` if that is short
+// of a quorum.
+int store_open(store_group *g, uint32_t req_id, const char *command, char *response, size_t size) {
+    int pending[MAX_REPLICAS], open = 0, i;
+    snprintf(response, size, "ERROR: Storage server failed");
+    for (i = 0; i < g->count; i++) {
+        g->socks[i] = pool_acquire(g->ports[i]);
+        if (g->socks[i] >= 0 && send_text(g->socks[i], OP_CMD, req_id, command) < 0) store_drop(g, i);
+        pending[i] = 1;
+    }
+    while ((i = store_wait(g, pending, open >= store_quorum(g))) >= 0) {
+        frame_hdr hdr;
+        char reply[BUFFER_SIZE];
+        pending[i] = 0;
+        if (recv_msg(g->socks[i], &hdr, reply, sizeof(reply)) < 0 || hdr.req_id != req_id) {
+            store_drop(g, i);
+        } else if (hdr.opcode != OP_RESP) {
+            snprintf(response, size, "%s", reply);
+            pool_release(g->ports[i], g->socks[i], 1);
+            g->socks[i] = -1;
+        } else {
+            open++;
+        }
+    }
+    for (i = 0; i < g->count; i++)
+        if (pending[i] || open < store_quorum(g)) store_drop(g, i);
+    return open >= store_quorum(g) ? open : 0;
+}
+
+// Passes one of the client's DATA frames on to several members: a compressed frame is read
+// whole and decoded for members that predate wire compression, a plain one goes on
+// CHUNK_SIZE bytes at a time. Returns -1 if the client connection broke.
+int store_fanout(int client_sock, uint32_t req_id, store_group *g, const frame_hdr *hdr) {
+    if (hdr->flags & FLAG_LZ4) {
+        unsigned char in[4 + LZ4_BLOCK];
+        char block[LZ4_BLOCK];
+        long raw = 0;
+        if (hdr->length > sizeof(in)) {
+            for (int i = 0; i < g->count; i++) store_drop(g, i);
+            return skip_payload(client_sock, hdr->length);
+        }
+        if (recv_all(client_sock, in, hdr->length) < 0) return -1;
+        for (int i = 0; i < g->count; i++) {
+            if (g->socks[i] < 0) continue;
+            int sent;
+            if (pool_for_port(g->ports[i])->lz4) {
+                sent = send_frame(g->socks[i], OP_DATA, FLAG_LZ4, req_id, in, hdr->length);
+            } else {
+                if (raw == 0) raw = lz4_unframe(in, hdr->length, block);
+                sent = raw < 0 ? -1 : send_frame(g->socks[i], OP_DATA, 0, req_id, block, raw);
+            }
+            if (sent < 0) store_drop(g, i);
+        }
+        return 0;
+    }
+
+    char chunk[CHUNK_SIZE];
+    for (int i = 0; i < g->count; i++)
+        if (g->socks[i] >= 0 && send_frame_hdr(g->socks[i], OP_DATA, 0, req_id, hdr->length) < 0) store_drop(g, i);
+    for (uint64_t left = hdr->length; left > 0;) {
+        size_t n = left < sizeof(chunk) ? left : sizeof(chunk);
+        if (recv_all(client_sock, chunk, n) < 0) return -1;
+        for (int i = 0; i < g->count; i++)
+            if (g->socks[i] >= 0 && send_all(g->socks[i], chunk, n, 0) < 0) store_drop(g, i);
+        left -= n;
+    }
+    return 0;
+}
+
+// Relays the client's body frames to the group up to the END (or ERROR, which sets *aborted).
+// A member that fails part-way is dropped; once none is left the rest of the body is drained
+// so the client connection stays in sync. Returns -1 if the client connection broke.
+int store_body(int client_sock, uint32_t req_id, store_group *g, int *aborted) {
+    frame_hdr hdr;
+    *aborted = 0;
+    while (1) {
+        if (recv_frame_hdr(client_sock, &hdr) < 0) return -1;
+        if (hdr.opcode != OP_DATA) {
+            *aborted = hdr.opcode != OP_END;
+            return *aborted && skip_payload(client_sock, hdr.length) < 0 ? -1 : 0;
+        }
+        int live = 0, only = -1;
+        for (int i = 0; i < g->count; i++)
+            if (g->socks[i] >= 0) { live++; only = i; }
+        if (live == 0) {
+            if (skip_payload(client_sock, hdr.length) < 0) return -1;
+            continue;
+        }
+        if (live > 1 || ((hdr.flags & FLAG_LZ4) && !pool_for_port(g->ports[only])->lz4)) {
+            if (store_fanout(client_sock, req_id, g, &hdr) < 0) return -1;
+            continue;
+        }
+        // A single server takes the frame as it is, spliced through without a copy
+        int rc = send_frame_hdr(g->socks[only], OP_DATA, hdr.flags & FLAG_LZ4, req_id, hdr.length) < 0 ? -2
+                 : relay_payload(client_sock, g->socks[only], hdr.length, 1);
+        if (rc == -1) return -1;
+        if (rc == -2) store_drop(g, only);
+    }
+}
+
+// Ends a body transfer: an END commits the file on each member, an ERROR (`abort`) makes them
+// discard the partial copy. Members it cannot be sent to are dropped; returns how many remain.
+int store_end(store_group *g, uint32_t req_id, int abort) {
+    int open = 0;
+    for (int i = 0; i < g->count; i++) {
+        if (g->socks[i] < 0) continue;
+        int sent = abort ? send_text(g->socks[i], OP_ERROR, req_id, "ERROR: Upload aborted")
+                         : send_frame(g->socks[i], OP_END, 0, req_id, NULL, 0);
+        if (sent < 0) store_drop(g, i); else open++;
+    }
+    return open;
+}
+
+// Collects the members' verdicts on an ended transfer and releases their connections. Returns
+// 1 once a quorum has stored the file; a member lagging STORE_LAG_MS behind that is not waited
+// for (its connection is closed, and the repair pass catches it up if it fails). Otherwise
+// the reason is in `response`.
+int store_result(store_group *g, uint32_t req_id, char *response, size_t size) {
+    int pending[MAX_REPLICAS], stored = 0, i;
+    snprintf(response, size, "ERROR: Storage server failed");
+    for (i = 0; i < g->count; i++) pending[i] = 1;
+    while ((i = store_wait(g, pending, stored >= store_quorum(g))) >= 0) {
+        frame_hdr hdr;
+        char reply[BUFFER_SIZE];
+        int replied = recv_msg(g->socks[i], &hdr, reply, sizeof(reply)) == 0 && hdr.req_id == req_id;
+        pool_release(g->ports[i], g->socks[i], replied);
+        g->socks[i] = -1;
+        if (replied && hdr.opcode == OP_RESP) stored++;
+        else if (replied && strncmp(reply, "ERROR", 5) == 0) snprintf(response, size, "%s", reply);
+    }
+    for (i = 0; i < g->count; i++) store_drop(g, i);
+    return stored >= store_quorum(g);
+}
+
+// Sends `command` (STORE or PPART) to the group, relays the client's body to it one frame at
+// a time, and replies to the client with `success` or a backend's error.
+// Returns -1 only when the client connection itself is broken.
+int forward_stream(int client_sock, uint32_t req_id, store_group *g, const char *command, const char *success) {
+    char response[BUFFER_SIZE];
+    store_open(g, req_id, command, response, sizeof(response));
+    int aborted;
+    int client_ok = store_body(client_sock, req_id, g, &aborted) == 0;
+
+    int stored = store_end(g, req_id, aborted || !client_ok) > 0 &&
+                 store_result(g, req_id, response, sizeof(response)) && !aborted && client_ok;
+    if (!client_ok) return -1;
+
+    if (stored) send_text(client_sock, OP_RESP, req_id, success);
+    else if (aborted) send_text(client_sock, OP_ERROR, req_id, "ERROR: Upload aborted by client");
+    else send_text(client_sock, OP_ERROR, req_id, response);
+    return 0;
+}
+
+// Streams an upload body from the client straight to the replicas of rel_path, all at once
+int forward_file(int client_sock, uint32_t req_id, const char *rel_path, file_type type){
+    char command[BUFFER_SIZE];
+    store_group g;
+    g.count = shard_owners(type, rel_path, g.ports);
+    store_command(rel_path, time(NULL), command, sizeof(command));
+    return forward_stream(client_sock, req_id, &g, command, "UPLOAD_SUCCESS");
+}
+
+// Replicated reads: a download goes to the replica with the fewest S1 connections in use
+// (servers that recently refused a connection or stalled go last), and if no reply has
+// started within HEDGE_DELAY_MS the same RETRIEVE is sent to the next replica too. Whichever
+// answers first is relayed and the other connection is dropped, so one slow or stalled
+// server costs a read at most the delay rather than its whole stall.
+#define HEDGE_DELAY_MS 50
+
+unsigned replica_rotor;  // spreads reads over equally busy replicas
+
+// The replicas of rel_path in the order they should be read from; returns how many
+int replica_order(file_type type, const char *rel_path, int *ports) {
+    int owners[MAX_REPLICAS], count = shard_owners(type, rel_path, owners);
+    unsigned start = __atomic_fetch_add(&replica_rotor, 1, __ATOMIC_RELAXED);
+    time_t now = time(NULL);
+    long load[MAX_REPLICAS];
+    for (int i = 0; i < count; i++) {
+        backend_pool *pool = pool_for_port(owners[(start + i) % count]);
+        ports[i] = pool->port;
+        load[i] = __atomic_load_n(&pool->busy, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&pool->down_until, __ATOMIC_RELAXED) > now) load[i] += 1L << 30;
+        for (int j = i; j > 0 && load[j] < load[j - 1]; j--) {
+            long l = load[j]; load[j] = load[j - 1]; load[j - 1] = l;
+            int p = ports[j]; ports[j] = ports[j - 1]; ports[j - 1] = p;
+        }
+    }
+    return count;
+}
+
+// Looks at the header of the reply waiting on a backend connection without consuming it:
+// 1 if it is an ERROR, 0 if anything else, -1 if the connection is broken or out of sync
+int reply_peek(int sock, uint32_t req_id) {
+    unsigned char raw[FRAME_HDR_SIZE];
+    frame_hdr hdr;
+    if (recv(sock, raw, sizeof(raw), MSG_PEEK | MSG_WAITALL) != sizeof(raw) ||
+        decode_frame_hdr(raw, &hdr) < 0 || hdr.req_id != req_id) return -1;
+    return hdr.opcode == OP_ERROR;
+}
+
+// Sends `command` (a RETRIEVE) to ports[0], hedging to the next replica each time
+// HEDGE_DELAY_MS pass without a reply. An ERROR (a replica the repair pass has not caught up
+// yet) is held back while another replica may still have the file. Returns the connection
+// whose reply won, unread, with its port in *port; the others are dropped. -1 if no replica
+// answered, within POOL_IO_TIMEOUT_SECS of the last one being asked.
+int replica_retrieve(const int *ports, int count, uint32_t req_id, const char *command, int compress, int *port) {
+    int socks[MAX_REPLICAS], next = 0, waiting = 0, hedge = 0, winner = -1, refused = -1, stalled = 0;
+    while (winner < 0) {
+        if ((waiting == 0 || hedge) && next < count) {
+            int i = next++;
+            // Once a replica has answered that it lacks the file, one marked down is not waited on
+            socks[i] = -1;
+            if (refused >= 0 && __atomic_load_n(&pool_for_port(ports[i])->down_until, __ATOMIC_RELAXED) > time(NULL)) continue;
+            socks[i] = pool_acquire(ports[i]);
+            uint16_t flags = compress && pool_for_port(ports[i])->lz4 ? FLAG_LZ4 : 0;
+            if (socks[i] >= 0 && send_frame(socks[i], OP_CMD, flags, req_id, command, strlen(command)) < 0) {
+                pool_release(ports[i], socks[i], 0);
+                socks[i] = -1;
+            }
+            if (socks[i] >= 0) waiting++;
+            if (socks[i] >= 0 && hedge) __atomic_add_fetch(&metrics.hedged_reads, 1, __ATOMIC_RELAXED);
+            hedge = 0;
+            continue;
+        }
+        if (waiting == 0) break;
+
+        struct pollfd fds[MAX_REPLICAS];
+        int asked[MAX_REPLICAS], n = 0;
+        for (int i = 0; i < next; i++)
+            if (socks[i] >= 0 && i != refused) { fds[n] = (struct pollfd){ .fd = socks[i], .events = POLLIN }; asked[n++] = i; }
+        int ready = poll(fds, n, next < count ? HEDGE_DELAY_MS : POOL_IO_TIMEOUT_SECS * 1000);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) break;
+        if (ready == 0 && next == count) { stalled = 1; break; }
+        hedge = ready == 0;
+        for (int k = 0; k < n && winner < 0; k++) {
+            if (!fds[k].revents) continue;
+            int i = asked[k], peek = reply_peek(socks[i], req_id);
+            waiting--;
+            if (peek == 0) {
+                winner = i;
+            } else if (peek == 1 && refused < 0) {
+                refused = i;
+            } else {
+                frame_hdr hdr;
+                char reply[BUFFER_SIZE];
+                pool_release(ports[i], socks[i], peek == 1 && recv_msg(socks[i], &hdr, reply, sizeof(reply)) == 0);
+                socks[i] = -1;
+            }
+        }
+    }
+    if (winner < 0) winner = refused;
+    // A replica a hedge overtook, or that never answered, is avoided for a while, like one that is down
+    for (int i = 0; i < next; i++) {
+        if (i == winner || socks[i] < 0) continue;
+        if ((i < winner || stalled) && i != refused) __atomic_store_n(&pool_for_port(ports[i])->down_until, time(NULL) + POOL_DOWN_SECS, __ATOMIC_RELAXED);
+        pool_release(ports[i], socks[i], 0);
+    }
+    if (winner < 0) return -1;
+    *port = ports[winner];
+    return socks[winner];
+}
+
+// Hot-object cache: whole backend-resident files of up to CACHE_MAX_OBJECT bytes are kept in
+// memory and served without contacting S2/S3/S4. Admission follows 2Q: a file's first
+// request only records its path in a bounded FIFO of "ghosts", and a request for a ghost
+// copies the file into the main LRU as it is relayed, so files fetched once don't push out
+// the hot ones. uploadf/removef through S1 invalidate the path; a fill that raced with an
+// invalidation of that path is discarded when it completes.
+#define CACHE_MAX_OBJECT (8 * 1024 * 1024)  // larger files are always relayed from the backend
+#define CACHE_GHOSTS 8192                    // paths remembered after a single request
+#define CACHE_BUCKETS 16384
+
+typedef struct cache_entry {
+    char *path;
+    char *data;                  // NULL for a ghost
+    size_t size;
+    int refs;                    // one for the table plus one per download being served
+    uint64_t fill;               // token of the fill admitting a ghost, 0 if none
+    struct cache_entry *hash_next, *prev, *next;
+} cache_entry;
+
+typedef struct {
+    cache_entry *head, *tail;
+    size_t count;
+} cache_list;
+
+cache_entry *cache_table[CACHE_BUCKETS];
+cache_list cache_lru, cache_ghosts;
+size_t cache_bytes, cache_capacity = CACHE_BYTES;
+uint64_t cache_fill_seq;         // last fill token handed out
+struct {
+    unsigned long long hits, misses, fills, evictions;
+} cache_stats;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+cache_entry **cache_slot(const char *path) {
+    cache_entry **slot = &cache_table[index_hash(path) % CACHE_BUCKETS];
+    while (*slot && strcmp((*slot)->path, path) != 0) slot = &(*slot)->hash_next;
+    return slot;
+}
+
+void cache_list_remove(cache_list *list, cache_entry *e) {
+    if (e->prev) e->prev->next = e->next; else list->head = e->next;
+    if (e->next) e->next->prev = e->prev; else list->tail = e->prev;
+    e->prev = e->next = NULL;
+    list->count--;
+}
+
+void cache_list_push(cache_list *list, cache_entry *e) {
+    e->prev = NULL;
+    e->next = list->head;
+    if (list->head) list->head->prev = e; else list->tail = e;
+    list->head = e;
+    list->count++;
+}
+
+void cache_put(cache_entry *e) {
+    if (--e->refs > 0) return;
+    free(e->path);
+    free(e->data);
+    free(e);
+}
+
+// Drops an entry from the table and its list (cache_lock held); senders still using it keep it alive
+void cache_drop(cache_entry *e) {
+    *cache_slot(e->path) = e->hash_next;
+    if (e->data) {
+        cache_list_remove(&cache_lru, e);
+        cache_bytes -= e->size;
+    } else {
+        cache_list_remove(&cache_ghosts, e);
+    }
+    cache_put(e);
+}
+
+// Returns the cached copy of rel_path with a reference held (give it back with cache_release),
+// or NULL. On a miss *admit is the token to pass to cache_insert if this download should be
+// copied into the cache, or 0.
+cache_entry *cache_lookup(const char *rel_path, uint64_t *admit) {
+    *admit = 0;
+    if (cache_capacity == 0) return NULL;
+    pthread_mutex_lock(&cache_lock);
+    cache_entry *e = *cache_slot(rel_path);
+    if (e && e->data) {
+        cache_stats.hits++;
+        cache_list_remove(&cache_lru, e);
+        cache_list_push(&cache_lru, e);
+        e->refs++;
+        pthread_mutex_unlock(&cache_lock);
+        return e;
+    }
+    cache_stats.misses++;
+    if (e) {
+        if (!e->fill) e->fill = ++cache_fill_seq;
+        *admit = e->fill;
+    } else {
+        e = calloc(1, sizeof(*e));
+        if (!e || !(e->path = strdup(rel_path))) { perror("calloc failed"); exit(EXIT_FAILURE); }
+        e->refs = 1;
+        cache_entry **slot = cache_slot(rel_path);
+        e->hash_next = *slot;
+        *slot = e;
+        cache_list_push(&cache_ghosts, e);
+        if (cache_ghosts.count > CACHE_GHOSTS) cache_drop(cache_ghosts.tail);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+}
+
+void cache_release(cache_entry *e) {
+    pthread_mutex_lock(&cache_lock);
+    cache_put(e);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Adds a downloaded file (taking ownership of data) unless rel_path was invalidated, or
+// filled by another download, since cache_lookup handed out `fill`; least recently used
+// files are evicted to make room
+void cache_insert(const char *rel_path, char *data, size_t size, uint64_t fill) {
+    pthread_mutex_lock(&cache_lock);
+    cache_entry *e = *cache_slot(rel_path);
+    if (!e || e->data || e->fill != fill || size > cache_capacity) {
+        pthread_mutex_unlock(&cache_lock);
+        free(data);
+        return;
+    }
+    cache_drop(e);
+    while (cache_bytes + size > cache_capacity && cache_lru.tail) {
+        cache_drop(cache_lru.tail);
+        cache_stats.evictions++;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (!e || !(e->path = strdup(rel_path))) { perror("calloc failed"); exit(EXIT_FAILURE); }
+    e->data = data ? data : malloc(1);
+    e->size = size;
+    e->refs = 1;
+    cache_entry **slot = cache_slot(rel_path);
+    e->hash_next = *slot;
+    *slot = e;
+    cache_list_push(&cache_lru, e);
+    cache_bytes += size;
+    cache_stats.fills++;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Called whenever rel_path may have changed on its backend; fills of other paths carry on
+void cache_invalidate(const char *rel_path) {
+    pthread_mutex_lock(&cache_lock);
+    cache_entry *e = *cache_slot(rel_path);
+    if (e) cache_drop(e);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Sends n bytes from memory as DATA frames, LZ4 block by block while that pays off (see send_data)
+int send_body(int sock, uint32_t req_id, const char *data, size_t n, int *compress) {
+    size_t pos = 0;
+    while (*compress && pos < n) {
+        size_t k = n - pos < LZ4_BLOCK ? n - pos : LZ4_BLOCK;
+        if (send_data(sock, req_id, data + pos, k, compress) < 0) return -1;
+        pos += k;
+    }
+    return pos < n ? send_frame(sock, OP_DATA, 0, req_id, data + pos, n - pos) : 0;
+}
+
+// Serves a download (or a range of it) from a cached copy
+void send_cached(int sock, uint32_t req_id, const cache_entry *e, uint64_t offset, int64_t length, int compress) {
+    if (offset > e->size) {
+        send_text(sock, OP_ERROR, req_id, "ERROR: Invalid range");
+        return;
+    }
+    uint64_t count = length < 0 || (uint64_t)length > e->size - offset ? e->size - offset : (uint64_t)length;
+    if (send_body(sock, req_id, e->data + offset, count, &compress) < 0) shutdown(sock, SHUT_RDWR);
+    else send_frame(sock, OP_END, 0, req_id, NULL, 0);
+}
+
+// relay_stream() for a download being admitted to the cache: the backend's (uncompressed)
+// reply is copied into memory as it is forwarded, compressed if the client asked, and cached
+// once complete. A reply larger than CACHE_MAX_OBJECT is relayed as usual and not cached.
+int relay_fill(int from, int to, uint32_t req_id, const char *rel_path, uint64_t fill, int compress) {
+    char *data = NULL;
+    size_t size = 0;
+    int capture = 1;
+    frame_hdr hdr;
+    while (recv_frame_hdr(from, &hdr) == 0 && hdr.req_id == req_id) {
+        if (capture && hdr.opcode == OP_DATA && !(hdr.flags & FLAG_LZ4) && size + hdr.length <= CACHE_MAX_OBJECT) {
+            char *grown = realloc(data, size + hdr.length);
+            if (!grown && size + hdr.length > 0) { perror("realloc failed"); exit(EXIT_FAILURE); }
+            data = grown;
+            if (recv_all(from, data + size, hdr.length) < 0) break;
+            if (send_body(to, req_id, data + size, hdr.length, &compress) < 0) {
+                free(data);
+                shutdown(to, SHUT_RDWR);
+                return -1;
+            }
+            size += hdr.length;
+            continue;
+        }
+        if (capture && hdr.opcode == OP_END) {
+            if (send_frame(to, OP_END, 0, req_id, NULL, 0) < 0) { free(data); return -1; }
+            cache_insert(rel_path, data, size, fill);
+            return 0;
+        }
+        free(data);
+        data = NULL;
+        capture = 0;
+
+        if (send_frame_hdr(to, hdr.opcode, hdr.flags, req_id, hdr.length) < 0) return -1;
+        if (relay_payload(from, to, hdr.length, 0) < 0) {
+            shutdown(to, SHUT_RDWR);
+            return -1;
+        }
+        if (hdr.opcode == OP_END) return 0;
+        if (hdr.opcode == OP_ERROR) return -2;
+    }
+    free(data);
+    send_text(to, OP_ERROR, req_id, "ERROR: Storage server connection lost");
+    return -1;
+}
+
+// cachestats: counters of the hot-object cache
+void handle_cachestats(int client_sock, uint32_t req_id) {
+    char reply[256];
+    pthread_mutex_lock(&cache_lock);
+    snprintf(reply, sizeof(reply), "CACHE hits %llu misses %llu fills %llu evictions %llu objects %zu bytes %zu capacity %zu",
+             cache_stats.hits, cache_stats.misses, cache_stats.fills, cache_stats.evictions,
+             cache_lru.count, cache_bytes, cache_capacity);
+    pthread_mutex_unlock(&cache_lock);
+    send_text(client_sock, OP_RESP, req_id, reply);
+}
+
+// Command Handlers
+// Optional "<offset> [<length>]" arguments of a ranged download; -1 if malformed
+int parse_range(const char *offset_arg, const char *length_arg, uint64_t *offset, int64_t *length) {
+    char *end;
+    *offset = 0;
+    *length = -1;
+    if (offset_arg) {
+        errno = 0;
+        *offset = strtoull(offset_arg, &end, 10);
+        if (errno || *end || !isdigit((unsigned char)*offset_arg)) return -1;
+    }
+    if (length_arg) {
+        errno = 0;
+        unsigned long long n = strtoull(length_arg, &end, 10);
+        if (errno || *end || !isdigit((unsigned char)*length_arg) || n > INT64_MAX) return -1;
+        *length = n;
+    }
+    return 0;
+}
+
+void handle_downlf(int client_sock, uint32_t req_id, const char *filepath, const char *offset_arg, const char *length_arg, int compress) {
+    if (!filepath) { send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid syntax"); return; }
+
+    char path[BUFFER_SIZE];
+    strncpy(path, filepath, BUFFER_SIZE);
+    if (strncmp(path, "~S1/", 4) == 0) memmove(path, path + 4, strlen(path) - 3);
+
+    uint64_t offset;
+    int64_t length;
+    if (parse_range(offset_arg, length_arg, &offset, &length) < 0) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid range"); return;
+    }
+
+    file_type type = get_file_type(path);
+    char full_path[BUFFER_SIZE]; snprintf(full_path, BUFFER_SIZE, "%s/%s", base_dir, path);
+
+    if (type == C_FILE) {
+        char rel_path[BUFFER_SIZE];
+        int fd = -1;
+        if (index_normalize(path, rel_path, sizeof(rel_path)) == 0 && index_lookup(rel_path, NULL, NULL))
+            fd = open(full_path, O_RDONLY);
+        if (fd < 0) { send_text(client_sock, OP_ERROR, req_id, "ERROR: File not found"); return; }
+        send_file_zero_copy(client_sock, req_id, fd, offset, length, compress);
+        close(fd);
+    } else {
+        compress = compress && type != ZIP;
+        char rel_path[BUFFER_SIZE];
+        uint64_t admit = 0;
+        if (index_normalize(path, rel_path, sizeof(rel_path)) < 0) {
+            send_text(client_sock, OP_ERROR, req_id, "ERROR: File not found"); return;
+        }
+        cache_entry *e = cache_lookup(rel_path, &admit);
+        if (e) {
+            send_cached(client_sock, req_id, e, offset, length, compress);
+            cache_release(e);
+            return;
+        }
+        uint64_t fill = offset == 0 && length < 0 ? admit : 0;  // the client may send offset 0
+
+        char range[48] = "";
+        if (offset_arg) snprintf(range, sizeof(range), " %llu", (unsigned long long)offset);
+        if (length_arg) snprintf(range + strlen(range), sizeof(range) - strlen(range), " %lld", (long long)length);
+        char command[BUFFER_SIZE];
+        if (snprintf(command, BUFFER_SIZE, "RETRIEVE %s%s", path, range) >= BUFFER_SIZE) {
+            send_text(client_sock, OP_ERROR, req_id, "ERROR: File not found"); return;
+        }
+        // The backend compresses the reply itself and S1 relays its frames unchanged, except
+        // for a cache fill, which needs the raw bytes
+        int ports[MAX_REPLICAS], port;
+        int count = replica_order(type, rel_path, ports);
+        int sock = replica_retrieve(ports, count, req_id, command, compress && !fill, &port);
+        if (sock < 0) { send_text(client_sock, OP_ERROR, req_id, "ERROR: Storage server unavailable"); return; }
+        int rc = fill ? relay_fill(sock, client_sock, req_id, rel_path, fill, compress) : relay_stream(sock, client_sock, req_id);
+        pool_release(port, sock, rc != -1);
+    }
+}
+
+void handle_statf(int client_sock, uint32_t req_id, const char *filepath) {
+    if (!filepath) { send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid syntax"); return; }
+
+    char path[BUFFER_SIZE];
+    strncpy(path, filepath, BUFFER_SIZE);
+    if (strncmp(path, "~S1/", 4) == 0) memmove(path, path + 4, strlen(path) - 3);
+
+    file_type type = get_file_type(path);
+    if (type == C_FILE) {
+        char rel_path[BUFFER_SIZE], reply[64];
+        uint64_t size;
+        time_t mtime;
+        if (index_normalize(path, rel_path, sizeof(rel_path)) < 0 || !index_lookup(rel_path, &size, &mtime)) {
+            send_text(client_sock, OP_ERROR, req_id, "ERROR: File not found"); return;
+        }
+        snprintf(reply, sizeof(reply), "SIZE %llu MTIME %lld", (unsigned long long)size, (long long)mtime);
+        send_text(client_sock, OP_RESP, req_id, reply);
+    } else {
+        char rel_path[BUFFER_SIZE];
+        if (index_normalize(path, rel_path, sizeof(rel_path)) < 0) {
+            send_text(client_sock, OP_ERROR, req_id, "ERROR: File not found"); return;
+        }
+        // Replicas are asked in turn until one has the file
+        int ports[MAX_REPLICAS], count = replica_order(type, rel_path, ports);
+        char command[BUFFER_SIZE]; snprintf(command, BUFFER_SIZE, "STAT %s", path);
+        frame_hdr hdr;
+        char response[BUFFER_SIZE], reply[BUFFER_SIZE];
+        int opcode = 0;
+        for (int i = 0; i < count && opcode != OP_RESP; i++) {
+            if (backend_request(ports[i], req_id, command, &hdr, reply, sizeof(reply)) < 0) continue;
+            if (!opcode || hdr.opcode == OP_RESP) { opcode = hdr.opcode; snprintf(response, sizeof(response), "%s", reply); }
+        }
+        if (!opcode)
+            send_text(client_sock, OP_ERROR, req_id, "ERROR: Storage server unavailable");
+        else
+            send_text(client_sock, opcode, req_id, response);
+    }
+}
+
+void handle_removef(int client_sock, uint32_t req_id, const char *filepath) {
+    if (!filepath) { send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid syntax"); return; }
+
+    char path[BUFFER_SIZE];
+    strncpy(path, filepath, BUFFER_SIZE);
+    if (strncmp(path, "~S1/", 4) == 0) memmove(path, path + 4, strlen(path) - 3);
+
+    file_type type = get_file_type(path);
+    char full_path[BUFFER_SIZE]; snprintf(full_path, BUFFER_SIZE, "%s/%s", base_dir, path);
+
+    if (type == C_FILE) {
+        char rel_path[BUFFER_SIZE];
+        if (index_normalize(path, rel_path, sizeof(rel_path)) == 0 && index_lookup(rel_path, NULL, NULL) && remove(full_path) == 0) {
+            index_remove(rel_path);
+            send_text(client_sock, OP_RESP, req_id, "REMOVE_SUCCESS");
+        } else {
+            send_text(client_sock, OP_ERROR, req_id, "ERROR: Deletion failed");
+        }
+    } else {
+        char rel_path[BUFFER_SIZE];
+        if (index_normalize(path, rel_path, sizeof(rel_path)) < 0) {
+            send_text(client_sock, OP_ERROR, req_id, "ERROR: Deletion failed"); return;
+        }
+        // A copy left on a replica that was down would be brought back by the repair pass, so
+        // nothing is deleted unless every replica can be reached
+        int ports[MAX_REPLICAS], socks[MAX_REPLICAS], reachable = 1;
+        int count = shard_owners(type, rel_path, ports);
+        for (int i = 0; i < count; i++) {
+            socks[i] = pool_acquire(ports[i]);
+            if (socks[i] < 0) reachable = 0;
+        }
+        char command[BUFFER_SIZE]; snprintf(command, BUFFER_SIZE, "DELETE %s", path);
+        char response[BUFFER_SIZE] = "", reply[BUFFER_SIZE];
+        int deleted = 0, failed = !reachable;
+        for (int i = 0; i < count; i++) {
+            int rc = reachable ? send_command_to_storage(socks[i], req_id, command, reply, sizeof(reply)) : 1;
+            pool_release(ports[i], socks[i], rc != -1);
+            if (rc == -1) failed = 1;
+            if (rc == 0 && !deleted) snprintf(response, sizeof(response), "%s", reply);
+            if (rc == -2 && !*response) snprintf(response, sizeof(response), "%s", reply);
+            deleted |= rc == 0;
+        }
+        cache_invalidate(rel_path);
+        if (failed)
+            send_text(client_sock, OP_ERROR, req_id, "ERROR: Storage server unavailable");
+        else
+            send_text(client_sock, deleted ? OP_RESP : OP_ERROR, req_id, response);
+    }
+}
+
+// Path of the tar entry whose first blocks (`length` bytes of them) are in `start`: from a pax
+// "path" record, or else the ustar header, which follows the pax header if there is one.
+// NULL if the ustar header is not among the blocks yet.
+const char *tar_entry_name(const char *start, size_t length, char *name, size_t size) {
+    const tar_header *h = (const tar_header *)start;
+    if (h->typeflag == 'x') {
+        size_t records = strtoull(h->size, NULL, 8);
+        const char *p = start + TAR_BLOCK, *end = p + (records < length - TAR_BLOCK ? records : length - TAR_BLOCK);
+        while (p < end) {
+            char *key;
+            long len = strtol(p, &key, 10);
+            if (len <= 0 || len > end - p) break;
+            if (strncmp(key, " path=", 6) == 0) {
+                snprintf(name, size, "%.*s", (int)(p + len - 1 - (key + 6)), key + 6);
+                return name;
+            }
+            p += len;
+        }
+        size_t header = TAR_BLOCK + (records + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        if (length < header + TAR_BLOCK) return NULL;
+        h = (const tar_header *)(start + header);
+    }
+    if (h->prefix[0]) snprintf(name, size, "%.155s/%.100s", h->prefix, h->name);
+    else snprintf(name, size, "%.100s", h->name);
+    return name;
+}
+
+// Relays the next entry of a shard's SENDTAR reply into a larger archive. Returns 1 once an
+// entry has been relayed (or skipped), 0 when the shard's archive has ended, -2 if it sent an
+// error (passed on to the client) and -1 if a connection broke. The end-of-archive blocks the
+// backend sends as its last DATA frame are dropped, so the caller can interleave entries of
+// several shards and write the trailer once at the very end. With `seen` (a tsearch() tree of
+// the entry names already sent) an entry an earlier shard held a replica of is skipped; the
+// frames that start each entry are read in to find its name.
+int relay_tar_entry(int from, int to, uint32_t req_id, void **seen) {
+    char start[3 * TAR_BLOCK + BUFFER_SIZE];  // pax header and records, then the ustar header
+    size_t held = 0;
+    int entry_start = 1, skipping = 0;
+    frame_hdr hdr;
+    while (recv_frame_hdr(from, &hdr) == 0 && hdr.req_id == req_id) {
+        if (hdr.opcode == OP_END) return 0;
+        int entry_end = hdr.opcode == OP_DATA && (hdr.flags & FLAG_ENTRY_END);
+        if (skipping && hdr.opcode == OP_DATA) {
+            if (skip_payload(from, hdr.length) < 0) break;
+            if (entry_end) return 1;
+            continue;
+        }
+        if (hdr.opcode == OP_DATA && entry_start && hdr.length <= sizeof(start) - held) {
+            if (recv_all(from, start + held, hdr.length) < 0) break;
+            held += hdr.length;
+            int trailer = entry_end && held == 2 * TAR_BLOCK;
+            for (size_t i = 0; i < held && trailer; i++) trailer = start[i] == 0;
+            if (trailer) { held = 0; continue; }
+
+            char name[BUFFER_SIZE];
+            const char *entry = seen ? tar_entry_name(start, held, name, sizeof(name)) : "";
+            if (!entry && !entry_end) continue;  // a pax header: the ustar header comes next
+            entry_start = 0;
+            if (entry && seen) {
+                char *copy = strdup(entry);
+                if (!copy) { perror("strdup failed"); exit(EXIT_FAILURE); }
+                char **found = tsearch(copy, seen, (int (*)(const void *, const void *))strcmp);
+                if (!found) { perror("tsearch failed"); exit(EXIT_FAILURE); }
+                if (*found != copy) {
+                    free(copy);
+                    if (entry_end) return 1;
+                    held = 0;
+                    skipping = 1;
+                    continue;
+                }
+            }
+            if (send_frame(to, OP_DATA, hdr.flags, req_id, start, held) < 0) return -1;
+            if (entry_end) return 1;
+            held = 0;
+            continue;
+        }
+        if (held > 0 && send_frame(to, OP_DATA, 0, req_id, start, held) < 0) return -1;
+        held = 0;
+        if (send_frame_hdr(to, hdr.opcode, hdr.flags, req_id, hdr.length) < 0) return -1;
+        if (relay_payload(from, to, hdr.length, 0) < 0) {
+            shutdown(to, SHUT_RDWR);
+            return -1;
+        }
+        if (hdr.opcode == OP_ERROR) return -2;
+        if (entry_end) return 1;
+        entry_start = 0;
+    }
+    send_text(to, OP_ERROR, req_id, "ERROR: Storage server connection lost");
+    return -1;
+}
+
+// The archive of a backend type is made of its shards' archives, and `downltar all` adds
+// every backend type and S1's own .c files. SENDTAR goes to every shard up front and the
+// replies are interleaved a whole entry at a time, from whichever shards have data waiting,
+// so all servers read their disks at once and a full archive takes about as long as the
+// slowest one. S1's own .c files take a turn in every round too. With replication each
+// file is sent once, and the archive is still complete with fewer shards out than there are
+// copies of a file.
+#define TAR_SOURCES (3 * MAX_SHARDS)
+
+void handle_downltar(int client_sock, uint32_t req_id, const char *ftype) {
+    static const char *exts[] = { [PDF] = ".pdf", [TXT] = ".txt", [ZIP] = ".zip" };
+    int all = ftype && strcmp(ftype, "all") == 0;
+    if (!ftype || (!all && strcmp(ftype, ".c") && strcmp(ftype, ".pdf") && strcmp(ftype, ".txt") && strcmp(ftype, ".zip"))) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid filetype"); return;
+    }
+
+    if (strcmp(ftype, ".c") == 0) {
+        send_tar_stream(client_sock, req_id);
+        return;
+    }
+    int ports[TAR_SOURCES], socks[TAR_SOURCES], dedup[TAR_SOURCES], count = 0, rc = 0;
+    for (file_type type = PDF; type <= ZIP; type++) {
+        if (!all && strcmp(ftype, exts[type]) != 0) continue;
+        int first = count, copies = shard_copies(type), unreachable = 0;
+        char command[BUFFER_SIZE]; snprintf(command, BUFFER_SIZE, "SENDTAR %s", exts[type]);
+        count += shard_list(type, ports + first);
+        for (int i = first; i < count; i++) {
+            dedup[i] = copies > 1;
+            socks[i] = pool_acquire(ports[i]);
+            if (socks[i] >= 0 && send_text(socks[i], OP_CMD, req_id, command) < 0) {
+                pool_release(ports[i], socks[i], 0);
+                socks[i] = -1;
+            }
+            if (socks[i] < 0) unreachable++;
+        }
+        if (unreachable >= copies && rc == 0) {
+            send_text(client_sock, OP_ERROR, req_id, "ERROR: Storage server unavailable");
+            rc = -2;
+        }
+    }
+
+    tar_list *local = all ? tar_cache_get() : NULL;
+    size_t next_local = 0, local_count = local ? local->count : 0;
+    void *seen = NULL;
+    struct pollfd fds[TAR_SOURCES];
+    int source[TAR_SOURCES];
+    while (rc == 0) {
+        int waiting = 0;
+        for (int i = 0; i < count; i++) {
+            if (socks[i] < 0) continue;
+            fds[waiting] = (struct pollfd){ .fd = socks[i], .events = POLLIN };
+            source[waiting++] = i;
+        }
+        if (waiting == 0 && next_local == local_count) break;
+        int ready = waiting ? poll(fds, waiting, next_local < local_count ? 0 : POOL_IO_TIMEOUT_SECS * 1000) : 0;
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0 || (ready == 0 && next_local == local_count)) {
+            // A stalled shard would leave the archive incomplete: break the stream instead
+            shutdown(client_sock, SHUT_RDWR);
+            rc = -1;
+            break;
+        }
+
+        // One entry from every shard with data waiting, then the next .c file
+        for (int k = 0; k < waiting && rc == 0; k++) {
+            if (!fds[k].revents) continue;
+            int i = source[k];
+            int relayed = relay_tar_entry(socks[i], client_sock, req_id, dedup[i] ? &seen : NULL);
+            if (relayed <= 0) {
+                // A shard whose reply was not read to the end leaves its connection out of sync
+                pool_release(ports[i], socks[i], relayed == 0);
+                socks[i] = -1;
+            }
+            if (relayed < 0) rc = relayed;
+        }
+        if (rc == 0 && next_local < local_count) {
+            char full_path[BUFFER_SIZE];
+            snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, local->items[next_local].path);
+            if (tar_send_entry(client_sock, req_id, full_path, &local->items[next_local++]) < 0) {
+                shutdown(client_sock, SHUT_RDWR);
+                rc = -1;
+            }
+        }
+    }
+    for (int i = 0; i < count; i++)
+        if (socks[i] >= 0) pool_release(ports[i], socks[i], 0);
+    if (local) tar_list_release(local);
+    tdestroy(seen, free);
+    if (rc == 0) {
+        char trailer[2 * TAR_BLOCK] = {0};
+        if (send_frame(client_sock, OP_DATA, FLAG_ENTRY_END, req_id, trailer, sizeof(trailer)) == 0)
+            send_frame(client_sock, OP_END, 0, req_id, NULL, 0);
+    }
+}
+
+int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Merges two newline-terminated name lists into one sorted list without duplicates. `into`
+// (which may be NULL) is freed; the result's length goes to *length.
+char *list_merge(char *into, const char *list, size_t *length) {
+    size_t count = 0, cap = 0;
+    char **names = NULL;
+    char *joined = NULL;
+    if (asprintf(&joined, "%s%s", into ? into : "", list) < 0) { perror("asprintf failed"); exit(EXIT_FAILURE); }
+    size_t size = strlen(joined);
+    free(into);
+    for (char *save = NULL, *name = strtok_r(joined, "\n", &save); name; name = strtok_r(NULL, "\n", &save)) {
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            names = realloc(names, cap * sizeof(char *));
+            if (!names) { perror("realloc failed"); exit(EXIT_FAILURE); }
+        }
+        names[count++] = name;
+    }
+    qsort(names, count, sizeof(char *), name_cmp);
+
+    char *out = malloc(size + 1), *p = out;
+    if (!out) { perror("malloc failed"); exit(EXIT_FAILURE); }
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && strcmp(names[i], names[i - 1]) == 0) continue;
+        p += sprintf(p, "%s\n", names[i]);
+    }
+    *length = p - out;
+    free(names);
+    free(joined);
+    return out;
+}
+
+void handle_dispfnames(int client_sock, uint32_t req_id, const char *dirpath) {
+    if (!dirpath) { send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid syntax"); return; }
+
+    char path[BUFFER_SIZE]; strncpy(path, dirpath, BUFFER_SIZE);
+    if (strncmp(path, "~S1/", 4) == 0) memmove(path, path + 4, strlen(path) - 3);
+
+    char rel_path[BUFFER_SIZE], command[BUFFER_SIZE];
+    if (index_normalize(path, rel_path, sizeof(rel_path)) < 0 ||
+        snprintf(command, sizeof(command), "LIST %s", rel_path) >= (int)sizeof(command)) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Directory not found"); return;
+    }
+    // S1 only holds .c files, so a directory with none of them may still exist on the backends
+    size_t local_len = 0;
+    char *local = index_list(rel_path, ".c", &local_len);
+    int found = local != NULL;
+
+    // LIST goes to every storage server before any reply is read, so the backends work
+    // concurrently and the listing takes as long as the slowest one rather than the sum
+    int ports[C_FILE * MAX_SHARDS], socks[C_FILE * MAX_SHARDS], count = 0;
+    file_type types[C_FILE * MAX_SHARDS];
+    frame_hdr hdrs[C_FILE * MAX_SHARDS];
+    for (int type = 0; type < C_FILE; type++) {
+        int n = shard_list(type, ports + count);
+        while (n-- > 0) types[count++] = type;
+    }
+    for (int i = 0; i < count; i++) {
+        socks[i] = pool_acquire(ports[i]);
+        if (socks[i] >= 0 && send_text(socks[i], OP_CMD, req_id, command) < 0) {
+            pool_release(ports[i], socks[i], 0);
+            socks[i] = pool_acquire(ports[i]);
+            if (socks[i] >= 0 && send_text(socks[i], OP_CMD, req_id, command) < 0) { pool_release(ports[i], socks[i], 0); socks[i] = -1; }
+        }
+    }
+
+    uint64_t total = local_len;
+    int answered[C_FILE] = { 0 };
+    for (int i = 0; i < count; i++) {
+        if (socks[i] < 0) continue;
+        if (recv_frame_hdr(socks[i], &hdrs[i]) < 0 || hdrs[i].req_id != req_id) {
+            pool_release(ports[i], socks[i], 0); socks[i] = -1;
+        } else if (hdrs[i].opcode != OP_RESP) {  // directory absent on that server
+            pool_release(ports[i], socks[i], skip_payload(socks[i], hdrs[i].length) == 0); socks[i] = -1;
+        } else {
+            total += hdrs[i].length;
+            answered[types[i]]++;
+            found = 1;
+        }
+    }
+    if (!found) { send_text(client_sock, OP_ERROR, req_id, "ERROR: Directory not found"); return; }
+
+    // Names of a type spread over several shards are read in and merged into one sorted list
+    char *merged[C_FILE] = { NULL };
+    size_t merged_len[C_FILE] = { 0 };
+    for (int i = 0; i < count; i++) {
+        if (socks[i] < 0 || answered[types[i]] < 2) continue;
+        char *list = malloc(hdrs[i].length + 1);
+        if (!list) { perror("malloc failed"); exit(EXIT_FAILURE); }
+        int ok = recv_all(socks[i], list, hdrs[i].length) == 0;
+        pool_release(ports[i], socks[i], ok);
+        socks[i] = -1;
+        total -= hdrs[i].length;
+        if (ok) {
+            list[hdrs[i].length] = '\0';
+            merged[types[i]] = list_merge(merged[types[i]], list, &merged_len[types[i]]);
+        }
+        free(list);
+    }
+    for (int type = 0; type < C_FILE; type++) total += merged_len[type];
+
+    // Each list arrives sorted and in .pdf/.txt/.zip order, so the reply is just the local .c
+    // names followed by the backends' lists, spliced through as they are read where a type
+    // has one shard
+    int rc = send_frame_hdr(client_sock, OP_RESP, 0, req_id, total) < 0 ||
+             (local_len > 0 && send_all(client_sock, local, local_len, 0) < 0) ? -2 : 0;
+    free(local);
+    for (int type = 0; type < C_FILE; type++) {
+        if (merged[type] && rc == 0 && send_all(client_sock, merged[type], merged_len[type], 0) < 0) rc = -2;
+        free(merged[type]);
+        for (int i = 0; i < count; i++) {
+            if (socks[i] < 0 || types[i] != (file_type)type) continue;
+            int relayed = rc == 0 ? relay_payload(socks[i], client_sock, hdrs[i].length, 0) : -2;
+            if (relayed == -1) shutdown(client_sock, SHUT_RDWR);  // the client was promised `total` bytes
+            if (relayed < 0) rc = relayed;
+            pool_release(ports[i], socks[i], relayed == 0);
+        }
+    }
+}
+
+// Receives the body of a .c upload into a temp file (see stage_path()) and moves it into
+// place. Returns 0 once stored, 1 with the reason in `reply` if it was refused, and -1 if the
+// client connection broke.
+int store_local(int client_sock, const char *path, const char *rel_path, char *reply, size_t size) {
+    char *dest_copy1 = strdup(path);
+    char *dest_copy2 = strdup(path);
+    char dir_path[BUFFER_SIZE], final_path[BUFFER_SIZE], temp_path[BUFFER_SIZE];
+    int fits = snprintf(dir_path, BUFFER_SIZE, "%s/%s", base_dir, dirname(dest_copy1)) < BUFFER_SIZE &&
+               snprintf(final_path, BUFFER_SIZE, "%s/%s", dir_path, basename(dest_copy2)) < BUFFER_SIZE &&
+               stage_path(final_path, temp_path, sizeof(temp_path)) == 0;
+    free(dest_copy1); free(dest_copy2);
+    if (!fits) {
+        if (recv_file_stream(client_sock, NULL, NULL, 0) == -1) return -1;
+        snprintf(reply, size, "ERROR: Invalid path");
+        return 1;
+    }
+    create_directory(dir_path);
+
+    FILE *file = fopen(temp_path, "wb");
+    char err[BUFFER_SIZE];
+    int rc = recv_file_stream(client_sock, file, err, sizeof(err));
+    if (file && fclose(file) != 0 && rc == 0) rc = -3;
+    if (!file || rc != 0) {
+        if (file) remove(temp_path);
+        if (rc == -1) return -1;
+        snprintf(reply, size, "%s", !file ? "ERROR: File creation failed" :
+                 rc == -2 ? "ERROR: Upload aborted by client" : "ERROR: File write failed");
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(temp_path, &st) != 0 || store_commit(temp_path, final_path, rel_path, st.st_size, st.st_mtime) != 0) {
+        remove(temp_path);
+        snprintf(reply, size, "ERROR: Save failed");
+        return 1;
+    }
+    return 0;
+}
+
+int handle_uploadf(int client_sock, uint32_t req_id, const char *filename, const char *dest_path) {
+    if (!filename || !dest_path) {
+        if (recv_file_stream(client_sock, NULL, NULL, 0) == -1) return -1;
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid syntax");
+        return 0;
+    }
+
+    char processed_path[BUFFER_SIZE];
+    strncpy(processed_path, dest_path, BUFFER_SIZE);
+    if (strncmp(processed_path, "~S1/", 4) == 0)
+        memmove(processed_path, processed_path + 4, strlen(processed_path) - 3);
+    char rel_path[BUFFER_SIZE];
+    if (index_normalize(processed_path, rel_path, sizeof(rel_path)) < 0 || !*rel_path) {
+        if (recv_file_stream(client_sock, NULL, NULL, 0) == -1) return -1;
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid path");
+        return 0;
+    }
+
+    // The destination decides where the body goes before any of it arrives:
+    // backend-owned types are streamed through without touching S1's disk
+    file_type type = get_file_type(rel_path);
+    if (type != C_FILE) {
+        int rc = forward_file(client_sock, req_id, rel_path, type);
+        cache_invalidate(rel_path);
+        return rc;
+    }
+
+    char reply[BUFFER_SIZE];
+    int rc = store_local(client_sock, processed_path, rel_path, reply, sizeof(reply));
+    if (rc < 0) return -1;
+    send_text(client_sock, rc ? OP_ERROR : OP_RESP, req_id, rc ? reply : "UPLOAD_SUCCESS");
+    return 0;
+}
+
+// Multi-part uploads: a large file arrives as fixed-size parts over several client
+// connections at once. Parts of a .c file are written at their own offsets into a temp file
+// under <base_dir>.parts and the file is moved into place only once every part is in; parts
+// of other types are relayed to their storage server, which assembles them the same way.
+// Sessions live in memory; temp files left over from a restart are cleared.
+#define PART_SESSIONS 64        // uploads in progress at once
+#define PART_IDLE_SECS 600      // an upload untouched for this long is dropped
+#define PART_MAX_COUNT 65536    // parts per upload
+
+typedef struct {
+    char id[40];                // empty if the slot is free
+    char rel_path[BUFFER_SIZE]; // destination, relative to the store
+    int fd;
+    uint64_t size, part_size;
+    uint32_t parts, done;
+    unsigned char *state;       // per part: 0 missing, 1 being written, 2 written
+    int writers;
+    time_t touched;
+    int port;                   // storage server assembling the upload, 0 if it is assembled here
+} part_upload;
+
+part_upload part_uploads[PART_SESSIONS];
+uint32_t part_counter;
+pthread_mutex_t part_lock = PTHREAD_MUTEX_INITIALIZER;
+char part_dir[300];
+
+void part_temp_path(const char *id, char *path, size_t size) {
+    snprintf(path, size, "%s/%s", part_dir, id);
+}
+
+// Frees a slot nobody is writing to, deleting its temp file if it is still open (part_lock held)
+void part_discard(part_upload *u) {
+    if (u->fd >= 0) {
+        char path[BUFFER_SIZE];
+        part_temp_path(u->id, path, sizeof(path));
+        close(u->fd);
+        remove(path);
+    }
+    free(u->state);
+    u->state = NULL;
+    u->fd = -1;
+    u->id[0] = '\0';
+}
+
+part_upload *part_find(const char *id) {
+    for (int i = 0; i < PART_SESSIONS; i++)
+        if (part_uploads[i].id[0] && strcmp(part_uploads[i].id, id) == 0) return &part_uploads[i];
+    return NULL;
+}
+
+// Opens upload `id` of `size` bytes for rel_path; returns NULL or the reason it was refused
+const char *part_begin(const char *id, const char *rel_path, uint64_t size, uint64_t part_size, int port) {
+    if (!*id || strlen(id) >= sizeof(part_uploads[0].id) || strchr(id, '/') || id[0] == '.')
+        return "ERROR: Invalid upload id";
+    if (part_size == 0 || size / part_size + (size % part_size != 0) > PART_MAX_COUNT)
+        return "ERROR: Invalid part size";
+    if (!port && strlen(base_dir) + 1 + strlen(rel_path) >= BUFFER_SIZE) return "ERROR: Invalid path";
+
+    pthread_mutex_lock(&part_lock);
+    time_t now = time(NULL);
+    part_upload *slot = NULL;
+    for (int i = 0; i < PART_SESSIONS; i++) {
+        part_upload *u = &part_uploads[i];
+        if (u->id[0] && u->writers == 0 && now - u->touched > PART_IDLE_SECS) part_discard(u);
+        if (!u->id[0] && !slot) slot = u;
+    }
+    const char *err = part_find(id) ? "ERROR: Upload already exists" : !slot ? "ERROR: Too many uploads" : NULL;
+    if (!err && port) {
+        slot->fd = -1;
+    } else if (!err) {
+        char path[BUFFER_SIZE];
+        part_temp_path(id, path, sizeof(path));
+        slot->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (slot->fd < 0 || ftruncate(slot->fd, size) != 0) {
+            if (slot->fd >= 0) { close(slot->fd); remove(path); }
+            err = "ERROR: Upload creation failed";
+        }
+    }
+    if (!err) {
+        snprintf(slot->id, sizeof(slot->id), "%s", id);
+        snprintf(slot->rel_path, sizeof(slot->rel_path), "%s", rel_path);
+        slot->size = size;
+        slot->part_size = part_size;
+        slot->parts = size / part_size + (size % part_size != 0);
+        slot->done = 0;
+        slot->state = calloc(slot->parts + 1, 1);
+        if (!slot->state) { perror("calloc failed"); exit(EXIT_FAILURE); }
+        slot->writers = 0;
+        slot->touched = now;
+        slot->port = port;
+    }
+    pthread_mutex_unlock(&part_lock);
+    return err;
+}
+
+// Claims part `index` for writing; NULL if there is no such part or it is being written.
+// A part that was already written may be sent again (e.g. after a lost reply).
+part_upload *part_claim(const char *id, uint32_t index) {
+    pthread_mutex_lock(&part_lock);
+    part_upload *u = part_find(id);
+    if (u && (index >= u->parts || u->state[index] == 1)) u = NULL;
+    if (u) {
+        if (u->state[index] == 2) u->done--;
+        u->state[index] = 1;
+        u->writers++;
+        u->touched = time(NULL);
+    }
+    pthread_mutex_unlock(&part_lock);
+    return u;
+}
+
+void part_finish(part_upload *u, uint32_t index, int ok) {
+    pthread_mutex_lock(&part_lock);
+    u->state[index] = ok ? 2 : 0;
+    if (ok) u->done++;
+    u->writers--;
+    u->touched = time(NULL);
+    pthread_mutex_unlock(&part_lock);
+}
+
+// Takes a complete upload out of the table, leaving its temp file for the caller to move
+// into place; returns NULL or the reason it cannot be committed yet
+const char *part_take(const char *id, char *rel_path, size_t rel_size, char *temp_path, size_t temp_size) {
+    pthread_mutex_lock(&part_lock);
+    part_upload *u = part_find(id);
+    const char *err = !u ? "ERROR: Unknown upload" : (u->writers || u->done != u->parts) ? "ERROR: Upload incomplete" : NULL;
+    if (!err) {
+        snprintf(rel_path, rel_size, "%s", u->rel_path);
+        part_temp_path(u->id, temp_path, temp_size);
+        close(u->fd);
+        u->fd = -1;
+        part_discard(u);
+    }
+    pthread_mutex_unlock(&part_lock);
+    return err;
+}
+
+// Storage server assembling upload `id` (0 if S1 does), or -1 if there is no such upload;
+// also copies its destination into rel_path if that is not NULL
+int part_port(const char *id, char *rel_path, size_t size) {
+    pthread_mutex_lock(&part_lock);
+    part_upload *u = part_find(id);
+    int port = u ? u->port : -1;
+    if (u) u->touched = time(NULL);
+    if (u && rel_path) snprintf(rel_path, size, "%s", u->rel_path);
+    pthread_mutex_unlock(&part_lock);
+    return port;
+}
+
+// Drops an upload and its temp file; returns NULL or the reason it cannot be dropped now
+const char *part_abort(const char *id) {
+    pthread_mutex_lock(&part_lock);
+    part_upload *u = part_find(id);
+    const char *err = !u ? "ERROR: Unknown upload" : u->writers ? "ERROR: Upload busy" : NULL;
+    if (!err) part_discard(u);
+    pthread_mutex_unlock(&part_lock);
+    return err;
+}
+
+// Clears temp files of uploads that were in progress when the server stopped
+void part_load(void) {
+    snprintf(part_dir, sizeof(part_dir), "%s.parts", base_dir);
+    mkdir(part_dir, 0755);
+    DIR *dir = opendir(part_dir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        char path[BUFFER_SIZE];
+        snprintf(path, sizeof(path), "%s/%s", part_dir, entry->d_name);
+        remove(path);
+    }
+    if (dir) closedir(dir);
+}
+
+// Decimal argument of a command; -1 if malformed
+int parse_u64(const char *arg, uint64_t *value) {
+    char *end;
+    errno = 0;
+    *value = strtoull(arg, &end, 10);
+    return (errno || *end || !isdigit((unsigned char)*arg)) ? -1 : 0;
+}
+
+
+// uploadp <dest_path> <size> <part_size>: opens a multi-part upload and replies
+// "UPLOAD_ID <id>". The client then sends "uploadpart <id> <index>" with each part's body,
+// on as many connections and in whatever order it likes, and finally "uploadcommit <id>".
+void handle_uploadp(int client_sock, uint32_t req_id, const char *dest_path, const char *size_arg, const char *part_size_arg) {
+    if (!dest_path || !size_arg || !part_size_arg) { send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid syntax"); return; }
+
+    char path[BUFFER_SIZE], rel_path[BUFFER_SIZE];
+    snprintf(path, sizeof(path), "%s", dest_path);
+    if (strncmp(path, "~S1/", 4) == 0) memmove(path, path + 4, strlen(path) - 3);
+    uint64_t size, part_size;
+    if (index_normalize(path, rel_path, sizeof(rel_path)) < 0 || !*rel_path) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid path");
+        return;
+    }
+    if (parse_u64(size_arg, &size) < 0 || parse_u64(part_size_arg, &part_size) < 0) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid size");
+        return;
+    }
+
+    char id[40];
+    snprintf(id, sizeof(id), "%lx-%x-%x", (unsigned long)time(NULL), (unsigned)getpid(),
+             __atomic_add_fetch(&part_counter, 1, __ATOMIC_RELAXED));
+    file_type type = get_file_type(rel_path);
+    int port = type == C_FILE ? 0 : shard_port(type, rel_path);
+    const char *err = part_begin(id, rel_path, size, part_size, port);
+    if (err) {
+        send_text(client_sock, OP_ERROR, req_id, err);
+        return;
+    }
+    if (port) {
+        char command[BUFFER_SIZE + 128], response[BUFFER_SIZE];
+        snprintf(command, sizeof(command), "PSTART %s %s %llu %llu", id, rel_path,
+                 (unsigned long long)size, (unsigned long long)part_size);
+        frame_hdr hdr;
+        int rc = backend_request(port, req_id, command, &hdr, response, sizeof(response));
+        if (rc < 0 || hdr.opcode != OP_RESP) {
+            part_abort(id);
+            send_text(client_sock, OP_ERROR, req_id, rc < 0 ? "ERROR: Storage server unavailable" : response);
+            return;
+        }
+    }
+    char reply[64];
+    snprintf(reply, sizeof(reply), "UPLOAD_ID %s", id);
+    send_text(client_sock, OP_RESP, req_id, reply);
+}
+
+// uploadpart <id> <index>, followed by the part's body. Returns -1 if the client connection broke.
+int handle_uploadpart(int client_sock, uint32_t req_id, const char *id, const char *index_arg) {
+    int port = (id && index_arg) ? part_port(id, NULL, 0) : -1;
+    if (port > 0) {
+        char command[BUFFER_SIZE];
+        snprintf(command, sizeof(command), "PPART %s %s", id, index_arg);
+        store_group g = { .count = 1, .ports = { port } };
+        return forward_stream(client_sock, req_id, &g, command, "PART_SUCCESS");
+    }
+
+    uint64_t index;
+    part_upload *u = NULL;
+    if (port == 0 && parse_u64(index_arg, &index) == 0 && index < PART_MAX_COUNT) u = part_claim(id, index);
+    if (!u) {
+        if (recv_file_stream(client_sock, NULL, NULL, 0) == -1) return -1;
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Unknown upload part");
+        return 0;
+    }
+
+    uint64_t offset = index * u->part_size;
+    uint64_t length = u->size - offset < u->part_size ? u->size - offset : u->part_size;
+    char err[BUFFER_SIZE];
+    int rc = recv_file_stream_at(client_sock, u->fd, offset, length, err, sizeof(err));
+    part_finish(u, index, rc == 0);
+    if (rc == -1) return -1;
+    if (rc == 0) send_text(client_sock, OP_RESP, req_id, "PART_SUCCESS");
+    else send_text(client_sock, OP_ERROR, req_id, rc == -2 ? "ERROR: Upload aborted by client" : "ERROR: Part write failed");
+    return 0;
+}
+
+// uploadcommit <id>: moves a complete multi-part upload into place
+void handle_uploadcommit(int client_sock, uint32_t req_id, const char *id) {
+    char rel_path[BUFFER_SIZE], temp_path[BUFFER_SIZE], full_path[BUFFER_SIZE];
+    int port = id ? part_port(id, rel_path, sizeof(rel_path)) : -1;
+    if (port > 0) {
+        char command[BUFFER_SIZE], response[BUFFER_SIZE];
+        snprintf(command, sizeof(command), "PCOMMIT %s", id);
+        frame_hdr hdr;
+        int rc = backend_request(port, req_id, command, &hdr, response, sizeof(response));
+        cache_invalidate(rel_path);
+        if (rc < 0) {
+            send_text(client_sock, OP_ERROR, req_id, "ERROR: Storage server unavailable");
+        } else if (hdr.opcode != OP_RESP) {
+            send_text(client_sock, OP_ERROR, req_id, response);
+        } else {
+            part_abort(id);
+            send_text(client_sock, OP_RESP, req_id, "UPLOAD_SUCCESS");
+        }
+        return;
+    }
+
+    const char *err = port < 0 ? "ERROR: Unknown upload" : part_take(id, rel_path, sizeof(rel_path), temp_path, sizeof(temp_path));
+    if (err) {
+        send_text(client_sock, OP_ERROR, req_id, err);
+        return;
+    }
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, rel_path) >= (int)sizeof(full_path)) {
+        remove(temp_path);
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid path");
+        return;
+    }
+    char *slash = strrchr(full_path, '/');
+    *slash = '\0';
+    create_directory(full_path);
+    *slash = '/';
+    struct stat st;
+    if (stat(temp_path, &st) != 0 || store_commit(temp_path, full_path, rel_path, st.st_size, st.st_mtime) != 0) {
+        remove(temp_path);
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Save failed");
+        return;
+    }
+    send_text(client_sock, OP_RESP, req_id, "UPLOAD_SUCCESS");
+}
+
+// uploadabort <id>: discards a multi-part upload and whatever parts it has received
+void handle_uploadabort(int client_sock, uint32_t req_id, const char *id) {
+    int port = id ? part_port(id, NULL, 0) : -1;
+    if (port > 0) {
+        char command[BUFFER_SIZE], response[BUFFER_SIZE];
+        snprintf(command, sizeof(command), "PABORT %s", id);
+        frame_hdr hdr;
+        backend_request(port, req_id, command, &hdr, response, sizeof(response));
+    }
+    const char *err = port < 0 ? "ERROR: Unknown upload" : part_abort(id);
+    send_text(client_sock, err ? OP_ERROR : OP_RESP, req_id, err ? err : "ABORTED");
+}
+
+// Batch transfers: many files under one command on one stream, so a client moving lots of
+// small files pays for neither a command nor a round trip per file. S1 routes each entry to
+// its storage server as it comes and keeps up to BATCH_WINDOW backend transfers of a batch
+// in flight at once, each on its own pooled connection.
+#define BATCH_WINDOW 16           // STOREs or RETRIEVEs of one batch in flight
+#define BATCH_MAX_ENTRIES 65536   // paths per downlb
+
+// A backend STORE whose body has been sent and whose replies are still to be read
+typedef struct {
+    store_group group;
+    char rel_path[BUFFER_SIZE];
+} batch_store;
+
+// Adds a "<path>: <reason>" line to a batch's failure report
+void batch_note(FILE *report, const char *path, const char *reason) {
+    if (strncmp(reason, "ERROR: ", 7) == 0) reason += 7;
+    fprintf(report, "\n%s: %s", path, reason);
+}
+
+// Reads the reply to the oldest STORE in flight
+int batch_collect(batch_store *pending, int *head, int *count, uint32_t req_id, FILE *report) {
+    batch_store *b = &pending[*head];
+    char reply[BUFFER_SIZE];
+    int stored = store_result(&b->group, req_id, reply, sizeof(reply));
+    cache_invalidate(b->rel_path);
+    if (!stored) batch_note(report, b->rel_path, reply);
+    *head = (*head + 1) % BATCH_WINDOW;
+    (*count)--;
+    return stored;
+}
+
+// uploadb: a batch of uploads. Each entry is a command frame holding the destination path
+// (as for uploadf) followed by the body as DATA frames and an END; an END in place of the
+// next entry ends the batch and an ERROR abandons the rest of it. A backend entry's STORE
+// reply is only read once later entries are on their way, so S2-S4 write files while the
+// client is still sending. The single reply is "BATCH <n> stored <m> failed" with a
+// "<path>: <reason>" line per failure. Returns -1 if the client connection broke.
+int handle_uploadb(int client_sock, uint32_t req_id) {
+    batch_store pending[BATCH_WINDOW];
+    int head = 0, count = 0, stored = 0, failed = 0, client_ok = 1, aborted = 0;
+    char *failures = NULL;
+    size_t failures_len = 0;
+    FILE *report = open_memstream(&failures, &failures_len);
+    if (!report) { perror("open_memstream failed"); exit(EXIT_FAILURE); }
+
+    while (1) {
+        if (count == BATCH_WINDOW) {
+            if (batch_collect(pending, &head, &count, req_id, report)) stored++; else failed++;
+        }
+        frame_hdr hdr;
+        char dest[BUFFER_SIZE], path[BUFFER_SIZE], rel_path[BUFFER_SIZE], reply[BUFFER_SIZE];
+        if (recv_msg(client_sock, &hdr, dest, sizeof(dest)) < 0) { client_ok = 0; break; }
+        if (hdr.opcode == OP_END) break;
+        if (hdr.opcode != OP_CMD) { aborted = hdr.opcode == OP_ERROR; client_ok = aborted; break; }
+
+        snprintf(path, sizeof(path), "%s", strncmp(dest, "~S1/", 4) == 0 ? dest + 4 : dest);
+        if (index_normalize(path, rel_path, sizeof(rel_path)) < 0 || !*rel_path) {
+            if (recv_file_stream(client_sock, NULL, NULL, 0) == -1) { client_ok = 0; break; }
+            batch_note(report, dest, "Invalid path");
+            failed++;
+            continue;
+        }
+
+        file_type type = get_file_type(rel_path);
+        if (type == C_FILE) {
+            int rc = store_local(client_sock, path, rel_path, reply, sizeof(reply));
+            if (rc < 0) { client_ok = 0; break; }
+            if (rc) { batch_note(report, rel_path, reply); failed++; } else stored++;
+            continue;
+        }
+
+        char command[BUFFER_SIZE];
+        batch_store *b = &pending[(head + count) % BATCH_WINDOW];
+        b->group.count = shard_owners(type, rel_path, b->group.ports);
+        store_command(rel_path, time(NULL), command, sizeof(command));
+        store_open(&b->group, req_id, command, reply, sizeof(reply));
+        int entry_aborted;
+        if (store_body(client_sock, req_id, &b->group, &entry_aborted) < 0) {
+            for (int i = 0; i < b->group.count; i++) store_drop(&b->group, i);
+            cache_invalidate(rel_path);
+            client_ok = 0;
+            break;
+        }
+        int open = store_end(&b->group, req_id, entry_aborted);
+        if (open > 0 && !entry_aborted) {
+            snprintf(b->rel_path, BUFFER_SIZE, "%s", rel_path);
+            count++;
+            continue;
+        }
+        if (open > 0) store_result(&b->group, req_id, reply, sizeof(reply));
+        cache_invalidate(rel_path);
+        batch_note(report, rel_path, entry_aborted ? "Upload aborted by client" :
+                   strncmp(reply, "ERROR", 5) == 0 ? reply : "Storage server failed");
+        failed++;
+    }
+    // Files already sent are committed whatever became of the rest of the batch
+    while (count > 0) {
+        if (batch_collect(pending, &head, &count, req_id, report)) stored++; else failed++;
+    }
+    fclose(report);
+
+    int rc = client_ok ? 0 : -1;
+    if (client_ok) {
+        size_t size = failures_len + 64;
+        char *text = malloc(size);
+        if (!text) { perror("malloc failed"); exit(EXIT_FAILURE); }
+        snprintf(text, size, "%sBATCH %d stored %d failed%s", aborted ? "ERROR: Batch aborted by client, " : "",
+                 stored, failed, failures);
+        send_text(client_sock, aborted ? OP_ERROR : OP_RESP, req_id, text);
+        free(text);
+    }
+    free(failures);
+    return rc;
+}
+
+// A downlb entry, with its backend reply requested ahead of time where possible
+typedef struct {
+    char *path;                  // as the client named it
+    int port, sock;              // RETRIEVE in flight on sock, or -1
+    int replicas;                // other replicas could be asked if this one lacks the file
+    uint64_t fill;               // cache fill token if the reply is being admitted (rel_path is set)
+    int compress;
+    char *rel_path;
+    cache_entry *cached;
+} batch_fetch;
+
+// Starts the download of a backend entry: a cached copy is pinned, otherwise its RETRIEVE is
+// sent on a connection of its own. Entries left untouched (.c files, bad paths, unreachable
+// backends) are served by handle_downlf in their turn.
+void batch_prefetch(batch_fetch *f, uint32_t req_id, int compress) {
+    char path[BUFFER_SIZE], rel_path[BUFFER_SIZE], command[BUFFER_SIZE];
+    snprintf(path, sizeof(path), "%s", strncmp(f->path, "~S1/", 4) == 0 ? f->path + 4 : f->path);
+    file_type type = get_file_type(path);
+    // A path too long to ask for is left to handle_downlf, which refuses it
+    if (type == C_FILE || index_normalize(path, rel_path, sizeof(rel_path)) < 0 ||
+        snprintf(command, sizeof(command), "RETRIEVE %s", path) >= (int)sizeof(command)) return;
+
+    f->compress = compress && type != ZIP;
+    uint64_t admit;
+    f->cached = cache_lookup(rel_path, &admit);
+    if (f->cached) return;
+
+    // The best replica only: a prefetch does not wait to see which answers first
+    int ports[MAX_REPLICAS];
+    f->replicas = replica_order(type, rel_path, ports);
+    for (int i = 0; i < f->replicas && f->sock < 0; i++) f->sock = pool_acquire(f->port = ports[i]);
+    if (f->sock < 0) return;
+    f->fill = admit;
+    if (f->fill && !(f->rel_path = strdup(rel_path))) { perror("strdup failed"); exit(EXIT_FAILURE); }
+    uint16_t flags = f->compress && !f->fill && pool_for_port(f->port)->lz4 ? FLAG_LZ4 : 0;
+    if (send_frame(f->sock, OP_CMD, flags, req_id, command, strlen(command)) < 0) {
+        pool_release(f->port, f->sock, 0);
+        f->sock = -1;
+    }
+}
+
+// downlb: a batch of downloads. The command is followed by one command frame per path and an
+// END. Each file comes back in the order asked for as a RESP frame holding its path and then
+// the reply downlf would have sent (DATA frames and END, or an ERROR); an END after the last
+// one ends the batch. While one file is relayed the next BATCH_WINDOW are already being read
+// by their storage servers. Returns -1 if the client connection broke.
+int handle_downlb(int client_sock, uint32_t req_id, int compress) {
+    batch_fetch *entries = NULL;
+    size_t count = 0, capacity = 0;
+    int too_many = 0;
+    frame_hdr hdr;
+    char path[BUFFER_SIZE];
+    while (1) {
+        int received = recv_msg(client_sock, &hdr, path, sizeof(path));
+        if (received < 0 || (hdr.opcode != OP_CMD && hdr.opcode != OP_END)) {
+            for (size_t i = 0; i < count; i++) free(entries[i].path);
+            free(entries);
+            if (received < 0 || hdr.opcode != OP_ERROR) return -1;
+            return send_text(client_sock, OP_ERROR, req_id, "ERROR: Batch aborted by client");
+        }
+        if (hdr.opcode == OP_END) break;
+        if (count == BATCH_MAX_ENTRIES) { too_many = 1; continue; }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            batch_fetch *grown = realloc(entries, capacity * sizeof(*entries));
+            if (!grown) { perror("realloc failed"); exit(EXIT_FAILURE); }
+            entries = grown;
+        }
+        entries[count] = (batch_fetch){ .sock = -1 };
+        if (!(entries[count++].path = strdup(path))) { perror("strdup failed"); exit(EXIT_FAILURE); }
+    }
+
+    int rc = 0;
+    if (too_many) rc = send_text(client_sock, OP_ERROR, req_id, "ERROR: Too many files in batch");
+    for (size_t started = 0, served = 0; !too_many && served < count; served++) {
+        for (; started < count && started < served + BATCH_WINDOW; started++)
+            batch_prefetch(&entries[started], req_id, compress);
+
+        batch_fetch *f = &entries[served];
+        if (send_text(client_sock, OP_RESP, req_id, f->path) < 0) { rc = -1; break; }
+        int peek = f->sock >= 0 && f->replicas > 1 ? reply_peek(f->sock, req_id) : 0;
+        if (f->cached) {
+            send_cached(client_sock, req_id, f->cached, 0, -1, f->compress);
+            cache_release(f->cached);
+            f->cached = NULL;
+        } else if (peek != 0) {
+            // The replica lacks the file or failed: handle_downlf tries the others
+            frame_hdr hdr;
+            char reply[BUFFER_SIZE];
+            pool_release(f->port, f->sock, peek == 1 && recv_msg(f->sock, &hdr, reply, sizeof(reply)) == 0);
+            f->sock = -1;
+            handle_downlf(client_sock, req_id, f->path, NULL, NULL, compress);
+        } else if (f->sock >= 0) {
+            int relayed = f->fill ? relay_fill(f->sock, client_sock, req_id, f->rel_path, f->fill, f->compress)
+                                  : relay_stream(f->sock, client_sock, req_id);
+            pool_release(f->port, f->sock, relayed != -1);
+            f->sock = -1;
+        } else {
+            handle_downlf(client_sock, req_id, f->path, NULL, NULL, compress);
+        }
+    }
+    if (rc == 0 && !too_many) rc = send_frame(client_sock, OP_END, 0, req_id, NULL, 0);
+
+    // Prefetches the client no longer waits for leave their connections mid-reply
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].sock >= 0) pool_release(entries[i].port, entries[i].sock, 0);
+        if (entries[i].cached) cache_release(entries[i].cached);
+        free(entries[i].rel_path);
+        free(entries[i].path);
+    }
+    free(entries);
+    return rc < 0 ? -1 : 0;
+}
+
+// Copies rel_path from shard `from` to shard `to`, streaming it across (RETRIEVE into STORE)
+// with the source's `mtime` so the copy compares equal to it. A copy on `to` that is newer
+// still (an upload since the caller looked) is kept. Returns 0 once `to` is current.
+int shard_copy(int from, int to, const char *rel_path, time_t mtime, uint32_t req_id) {
+    char command[BUFFER_SIZE], response[BUFFER_SIZE];
+    frame_hdr hdr;
+    long long size, current;
+    snprintf(command, sizeof(command), "STAT %s", rel_path);
+    if (backend_request(to, req_id, command, &hdr, response, sizeof(response)) < 0) return -1;
+    if (hdr.opcode == OP_RESP && sscanf(response, "SIZE %lld MTIME %lld", &size, &current) == 2 && current > mtime) return 0;
+
+    int src = pool_acquire(from);
+    if (src < 0) return -1;
+    snprintf(command, sizeof(command), "RETRIEVE %s", rel_path);
+    if (send_text(src, OP_CMD, req_id, command) < 0) { pool_release(from, src, 0); return -1; }
+    store_command(rel_path, mtime, command, sizeof(command));
+    store_group dst = { .count = 1, .ports = { to } };
+    store_open(&dst, req_id, command, response, sizeof(response));
+
+    // The RETRIEVE reply is plain DATA frames and an END (or an ERROR), just like an upload
+    int rc = -1, in_sync = 0;
+    while (recv_frame_hdr(src, &hdr) == 0 && hdr.req_id == req_id) {
+        if (hdr.opcode == OP_DATA) {
+            int relayed = dst.socks[0] < 0 ? (skip_payload(src, hdr.length) < 0 ? -1 : 0)
+                          : send_frame_hdr(dst.socks[0], OP_DATA, 0, req_id, hdr.length) < 0 ? -2
+                          : relay_payload(src, dst.socks[0], hdr.length, 1);
+            if (relayed == -1) break;
+            if (relayed == -2) store_drop(&dst, 0);
+            continue;
+        }
+        in_sync = hdr.opcode == OP_END || skip_payload(src, hdr.length) == 0;
+        if (store_end(&dst, req_id, hdr.opcode != OP_END) > 0)
+            rc = store_result(&dst, req_id, response, sizeof(response)) && hdr.opcode == OP_END ? 0 : -1;
+        break;
+    }
+    store_drop(&dst, 0);
+    pool_release(from, src, in_sync);
+    return rc;
+}
+
+// A copy of a file, as the FILES listing of the shard holding it describes it
+typedef struct {
+    const char *path;
+    int port;
+    unsigned long long size;
+    long long mtime;
+} shard_file;
+
+// By path, then newest first
+int shard_file_cmp(const void *a, const void *b) {
+    const shard_file *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    if (c) return c;
+    if (x->mtime != y->mtime) return x->mtime > y->mtime ? -1 : 1;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    return x->port - y->port;
+}
+
+// The FILES listing of one shard, or NULL if it cannot be had
+char *shard_files(int port, uint32_t req_id) {
+    int sock = pool_acquire(port);
+    frame_hdr hdr;
+    char *files = NULL;
+    if (sock >= 0 && send_text(sock, OP_CMD, req_id, "FILES") == 0 &&
+        recv_frame_hdr(sock, &hdr) == 0 && hdr.req_id == req_id && hdr.opcode == OP_RESP &&
+        (files = malloc(hdr.length + 1)) && recv_all(sock, files, hdr.length) == 0) {
+        files[hdr.length] = '\0';
+        pool_release(port, sock, 1);
+        return files;
+    }
+    pool_release(port, sock, 0);
+    free(files);
+    return NULL;
+}
+
+typedef struct {
+    int copied, dropped, failed, unreachable;
+} reconcile_stats;
+
+// Puts the copies of one file (sorted by shard_file_cmp) where its type's ring says: the
+// newest goes to every replica that lacks it, and copies on shards that are not replicas are
+// deleted once all the replicas have it.
+void shard_reconcile_file(file_type type, const shard_file *copies, size_t count, uint32_t req_id, reconcile_stats *stats) {
+    const shard_file *newest = &copies[0];
+    int owners[MAX_REPLICAS], replicas = shard_owners(type, newest->path, owners), current = 0;
+    for (int r = 0; r < replicas; r++) {
+        size_t i = 0;
+        while (i < count && copies[i].port != owners[r]) i++;
+        if (i < count && copies[i].size == newest->size && copies[i].mtime == newest->mtime) { current++; continue; }
+        debug_print("Copying %s from port %d to %d\n", newest->path, newest->port, owners[r]);
+        if (shard_copy(newest->port, owners[r], newest->path, newest->mtime, req_id) == 0) {
+            stats->copied++;
+            current++;
+        } else {
+            stats->failed++;
+        }
+    }
+    for (size_t i = 0; i < count && current == replicas; i++) {
+        int owned = 0;
+        for (int r = 0; r < replicas; r++) owned |= copies[i].port == owners[r];
+        if (owned) continue;
+        char command[BUFFER_SIZE], response[BUFFER_SIZE];
+        frame_hdr hdr;
+        snprintf(command, sizeof(command), "DELETE %s", copies[i].path);
+        debug_print("Dropping %s from port %d\n", copies[i].path, copies[i].port);
+        if (backend_request(copies[i].port, req_id, command, &hdr, response, sizeof(response)) == 0 && hdr.opcode == OP_RESP)
+            stats->dropped++;
+        else
+            stats->failed++;
+    }
+}
+
+// Brings every shard in line with the rings: files that are not on all of their replicas
+// are copied there (a replica that was down during an upload, or a new owner after the rings
+// changed) and copies on shards that no longer hold the file are removed. The copy with the
+// newest mtime wins. Files are handled one at a time while S1 keeps serving; an upload racing
+// with the copy of the same file may be overwritten until the next pass, and a removef racing
+// with it may see the file come back.
+pthread_mutex_t reconcile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void shard_reconcile(uint32_t req_id, reconcile_stats *stats) {
+    pthread_mutex_lock(&reconcile_lock);
+    for (int type = 0; type < C_FILE; type++) {
+        int ports[MAX_SHARDS];
+        int count = shard_list(type, ports);
+        char *lists[MAX_SHARDS];
+        shard_file *files = NULL;
+        size_t total = 0, cap = 0;
+        for (int i = 0; i < count; i++) {
+            if (!(lists[i] = shard_files(ports[i], req_id))) { stats->unreachable++; continue; }
+            for (char *save = NULL, *line = strtok_r(lists[i], "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+                shard_file f = { .port = ports[i] };
+                int skip = 0;
+                if (sscanf(line, "%llu %lld %n", &f.size, &f.mtime, &skip) < 2 || !line[skip]) continue;
+                f.path = line + skip;
+                if (total == cap) {
+                    cap = cap ? cap * 2 : 1024;
+                    files = realloc(files, cap * sizeof(shard_file));
+                    if (!files) { perror("realloc failed"); exit(EXIT_FAILURE); }
+                }
+                files[total++] = f;
+            }
+        }
+        qsort(files, total, sizeof(shard_file), shard_file_cmp);
+        for (size_t i = 0, end; i < total; i = end) {
+            for (end = i + 1; end < total && strcmp(files[end].path, files[i].path) == 0; end++) {}
+            shard_reconcile_file(type, files + i, end - i, req_id, stats);
+        }
+        free(files);
+        for (int i = 0; i < count; i++) free(lists[i]);
+    }
+    pthread_mutex_unlock(&reconcile_lock);
+    __atomic_add_fetch(&metrics.repair_copies, stats->copied, __ATOMIC_RELAXED);
+}
+
+// Replies "<what> moved <n> copied <m> failed <k>", plus "unreachable <j>" if shards could not
+// be listed. `moved` counts copies removed from shards that no longer hold the file.
+void reconcile_reply(int client_sock, uint32_t req_id, const char *what, const reconcile_stats *stats) {
+    char reply[128];
+    snprintf(reply, sizeof(reply), "%s moved %d copied %d failed %d", what, stats->dropped, stats->copied, stats->failed);
+    if (stats->unreachable)
+        snprintf(reply + strlen(reply), sizeof(reply) - strlen(reply), " unreachable %d", stats->unreachable);
+    send_text(client_sock, OP_RESP, req_id, reply);
+}
+
+// rebalance: re-reads <base_dir>.shards and moves every file to the shards its type's ring
+// now assigns it to (see shard_reconcile); replies "REBALANCE moved <n> copied <m> failed <k>".
+// Until a file has moved, requests for it go to its new owners and miss.
+void handle_rebalance(int client_sock, uint32_t req_id) {
+    char err[BUFFER_SIZE];
+    if (shard_load(err, sizeof(err))) {
+        char reply[BUFFER_SIZE + 16];
+        snprintf(reply, sizeof(reply), "ERROR: %s", err);
+        send_text(client_sock, OP_ERROR, req_id, reply);
+        return;
+    }
+    reconcile_stats stats = { 0 };
+    shard_reconcile(req_id, &stats);
+    reconcile_reply(client_sock, req_id, "REBALANCE", &stats);
+}
+
+// repair: runs the pass the repair thread makes every REPAIR_INTERVAL_SECS right away
+void handle_repair(int client_sock, uint32_t req_id) {
+    reconcile_stats stats = { 0 };
+    shard_reconcile(req_id, &stats);
+    reconcile_reply(client_sock, req_id, "REPAIR", &stats);
+}
+
+#define REPAIR_INTERVAL_SECS 60  // between background repair passes, when files are replicated
+
+void *repair_main(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(REPAIR_INTERVAL_SECS);
+        int replicated = 0;
+        for (int type = 0; type < C_FILE; type++) replicated |= shard_copies(type) > 1;
+        if (!replicated) continue;
+        reconcile_stats stats = { 0 };
+        shard_reconcile(0, &stats);
+        if (stats.copied || stats.dropped || stats.failed)
+            debug_print("Repair: copied %d, moved %d, failed %d\n", stats.copied, stats.dropped, stats.failed);
+    }
+    return NULL;
+}
+
+// Parses and runs one client command on a worker thread. Returns -1 if the client
+// connection is no longer usable.
+int process_command(int client_sock, uint32_t req_id, uint16_t flags, char *buffer) {
+    debug_print("Command: %s\n", buffer);
+    char *save = NULL;
+    char *cmd = strtok_r(buffer, " ", &save);
+    if (!cmd) return send_text(client_sock, OP_ERROR, req_id, "ERROR: Unknown command");
+
+    if (strcmp(cmd, "uploadf") == 0) {
+        char *filename = strtok_r(NULL, " ", &save);
+        char *dest_path = strtok_r(NULL, " ", &save);
+        return handle_uploadf(client_sock, req_id, filename, dest_path);
+    }
+    else if (strcmp(cmd, "uploadp") == 0) {
+        char *dest_path = strtok_r(NULL, " ", &save);
+        char *size = strtok_r(NULL, " ", &save);
+        char *part_size = strtok_r(NULL, " ", &save);
+        handle_uploadp(client_sock, req_id, dest_path, size, part_size);
+    }
+    else if (strcmp(cmd, "uploadpart") == 0) {
+        char *id = strtok_r(NULL, " ", &save);
+        char *index = strtok_r(NULL, " ", &save);
+        return handle_uploadpart(client_sock, req_id, id, index);
+    }
+    else if (strcmp(cmd, "uploadcommit") == 0) {
+        char *id = strtok_r(NULL, " ", &save);
+        handle_uploadcommit(client_sock, req_id, id);
+    }
+    else if (strcmp(cmd, "uploadabort") == 0) {
+        char *id = strtok_r(NULL, " ", &save);
+        handle_uploadabort(client_sock, req_id, id);
+    }
+    else if (strcmp(cmd, "uploadb") == 0) {
+        return handle_uploadb(client_sock, req_id);
+    }
+    else if (strcmp(cmd, "downlb") == 0) {
+        return handle_downlb(client_sock, req_id, (flags & FLAG_LZ4) != 0);
+    }
+    else if (strcmp(cmd, "downlf") == 0) {
+        char *filepath = strtok_r(NULL, " ", &save);
+        char *offset = strtok_r(NULL, " ", &save);
+        char *length = strtok_r(NULL, " ", &save);
+        handle_downlf(client_sock, req_id, filepath, offset, length, (flags & FLAG_LZ4) != 0);
+    } 
+    else if (strcmp(cmd, "rebalance") == 0) {
+        handle_rebalance(client_sock, req_id);
+    }
+    else if (strcmp(cmd, "repair") == 0) {
+        handle_repair(client_sock, req_id);
+    }
+    else if (strcmp(cmd, "cachestats") == 0) {
+        handle_cachestats(client_sock, req_id);
+    }
+    else if (strcmp(cmd, "stats") == 0) {
+        char *server = strtok_r(NULL, " ", &save);
+        handle_stats(client_sock, req_id, server);
+    }
+    else if (strcmp(cmd, "HELLO") == 0) {
+        // Optional features are granted by naming them in the reply
+        char reply[64] = "HELLO lz4", *feature;
+        while ((feature = strtok_r(NULL, " ", &save)))
+            if (strcmp(feature, "pipeline") == 0) strcat(reply, " pipeline");
+        return send_text(client_sock, OP_RESP, req_id, reply);
+    }
+    else if (strcmp(cmd, "statf") == 0) {
+        char *filepath = strtok_r(NULL, " ", &save);
+        handle_statf(client_sock, req_id, filepath);
+    } 
+    else if (strcmp(cmd, "removef") == 0) {
+        char *filepath = strtok_r(NULL, " ", &save);
+        handle_removef(client_sock, req_id, filepath);
+    } 
+    else if (strcmp(cmd, "downltar") == 0) {
+        char *filetype = strtok_r(NULL, " ", &save);
+        handle_downltar(client_sock, req_id, filetype);
+    } 
+    else if (strcmp(cmd, "dispfnames") == 0) {
+        char *dirpath = strtok_r(NULL, " ", &save);
+        handle_dispfnames(client_sock, req_id, dirpath);
+    } 
+    else {
+        return send_text(client_sock, OP_ERROR, req_id, "ERROR: Unknown command");
+    }
+    return 0;
+}
+
+
+// Event-driven front end: one epoll thread owns every idle client connection and assembles
+// command frames without blocking; a complete command is queued to a fixed pool of workers
+// that run it with ordinary blocking I/O and then hand the connection back to epoll.
+//
+// Pipelining: a client that negotiated "HELLO ... pipeline" may send further commands without
+// waiting for replies. epoll keeps reading them and up to PIPELINE_DEPTH run at once; each
+// reply carries its command's req_id and replies go out in completion order, one whole reply
+// at a time (see send_frame_hdr). Commands that read a body from the socket or change the
+// session (uploads, HELLO) run alone once everything before them has finished, and commands
+// naming the same path run in the order they were sent unless both only read it. As with any pipelined protocol the
+// client must keep reading replies while it is sending.
+#define PIPELINE_DEPTH 32        // commands of one connection running at once (at most 64)
+
+typedef enum {CONN_READ_HDR, CONN_READ_CMD} conn_state;
+
+typedef struct connection connection;
+
+// A command read from a connection
+typedef struct request {
+    connection *conn;
+    frame_hdr hdr;
+    char *cmd;
+    uint64_t key;                // hash of the path the command names
+    int exclusive;               // runs alone: nothing else of its connection is read or run
+    int writes;                  // changes its path, so it is ordered against reads of it too
+    int slot;                    // its entry in conn->keys while it runs
+    struct request *next;        // work queue link
+} request;
+
+struct connection {
+    int fd;
+    conn_state state;            // the read state is only touched by whoever has the connection armed
+    unsigned char raw[FRAME_HDR_SIZE];
+    size_t have;                 // bytes of the header or command read so far
+    frame_hdr hdr;
+    char *cmd;                   // allocated only while a command is being read
+    pthread_mutex_t reply_lock;  // held by the command whose reply is being written
+    pthread_mutex_t lock;        // guards the fields below
+    int pipeline;                // the client negotiated pipelining
+    uint64_t running;            // bitmap of keys[] in use by running commands
+    uint64_t writing;            // the subset of running that are writes
+    uint64_t keys[PIPELINE_DEPTH];
+    int exclusive;               // an exclusive command is running
+    int paused;                  // not armed: epoll reads nothing until a worker resumes it
+    int closing;                 // nothing more is read; the connection is closed once idle
+    int broken;                  // a transfer failed mid-stream: held commands are dropped
+    request *held;               // read, but waiting for a conflicting command to finish
+};
+
+int epoll_fd;
+int max_connections = MAX_CONNECTIONS;
+int worker_count = WORKER_THREADS;
+int active_connections;
+
+request *queue_head, *queue_tail;
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+void close_connection(connection *conn) {
+    close(conn->fd);
+    if (conn->held) { free(conn->held->cmd); free(conn->held); }
+    free(conn->cmd);
+    pthread_mutex_destroy(&conn->reply_lock);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+}
+
+// Connections are registered one-shot so that exactly one thread reads a connection at a time
+int arm_connection(connection *conn, int op) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn };
+    if (epoll_ctl(epoll_fd, op, conn->fd, &ev) < 0) {
+        debug_print("epoll_ctl failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Stops reading a connection for good and closes it unless commands are still running
+void shut_connection(connection *conn) {
+    pthread_mutex_lock(&conn->lock);
+    conn->closing = 1;
+    conn->paused = 1;
+    int idle = conn->running == 0;
+    pthread_mutex_unlock(&conn->lock);
+    if (idle) close_connection(conn);
+}
+
+void queue_push(request *req) {
+    req->next = NULL;
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail) queue_tail->next = req; else queue_head = req;
+    queue_tail = req;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+request *queue_pop(void) {
+    pthread_mutex_lock(&queue_lock);
+    while (!queue_head) pthread_cond_wait(&queue_cond, &queue_lock);
+    request *req = queue_head;
+    queue_head = req->next;
+    if (!queue_head) queue_tail = NULL;
+    pthread_mutex_unlock(&queue_lock);
+    return req;
+}
+
+// Commands that only reply may overlap; anything that reads a body or is unknown runs alone
+int command_exclusive(const char *cmd) {
+    static const char *shared[] = { "downlf", "statf", "removef", "dispfnames", "downltar", "cachestats", "stats" };
+    size_t len = strcspn(cmd, " ");
+    for (size_t i = 0; i < sizeof(shared) / sizeof(shared[0]); i++)
+        if (strlen(shared[i]) == len && strncmp(shared[i], cmd, len) == 0) return 0;
+    return 1;
+}
+
+// Ordering key of a command: its first argument, with any ~S1/ prefix dropped
+uint64_t command_key(const char *cmd) {
+    const char *arg = cmd + strcspn(cmd, " ");
+    arg += strspn(arg, " ");
+    if (strncmp(arg, "~S1/", 4) == 0) arg += 4;
+    char key[BUFFER_SIZE];
+    snprintf(key, sizeof(key), "%.*s", (int)strcspn(arg, " "), arg);
+    return index_hash(key);
+}
+
+// The rules below are evaluated with conn->lock held
+int request_ready(connection *conn, const request *req) {
+    if (conn->exclusive) return 0;
+    if (req->exclusive) return conn->running == 0;
+    if (__builtin_popcountll(conn->running) >= PIPELINE_DEPTH) return 0;
+    uint64_t conflicting = req->writes ? conn->running : conn->writing;
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
+        if ((conflicting >> i & 1) && conn->keys[i] == req->key) return 0;
+    return 1;
+}
+
+void request_start(connection *conn, request *req) {
+    req->slot = __builtin_ctzll(~conn->running);
+    conn->running |= 1ULL << req->slot;
+    if (req->writes) conn->writing |= 1ULL << req->slot;
+    conn->keys[req->slot] = req->key;
+    if (req->exclusive) conn->exclusive = 1;
+}
+
+int connection_readable(const connection *conn) {
+    int limit = conn->pipeline ? PIPELINE_DEPTH : 1;
+    return !conn->closing && !conn->held && !conn->exclusive && __builtin_popcountll(conn->running) < limit;
+}
+
+// Turns the command just read into a request and starts it, or holds it back until it can
+// run. Returns 1 if epoll should go on reading the connection, 0 if it is now paused and
+// -1 if the request could not be allocated.
+int take_command(connection *conn) {
+    request *req = calloc(1, sizeof(*req));
+    if (!req) return -1;
+    conn->cmd[conn->have] = '\0';
+    req->conn = conn;
+    req->hdr = conn->hdr;
+    req->cmd = conn->cmd;
+    req->exclusive = command_exclusive(req->cmd);
+    req->key = command_key(req->cmd);
+    req->writes = strncmp(req->cmd, "removef ", 8) == 0;
+    conn->cmd = NULL;
+    conn->state = CONN_READ_HDR;
+    conn->have = 0;
+
+    pthread_mutex_lock(&conn->lock);
+    int ready = request_ready(conn, req);
+    if (ready) request_start(conn, req); else conn->held = req;
+    // HELLO runs alone, so every command read after it is already in the negotiated mode
+    if (strncmp(req->cmd, "HELLO ", 6) == 0 && strstr(req->cmd, " pipeline")) conn->pipeline = 1;
+    int more = connection_readable(conn);
+    if (!more) conn->paused = 1;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (ready) queue_push(req);
+    return more;
+}
+
+// Retires a finished request: a held command may be able to start now, and epoll resumes
+// reading once the connection has room again
+void request_done(request *req, int rc) {
+    connection *conn = req->conn;
+    request *next = NULL;
+    pthread_mutex_lock(&conn->lock);
+    conn->running &= ~(1ULL << req->slot);
+    conn->writing &= ~(1ULL << req->slot);
+    if (req->exclusive) conn->exclusive = 0;
+    if (rc < 0 && !conn->broken) {
+        // The stream is out of sync; if epoll is still reading, it wakes up to EOF
+        conn->broken = conn->closing = 1;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    if (!conn->broken && conn->held && request_ready(conn, conn->held)) {
+        next = conn->held;
+        conn->held = NULL;
+        request_start(conn, next);
+    }
+    int resume = conn->paused && connection_readable(conn);
+    if (resume) conn->paused = 0;
+    int idle = conn->closing && conn->paused && conn->running == 0;
+    pthread_mutex_unlock(&conn->lock);
+
+    free(req);
+    if (next) queue_push(next);
+    if (idle) close_connection(conn);
+    else if (resume && arm_connection(conn, EPOLL_CTL_MOD) < 0) shut_connection(conn);
+}
+
+void *worker_main(void *arg) {
+    (void)arg;
+    while (1) {
+        request *req = queue_pop();
+        connection *conn = req->conn;
+        uint64_t started = now_us();
+        command_metric *metric = metric_for(req->cmd);
+        command_failed = 0;
+        reply_fd = conn->fd;
+        reply_lock = &conn->reply_lock;
+        int rc = process_command(conn->fd, req->hdr.req_id, req->hdr.flags, req->cmd);
+        if (reply_locked) pthread_mutex_unlock(reply_lock);
+        reply_locked = 0;
+        reply_fd = -1;
+        metric_record(metric, started, rc < 0 || command_failed);
+        free(req->cmd);
+        request_done(req, rc);
+    }
+    return NULL;
+}
+
+// Advances a connection's read state machine with whatever bytes are already available.
+// Complete commands go onto the work queue until the connection has to wait for them.
+void on_readable(connection *conn) {
+    while (1) {
+        if (conn->state == CONN_READ_CMD && conn->have == conn->hdr.length) {
+            int more = take_command(conn);
+            if (more < 0) shut_connection(conn);
+            if (more <= 0) return;
+            continue;
+        }
+
+        char *dst = conn->state == CONN_READ_HDR ? (char *)conn->raw + conn->have : conn->cmd + conn->have;
+        size_t want = conn->state == CONN_READ_HDR ? FRAME_HDR_SIZE - conn->have : conn->hdr.length - conn->have;
+        ssize_t n = recv(conn->fd, dst, want, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (arm_connection(conn, EPOLL_CTL_MOD) < 0) shut_connection(conn);
+            return;
+        }
+        if (n > 0) __atomic_add_fetch(&metrics.bytes_in, n, __ATOMIC_RELAXED);
+        if (n <= 0) {
+            debug_print("Client disconnected\n");
+            shut_connection(conn);
+            return;
+        }
+        conn->have += n;
+
+        if (conn->state == CONN_READ_HDR && conn->have == FRAME_HDR_SIZE) {
+            if (decode_frame_hdr(conn->raw, &conn->hdr) < 0 || conn->hdr.opcode != OP_CMD ||
+                conn->hdr.length >= BUFFER_SIZE) {
+                debug_print("Dropping client that sent an invalid command frame\n");
+                shut_connection(conn);
+                return;
+            }
+            conn->cmd = malloc(conn->hdr.length + 1);
+            if (!conn->cmd) { shut_connection(conn); return; }
+            conn->state = CONN_READ_CMD;
+            conn->have = 0;
+        }
+    }
+}
+
+void accept_connections(int server_fd) {
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) debug_print("Accept error: %s\n", strerror(errno));
+            return;
+        }
+        if (__atomic_load_n(&active_connections, __ATOMIC_RELAXED) >= max_connections) {
+            send_text(fd, OP_ERROR, 0, "ERROR: Server busy");
+            close(fd);
+            continue;
+        }
+
+        struct timeval tv = { .tv_sec = CLIENT_IO_TIMEOUT_SECS };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        // Replies are already coalesced with MSG_MORE; Nagle would only hold back the tail of
+        // a multi-part reply (e.g. a dispfnames listing) until the client's delayed ACK
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        connection *conn = calloc(1, sizeof(*conn));
+        if (!conn) { close(fd); continue; }
+        conn->fd = fd;
+        conn->state = CONN_READ_HDR;
+        pthread_mutex_init(&conn->reply_lock, NULL);
+        pthread_mutex_init(&conn->lock, NULL);
+        __atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+        if (arm_connection(conn, EPOLL_CTL_ADD) < 0) close_connection(conn);
+    }
+}
+
+// Lifts the open-file limit so the configured number of connections can actually be accepted
+void raise_fd_limit(rlim_t wanted) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= wanted) return;
+    rl.rlim_cur = wanted < rl.rlim_max ? wanted : rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0) debug_print("setrlimit failed: %s\n", strerror(errno));
+    if (rl.rlim_cur < wanted) debug_print("Open file limit %llu caps connections below %llu\n",
+                                          (unsigned long long)rl.rlim_cur, (unsigned long long)wanted);
+}
+
+// Renders every metric in the Prometheus text exposition format
+void metrics_header(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_value(FILE *out, const char *name, const char *type, const char *help, unsigned long long value) {
+    metrics_header(out, name, type, help);
+    fprintf(out, "%s{server=\"%s\"} %llu\n", name, BASE_DIR_NAME, value);
+}
+
+char *metrics_text(size_t *length) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    size_t commands = sizeof(command_metrics) / sizeof(command_metrics[0]);
+    char *text = NULL;
+    FILE *out = open_memstream(&text, length);
+    if (!out) return NULL;
+
+    metrics_header(out, "dfs_requests_total", "counter", "Commands completed.");
+    for (size_t i = 0; i < commands; i++)
+        fprintf(out, "dfs_requests_total{server=\"%s\",command=\"%s\"} %llu\n", BASE_DIR_NAME, command_metrics[i].name,
+                __atomic_load_n(&command_metrics[i].count, __ATOMIC_RELAXED));
+    metrics_header(out, "dfs_request_errors_total", "counter", "Commands that replied with an error or lost the connection.");
+    for (size_t i = 0; i < commands; i++)
+        fprintf(out, "dfs_request_errors_total{server=\"%s\",command=\"%s\"} %llu\n", BASE_DIR_NAME, command_metrics[i].name,
+                __atomic_load_n(&command_metrics[i].errors, __ATOMIC_RELAXED));
+    metrics_header(out, "dfs_request_duration_seconds", "summary", "Command latency, from the complete command frame to the last reply byte.");
+    for (size_t i = 0; i < commands; i++) {
+        const command_metric *m = &command_metrics[i];
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            fprintf(out, "dfs_request_duration_seconds{server=\"%s\",command=\"%s\",quantile=\"%g\"} %.6f\n",
+                    BASE_DIR_NAME, m->name, quantiles[q], metric_quantile(m, quantiles[q]) / 1e6);
+        fprintf(out, "dfs_request_duration_seconds_sum{server=\"%s\",command=\"%s\"} %.6f\n", BASE_DIR_NAME, m->name,
+                __atomic_load_n(&m->sum_us, __ATOMIC_RELAXED) / 1e6);
+        fprintf(out, "dfs_request_duration_seconds_count{server=\"%s\",command=\"%s\"} %llu\n", BASE_DIR_NAME, m->name,
+                __atomic_load_n(&m->count, __ATOMIC_RELAXED));
+    }
+    metrics_header(out, "dfs_request_duration_max_seconds", "gauge", "Slowest command since startup.");
+    for (size_t i = 0; i < commands; i++)
+        fprintf(out, "dfs_request_duration_max_seconds{server=\"%s\",command=\"%s\"} %.6f\n", BASE_DIR_NAME, command_metrics[i].name,
+                __atomic_load_n(&command_metrics[i].max_us, __ATOMIC_RELAXED) / 1e6);
+
+    metrics_value(out, "dfs_received_bytes_total", "counter", "Bytes read from client and storage server sockets.",
+                  __atomic_load_n(&metrics.bytes_in, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_sent_bytes_total", "counter", "Bytes written to client and storage server sockets.",
+                  __atomic_load_n(&metrics.bytes_out, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_connections_active", "gauge", "Open client connections.",
+                  __atomic_load_n(&active_connections, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_backend_connect_errors_total", "counter", "Failed connections or handshakes to S2/S3/S4.",
+                  __atomic_load_n(&metrics.backend_errors, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_hedged_reads_total", "counter", "Downloads also sent to a second replica after HEDGE_DELAY_MS.",
+                  __atomic_load_n(&metrics.hedged_reads, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_repair_copies_total", "counter", "Files copied to replicas that lacked them or held an old version.",
+                  __atomic_load_n(&metrics.repair_copies, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_tar_cache_hits_total", "counter", "Archives sent from an up-to-date tar cache.",
+                  __atomic_load_n(&metrics.tar_hits, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_tar_cache_updates_total", "counter", "Archives that only had the files changed since the last one looked up again.",
+                  __atomic_load_n(&metrics.tar_updates, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_tar_cache_rebuilds_total", "counter", "Archives listed from the whole index.",
+                  __atomic_load_n(&metrics.tar_rebuilds, __ATOMIC_RELAXED));
+#ifdef USE_JOURNAL
+    metrics_value(out, "dfs_journal_commits_total", "counter", "Journal group commits (one syncfs and one fdatasync each).",
+                  __atomic_load_n(&metrics.journal_commits, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_journal_files_total", "counter", "Uploaded .c files that went through the journal.",
+                  __atomic_load_n(&metrics.journal_files, __ATOMIC_RELAXED));
+#endif
+    metrics_value(out, "dfs_relay_zero_copy_bytes_total", "counter", "Backend bytes relayed with splice().",
+                  __atomic_load_n(&relay_stats.zero_copy_bytes, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_relay_copied_bytes_total", "counter", "Backend bytes relayed through a buffer.",
+                  __atomic_load_n(&relay_stats.copied_bytes, __ATOMIC_RELAXED));
+
+    pthread_mutex_lock(&cache_lock);
+    unsigned long long hits = cache_stats.hits, misses = cache_stats.misses, fills = cache_stats.fills;
+    unsigned long long evictions = cache_stats.evictions, objects = cache_lru.count, bytes = cache_bytes;
+    pthread_mutex_unlock(&cache_lock);
+    metrics_value(out, "dfs_cache_hits_total", "counter", "Downloads served from the hot-object cache.", hits);
+    metrics_value(out, "dfs_cache_misses_total", "counter", "Cacheable downloads relayed from a storage server.", misses);
+    metrics_value(out, "dfs_cache_fills_total", "counter", "Files copied into the cache.", fills);
+    metrics_value(out, "dfs_cache_evictions_total", "counter", "Files evicted to stay within the capacity.", evictions);
+    metrics_value(out, "dfs_cache_objects", "gauge", "Files held in the cache.", objects);
+    metrics_value(out, "dfs_cache_bytes", "gauge", "Bytes held in the cache.", bytes);
+    metrics_value(out, "dfs_cache_capacity_bytes", "gauge", "Cache size limit.", cache_capacity);
+
+    if (fclose(out) != 0) { free(text); return NULL; }
+    return text;
+}
+
+// stats [S2|S3|S4]: metrics of S1, or of one storage server, as Prometheus text
+void handle_stats(int client_sock, uint32_t req_id, const char *server) {
+    if (server) {
+        // A storage server by name, or any shard by port
+        int port = strcmp(server, "S2") == 0 ? S2_PORT : strcmp(server, "S3") == 0 ? S3_PORT :
+                   strcmp(server, "S4") == 0 ? S4_PORT : atoi(server);
+        if (!pool_for_port(port)) { send_text(client_sock, OP_ERROR, req_id, "ERROR: Unknown server"); return; }
+        frame_hdr hdr;
+        int sock = pool_acquire(port);
+        if (sock < 0 || send_text(sock, OP_CMD, req_id, "STATS") < 0 ||
+            recv_frame_hdr(sock, &hdr) < 0 || hdr.req_id != req_id) {
+            pool_release(port, sock, 0);
+            send_text(client_sock, OP_ERROR, req_id, "ERROR: Storage server unavailable");
+            return;
+        }
+        int rc = send_frame_hdr(client_sock, hdr.opcode, 0, req_id, hdr.length) == 0
+                     ? relay_payload(sock, client_sock, hdr.length, 1) : -1;
+        if (rc == -1) shutdown(client_sock, SHUT_RDWR);
+        pool_release(port, sock, rc != -1);
+        return;
+    }
+
+    size_t length = 0;
+    char *text = metrics_text(&length);
+    if (text) send_frame(client_sock, OP_RESP, 0, req_id, text, length);
+    else send_text(client_sock, OP_ERROR, req_id, "ERROR: Out of memory");
+    free(text);
+}
+
+// Prometheus endpoint: every connection to 127.0.0.1:METRICS_PORT gets one HTTP/1.0 response
+// holding metrics_text(), whatever it asked for, so scrapers need no frame protocol
+void *metrics_main(void *arg) {
+    int server_fd = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) sleep(1);
+            continue;
+        }
+        struct timeval tv = { .tv_sec = 2 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        char request[BUFFER_SIZE];
+        size_t have = 0;
+        ssize_t n;
+        while (have < sizeof(request) - 1 && (n = recv(fd, request + have, sizeof(request) - 1 - have, 0)) > 0) {
+            have += n;
+            request[have] = '\0';
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+        }
+
+        size_t length = 0;
+        char *text = metrics_text(&length);
+        char head[128];
+        int head_len = snprintf(head, sizeof(head), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\n\r\n", text ? "200 OK" : "500 Internal Server Error", text ? length : 0);
+        if (send_all(fd, head, head_len, text ? MSG_MORE : 0) == 0 && text) send_all(fd, text, length, 0);
+        free(text);
+        close(fd);
+    }
+    return NULL;
+}
+
+void metrics_start(void) {
+    int opt = 1;
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(METRICS_PORT) };
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    pthread_t tid;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 16) < 0 ||
+        pthread_create(&tid, NULL, metrics_main, (void *)(intptr_t)fd) != 0) {
+        debug_print("Metrics endpoint disabled: %s\n", strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+// Main function
+// Usage: S1 [max_connections] [worker_threads] [cache_mb]
+int main(int argc, char *argv[]) {
+    int server_fd;
+    struct sockaddr_in address;
+    snprintf(base_dir, sizeof(base_dir), "%s/%s", getenv("HOME"), BASE_DIR_NAME);
+    signal(SIGPIPE, SIG_IGN);  // sendfile() has no MSG_NOSIGNAL; treat dead peers as EPIPE
+    if (argc > 1 && atoi(argv[1]) > 0) max_connections = atoi(argv[1]);
+    if (argc > 2 && atoi(argv[2]) > 0) worker_count = atoi(argv[2]);
+    if (argc > 3 && atoi(argv[3]) >= 0) cache_capacity = (size_t)atoi(argv[3]) * 1024 * 1024;
+    raise_fd_limit(max_connections + MAX_BACKENDS * POOL_SIZE + 64);
+    int opt = 1;
+
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) handle_error(errno, "Socket failed");
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) handle_error(errno, "Setsockopt failed");
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(PORT);
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) handle_error(errno, "Bind failed");
+    if (listen(server_fd, SOMAXCONN) < 0) handle_error(errno, "Listen failed");
+
+    if ((epoll_fd = epoll_create1(0)) < 0) handle_error(errno, "epoll_create1 failed");
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) handle_error(errno, "epoll_ctl failed");
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_t tid;
+        int err = pthread_create(&tid, NULL, worker_main, NULL);
+        if (err) handle_error(err, "pthread_create failed");
+        pthread_detach(tid);
+    }
+
+    debug_print("Server listening on port %d (%d workers, max %d connections)\n", PORT, worker_count, max_connections);
+    create_directory(base_dir);
+    char err[BUFFER_SIZE];
+    if (shard_load(err, sizeof(err))) handle_error(EINVAL, err);
+    index_load();
+#ifdef USE_JOURNAL
+    journal_load();
+#endif
+    part_load();
+    metrics_start();
+    pthread_t repair_tid;
+    int err_repair = pthread_create(&repair_tid, NULL, repair_main, NULL);
+    if (err_repair) handle_error(err_repair, "pthread_create failed");
+    pthread_detach(repair_tid);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) handle_error(errno, "epoll_wait failed");
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) accept_connections(server_fd);
+            else on_readable(events[i].data.ptr);
         }
     }
     return 0;
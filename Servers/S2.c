@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -8,14 +10,34 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
 #include <dirent.h>
-#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+#include <stdint.h>
+#include <endian.h>
+#include <sys/sendfile.h>
 
 #define PORT 7041  
 #define BUFFER_SIZE 4096
+#define CHUNK_SIZE 65536
 #define DEBUG 1
+#define WORKERS_PER_CORE 2    // threads for CPU- and network-bound work per core
+#define WORKERS_PER_DISK 8    // extra threads to keep the store's disk queue busy
+#define QUEUE_CAPACITY 256    // commands waiting for a worker before new ones are refused
+#define ZERO_COPY 1
 #define BASE_DIR_NAME "S2"  
+#define TAR_TYPE ".pdf"       // the type SENDTAR archives
 char base_dir[256];
+char server_name[32] = BASE_DIR_NAME;  // BASE_DIR_NAME, or BASE_DIR_NAME-<port> for an extra instance
+int listen_port = PORT;
 
 #define debug_print(fmt, ...) \
     do { if (DEBUG) fprintf(stderr, "[S2 DEBUG] %s:%d:%s(): " fmt, __FILE__, \
@@ -24,14 +46,2165 @@ char base_dir[256];
 #define handle_error(en, msg) \
     do { debug_print("ERROR: %s - %s\n", msg, strerror(en)); exit(EXIT_FAILURE); } while (0)
 
+// Wire protocol: every message is a 16-byte header followed by `length` payload bytes.
+// Header (network byte order): version(1) opcode(1) flags(2) req_id(4) length(8)
+#define PROTO_VERSION 1
+#define FRAME_HDR_SIZE 16
+
+typedef enum {OP_CMD = 1, OP_RESP, OP_ERROR, OP_DATA, OP_END} frame_op;
+
+// DATA frame flag: this frame completes one archive entry (see send_tar_stream)
+#define FLAG_ENTRY_END 0x0001
+// DATA frame flag: the payload is LZ4-compressed; on a command: the reply may be (see send_data)
+#define FLAG_LZ4 0x0002
+
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint32_t req_id;
+    uint64_t length;
+} frame_hdr;
+
+#ifdef USE_IO_URING
+int uring_ready(void);
+int uring_recv_file_stream(int sock, int fd, char *err, size_t err_size);
+int uring_send_file(int sock, uint32_t req_id, int fd, off_t offset, off_t size);
+#endif
+
+#ifdef USE_DEDUP
+int64_t manifest_size(int fd);
+int dedup_send_body(int sock, int fd, uint64_t offset, uint64_t length);
+#endif
+void tar_cache_note(const char *path);
+
+// Metrics: counters are bumped with relaxed atomics on the hot path and never take a lock.
+// Command latencies go into log-linear (HDR-style) histograms: every power of two of
+// microseconds is split into METRIC_SUB_BUCKETS linear buckets, so a quantile read back from
+// the histogram is within ~6% of the true value anywhere from 1 us to hours. The totals are
+// exposed by the STATS command and as Prometheus text on 127.0.0.1:metrics_port.
+#define METRICS_PORT 7141                            // PORT + 100
+int metrics_port = METRICS_PORT;
+#define METRIC_SUB_BITS 4
+#define METRIC_SUB_BUCKETS (1 << METRIC_SUB_BITS)
+#define METRIC_BUCKETS (33 * METRIC_SUB_BUCKETS)     // latencies up to 2^36 us (~19 h)
+
+typedef struct {
+    const char *name;
+    unsigned long long count, errors, sum_us, max_us;
+    unsigned long long buckets[METRIC_BUCKETS];
+} command_metric;
+
+command_metric command_metrics[] = {
+    { .name = "STORE" }, { .name = "PPART" }, { .name = "RETRIEVE" }, { .name = "STAT" },
+    { .name = "DELETE" }, { .name = "LIST" }, { .name = "SENDTAR" },
+};
+
+struct {
+    unsigned long long bytes_in, bytes_out;
+    unsigned long long rejected;              // commands refused because the work queue was full
+    unsigned long long journal_commits, journal_files;
+    unsigned long long tar_hits, tar_updates, tar_rebuilds;  // see tar_cache_get()
+} metrics;
+
+__thread int command_failed;  // set when the command running on this thread replies with an error
+
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int metric_bucket(uint64_t us) {
+    if (us < METRIC_SUB_BUCKETS) return us;
+    int e = 63 - __builtin_clzll(us);
+    int b = (e - METRIC_SUB_BITS + 1) * METRIC_SUB_BUCKETS + (int)((us >> (e - METRIC_SUB_BITS)) & (METRIC_SUB_BUCKETS - 1));
+    return b < METRIC_BUCKETS ? b : METRIC_BUCKETS - 1;
+}
+
+// Smallest latency above bucket `b`
+uint64_t metric_bucket_limit(int b) {
+    if (b < METRIC_SUB_BUCKETS) return b + 1;
+    return (uint64_t)(METRIC_SUB_BUCKETS + b % METRIC_SUB_BUCKETS + 1) << (b / METRIC_SUB_BUCKETS - 1);
+}
+
+// The histogram for a command line, looked up by its first word; NULL for untracked commands
+command_metric *metric_for(const char *command) {
+    size_t len = strcspn(command, " ");
+    for (size_t i = 0; i < sizeof(command_metrics) / sizeof(command_metrics[0]); i++)
+        if (strlen(command_metrics[i].name) == len && strncmp(command_metrics[i].name, command, len) == 0)
+            return &command_metrics[i];
+    return NULL;
+}
+
+void metric_record(command_metric *m, uint64_t started_us, int failed) {
+    if (!m) return;
+    uint64_t us = now_us() - started_us;
+    __atomic_add_fetch(&m->count, 1, __ATOMIC_RELAXED);
+    if (failed) __atomic_add_fetch(&m->errors, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->buckets[metric_bucket(us)], 1, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&m->max_us, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&m->max_us, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Upper bound of the q-quantile latency, in microseconds
+uint64_t metric_quantile(const command_metric *m, double q) {
+    unsigned long long counts[METRIC_BUCKETS], total = 0;
+    for (int b = 0; b < METRIC_BUCKETS; b++) total += counts[b] = __atomic_load_n(&m->buckets[b], __ATOMIC_RELAXED);
+    if (total == 0) return 0;
+    unsigned long long rank = (unsigned long long)(q * total + 0.5), seen = 0;
+    if (rank == 0) rank = 1;
+    uint64_t max = __atomic_load_n(&m->max_us, __ATOMIC_RELAXED);
+    for (int b = 0; b < METRIC_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen >= rank) return metric_bucket_limit(b) - 1 < max ? metric_bucket_limit(b) - 1 : max;
+    }
+    return max;
+}
+
+void handle_stats(int client_sock, uint32_t req_id);
+
+// Frame I/O helpers
+int send_all(int sock, const void *buf, size_t len, int flags) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, flags | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n; len -= n;
+        __atomic_add_fetch(&metrics.bytes_out, n, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+int recv_all(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; len -= n;
+        __atomic_add_fetch(&metrics.bytes_in, n, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+int send_frame_hdr(int sock, uint8_t opcode, uint16_t flags, uint32_t req_id, uint64_t length) {
+    unsigned char hdr[FRAME_HDR_SIZE];
+    uint16_t f = htons(flags);
+    uint32_t id = htonl(req_id);
+    uint64_t len = htobe64(length);
+    hdr[0] = PROTO_VERSION; hdr[1] = opcode;
+    memcpy(hdr + 2, &f, 2); memcpy(hdr + 4, &id, 4); memcpy(hdr + 8, &len, 8);
+    if (opcode == OP_ERROR) command_failed = 1;
+    return send_all(sock, hdr, FRAME_HDR_SIZE, length ? MSG_MORE : 0);
+}
+
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint32_t req_id, const void *payload, uint64_t length) {
+    if (send_frame_hdr(sock, opcode, flags, req_id, length) < 0) return -1;
+    return length ? send_all(sock, payload, length, 0) : 0;
+}
+
+int send_text(int sock, uint8_t opcode, uint32_t req_id, const char *text) {
+    return send_frame(sock, opcode, 0, req_id, text, strlen(text));
+}
+
+int decode_frame_hdr(const unsigned char *raw, frame_hdr *hdr) {
+    uint16_t f; uint32_t id; uint64_t len;
+    memcpy(&f, raw + 2, 2); memcpy(&id, raw + 4, 4); memcpy(&len, raw + 8, 8);
+    hdr->version = raw[0]; hdr->opcode = raw[1];
+    hdr->flags = ntohs(f); hdr->req_id = ntohl(id); hdr->length = be64toh(len);
+
+    if (hdr->version != PROTO_VERSION) {
+        debug_print("Unsupported protocol version %u\n", hdr->version);
+        return -1;
+    }
+    return 0;
+}
+
+int recv_frame_hdr(int sock, frame_hdr *hdr) {
+    unsigned char raw[FRAME_HDR_SIZE];
+    if (recv_all(sock, raw, FRAME_HDR_SIZE) < 0) return -1;
+    return decode_frame_hdr(raw, hdr);
+}
+
+// Discards `length` payload bytes that the caller has no use for
+int skip_payload(int sock, uint64_t length) {
+    char buffer[BUFFER_SIZE];
+    while (length > 0) {
+        size_t n = length < BUFFER_SIZE ? length : BUFFER_SIZE;
+        if (recv_all(sock, buffer, n) < 0) return -1;
+        length -= n;
+    }
+    return 0;
+}
+
+// Reads one frame and stores its payload as a NUL-terminated string (truncated to fit)
+int recv_msg(int sock, frame_hdr *hdr, char *buf, size_t size) {
+    if (recv_frame_hdr(sock, hdr) < 0) return -1;
+    size_t n = hdr->length < size - 1 ? hdr->length : size - 1;
+    if (recv_all(sock, buf, n) < 0) return -1;
+    buf[n] = '\0';
+    return skip_payload(sock, hdr->length - n);
+}
+
+// Wire compression: a DATA frame flagged FLAG_LZ4 carries a 4-byte raw length followed by
+// one LZ4 block (the standard block format) of at most LZ4_BLOCK raw bytes. Peers learn
+// whether the other side decodes these with a HELLO exchange, and a command frame flagged
+// FLAG_LZ4 tells the receiver it may compress the DATA frames of its reply.
+#define LZ4_BLOCK 65536      // raw bytes per compressed frame; positions must fit in 16 bits
+#define LZ4_HASH_LOG 12
+
+size_t lz4_put_length(unsigned char *op, size_t len) {
+    size_t n = 0;
+    for (; len >= 255; len -= 255) op[n++] = 255;
+    op[n++] = len;
+    return n;
+}
+
+// Compresses n <= LZ4_BLOCK bytes into dst; returns 0 if the result would not fit in cap
+size_t lz4_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    uint16_t table[1 << LZ4_HASH_LOG] = {0};
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    // The format requires the last 5 bytes to be literals and no match to start in the last 12
+    while (n > 12 && ip < end - 12) {
+        uint32_t seq, cand;
+        memcpy(&seq, ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+        const unsigned char *ref = src + table[h];
+        table[h] = ip - src;
+        memcpy(&cand, ref, 4);
+        if (ref >= ip || cand != seq) { ip++; continue; }
+
+        const unsigned char *mend = ip + 4;
+        while (mend < end - 5 && *mend == ref[mend - ip]) mend++;
+        size_t lit = ip - anchor, mlen = mend - ip - 4;
+        if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return 0;
+        unsigned char *token = op++;
+        *token = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+        if (lit >= 15) op += lz4_put_length(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        if (mlen >= 15) op += lz4_put_length(op, mlen - 15);
+        ip = anchor = mend;
+    }
+
+    size_t lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op += lz4_put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    return op + lit - dst;
+}
+
+// Decodes one block into dst; returns the decoded size, or -1 if the block is malformed
+// or decodes to more than cap bytes
+long lz4_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, mlen = token & 15;
+        if (lit == 15) {
+            unsigned b;
+            do { if (ip >= iend) return -1; b = *ip++; lit += b; } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;  // the last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        if (mlen == 15) {
+            unsigned b;
+            do { if (ip >= iend) return -1; b = *ip++; mlen += b; } while (b == 255);
+        }
+        mlen += 4;
+        if ((size_t)(oend - op) < mlen) return -1;
+        for (const unsigned char *ref = op - offset; mlen > 0; mlen--) *op++ = *ref++;  // may overlap
+    }
+    return op - dst;
+}
+
+// Sends one DATA frame of at most LZ4_BLOCK bytes, compressed if *compress is set and the
+// block shrinks by at least 1/8. The first block that does not clears *compress, so data
+// that is already compressed costs a single trial.
+int send_data(int sock, uint32_t req_id, const void *data, size_t n, int *compress) {
+    if (*compress && n > 0) {
+        unsigned char out[4 + LZ4_BLOCK];
+        size_t c = lz4_compress(data, n, out + 4, n - n / 8);
+        if (c > 0) {
+            uint32_t raw = htonl(n);
+            memcpy(out, &raw, 4);
+            return send_frame(sock, OP_DATA, FLAG_LZ4, req_id, out, c + 4);
+        }
+        *compress = 0;
+    }
+    return send_frame(sock, OP_DATA, 0, req_id, data, n);
+}
+
+// Reads the payload of a FLAG_LZ4 DATA frame and decodes it into out (LZ4_BLOCK bytes).
+// Returns the raw length, -1 if the connection failed and -2 if the block was corrupt.
+long recv_lz4(int sock, uint64_t length, void *out) {
+    unsigned char in[4 + LZ4_BLOCK];
+    if (length < 4 || length > sizeof(in)) return skip_payload(sock, length) < 0 ? -1 : -2;
+    if (recv_all(sock, in, length) < 0) return -1;
+    uint32_t raw;
+    memcpy(&raw, in, 4);
+    raw = ntohl(raw);
+    if (raw > LZ4_BLOCK || lz4_decompress(in + 4, length - 4, out, raw) != (long)raw) return -2;
+    return raw;
+}
+
+// Sends the rest of `file` as DATA frames followed by END
+// Sends an open file as a single DATA frame announcing its full size, followed by END.
+// With ZERO_COPY the body goes straight from the page cache to the socket via sendfile();
+// pread()+send() is the fallback when sendfile is disabled or unsupported for this fd.
+// Sends `length` bytes (all if negative) of the file from `offset` as one DATA frame plus END
+int send_file_zero_copy(int sock, uint32_t req_id, int fd, uint64_t offset, int64_t length, int compress) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        send_text(sock, OP_ERROR, req_id, "ERROR: Not a regular file");
+        return -1;
+    }
+    uint64_t size = st.st_size;
+#ifdef USE_DEDUP
+    int64_t logical = manifest_size(fd);
+    if (logical >= 0) size = logical;
+#endif
+    if (offset > size) {
+        send_text(sock, OP_ERROR, req_id, "ERROR: Invalid range");
+        return -1;
+    }
+    uint64_t count = length < 0 || (uint64_t)length > size - offset ? size - offset : (uint64_t)length;
+    char buffer[CHUNK_SIZE];
+    off_t pos = offset, end = offset + count;
+#ifdef USE_DEDUP
+    if (logical >= 0) compress = 0;  // manifests are sent chunk by chunk as stored
+#endif
+    // Compressed frames while the data keeps shrinking, then the rest as one raw frame
+    while (compress && pos < end) {
+        ssize_t n = pread(fd, buffer, end - pos < LZ4_BLOCK ? end - pos : LZ4_BLOCK, pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || send_data(sock, req_id, buffer, n, &compress) < 0) {
+            shutdown(sock, SHUT_RDWR);
+            return -1;
+        }
+        pos += n;
+    }
+    count = end - pos;
+    if (count > 0 && send_frame_hdr(sock, OP_DATA, 0, req_id, count) < 0) return -1;
+#ifdef USE_DEDUP
+    if (logical >= 0) {
+        if (count > 0 && dedup_send_body(sock, fd, pos, count) < 0) {
+            shutdown(sock, SHUT_RDWR);
+            return -1;
+        }
+        return send_frame(sock, OP_END, 0, req_id, NULL, 0);
+    }
+#endif
+#ifdef USE_IO_URING
+    if (count > 0 && uring_ready()) return uring_send_file(sock, req_id, fd, pos, count);
+#endif
+
+    int use_sendfile = ZERO_COPY;
+    while (pos < end) {
+        ssize_t n;
+        if (use_sendfile) {
+            n = sendfile(sock, fd, &pos, end - pos);
+            if (n > 0) __atomic_add_fetch(&metrics.bytes_out, n, __ATOMIC_RELAXED);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) { use_sendfile = 0; continue; }
+        } else {
+            size_t want = end - pos < CHUNK_SIZE ? end - pos : CHUNK_SIZE;
+            n = pread(fd, buffer, want, pos);
+            if (n > 0 && send_all(sock, buffer, n, 0) < 0) n = -1;
+            if (n > 0) pos += n;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            // The file shrank or the socket failed mid-frame; the stream can't be resynchronised
+            debug_print("File transfer aborted at offset %lld\n", (long long)pos);
+            shutdown(sock, SHUT_RDWR);
+            return -1;
+        }
+    }
+    return send_frame(sock, OP_END, 0, req_id, NULL, 0);
+}
+// Tar streaming: archives are generated on the fly from the store, with no temp files.
+// Every entry is a DATA frame holding its 512-byte ustar header followed by one DATA frame
+// holding the body padded to whole blocks (sent with sendfile); the last frame of each entry
+// carries FLAG_ENTRY_END so a relay can tell where entries start and end. Names too long
+// for ustar and sizes of 8 GiB or more are described by a preceding pax 'x' header.
+#define TAR_BLOCK 512
+
+typedef struct {
+    char name[100], mode[8], uid[8], gid[8], size[12], mtime[12], chksum[8], typeflag;
+    char linkname[100], magic[6], version[2], uname[32], gname[32], devmajor[8], devminor[8];
+    char prefix[155], pad[12];
+} tar_header;
+
+// One archived file as the tar cache remembers it
+typedef struct {
+    char *path;             // entry name, relative to the store
+    uint64_t size;          // in dedup mode the content's size, not the manifest's
+    time_t mtime;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+} tar_item;
+
+void tar_octal(char *field, size_t width, unsigned long long value) {
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "%0*llo", (int)width - 1, value);
+    memcpy(field, tmp, width - 1);
+}
+
+void tar_finish_header(tar_header *h) {
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(*h); i++) sum += ((unsigned char *)h)[i];
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+    h->chksum[7] = ' ';
+}
+
+// Appends one "<len> key=value\n" pax record; the length counts its own digits
+size_t pax_record(char *out, size_t room, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;  // ' ', '=', '\n'
+    size_t len = body + 1;
+    while (snprintf(NULL, 0, "%zu", len) + body != len) len++;
+    if (len >= room) return 0;
+    snprintf(out, room, "%zu %s=%s\n", len, key, value);
+    return len;
+}
+
+// Streams one stored file as a tar entry, with the name and metadata the tar cache has for it
+int tar_send_entry(int sock, uint32_t req_id, const char *full_path, const tar_item *item) {
+    int fd = open(full_path, O_RDONLY);
+    if (fd < 0) return 0;  // removed since the list was made; skip it
+    const char *name = item->path;
+    struct stat st = { .st_size = item->size, .st_mtime = item->mtime, .st_mode = item->mode,
+                       .st_uid = item->uid, .st_gid = item->gid };
+#ifdef USE_DEDUP
+    int64_t logical = manifest_size(fd);
+    if (logical >= 0) st.st_size = logical;  // archive the content, not the manifest
+#endif
+
+    tar_header h;
+    memset(&h, 0, sizeof(h));
+    char pax[BUFFER_SIZE + 64];
+    size_t pax_len = 0;
+    size_t name_len = strlen(name);
+    const char *split = NULL;
+    if (name_len > sizeof(h.name)) {
+        // ustar can hold up to 155 + 1 + 100 characters if the name splits at a '/'
+        for (const char *p = strchr(name, '/'); p; p = strchr(p + 1, '/'))
+            if ((size_t)(p - name) <= sizeof(h.prefix) && name_len - (p - name) - 1 <= sizeof(h.name)) { split = p; break; }
+        if (!split) pax_len += pax_record(pax + pax_len, sizeof(pax) - pax_len, "path", name);
+    }
+    if ((unsigned long long)st.st_size >= 077777777777ULL) {
+        char size[32];
+        snprintf(size, sizeof(size), "%lld", (long long)st.st_size);
+        pax_len += pax_record(pax + pax_len, sizeof(pax) - pax_len, "size", size);
+    }
+
+    if (pax_len > 0) {
+        tar_header x;
+        memset(&x, 0, sizeof(x));
+        snprintf(x.name, sizeof(x.name), "PaxHeaders/%.80s", strrchr(name, '/') ? strrchr(name, '/') + 1 : name);
+        tar_octal(x.mode, sizeof(x.mode), 0644);
+        tar_octal(x.uid, sizeof(x.uid), 0);
+        tar_octal(x.gid, sizeof(x.gid), 0);
+        tar_octal(x.size, sizeof(x.size), pax_len);
+        tar_octal(x.mtime, sizeof(x.mtime), st.st_mtime);
+        x.typeflag = 'x';
+        tar_finish_header(&x);
+
+        char block[TAR_BLOCK + sizeof(pax)];
+        size_t padded = (pax_len + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        memcpy(block, &x, TAR_BLOCK);
+        memset(block + TAR_BLOCK, 0, padded);
+        memcpy(block + TAR_BLOCK, pax, pax_len);
+        if (send_frame(sock, OP_DATA, 0, req_id, block, TAR_BLOCK + padded) < 0) { close(fd); return -1; }
+    }
+
+    if (split) {
+        memcpy(h.prefix, name, split - name);
+        memcpy(h.name, split + 1, name_len - (split - name) - 1);
+    } else {
+        memcpy(h.name, name, name_len < sizeof(h.name) ? name_len : sizeof(h.name));
+    }
+    tar_octal(h.mode, sizeof(h.mode), st.st_mode & 07777);
+    tar_octal(h.uid, sizeof(h.uid), st.st_uid);
+    tar_octal(h.gid, sizeof(h.gid), st.st_gid);
+    tar_octal(h.size, sizeof(h.size), (unsigned long long)st.st_size < 077777777777ULL ? st.st_size : 0);
+    tar_octal(h.mtime, sizeof(h.mtime), st.st_mtime);
+    h.typeflag = '0';
+    tar_finish_header(&h);
+
+    if (st.st_size == 0) {
+        close(fd);
+        return send_frame(sock, OP_DATA, FLAG_ENTRY_END, req_id, &h, TAR_BLOCK);
+    }
+    if (send_frame(sock, OP_DATA, 0, req_id, &h, TAR_BLOCK) < 0) { close(fd); return -1; }
+
+    // Body: announced as size rounded up to a block; a file that shrinks meanwhile is
+    // zero-filled (as tar(1) does) so the archive stays well-formed
+    uint64_t padded = ((uint64_t)st.st_size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    if (send_frame_hdr(sock, OP_DATA, FLAG_ENTRY_END, req_id, padded) < 0) { close(fd); return -1; }
+    off_t offset = 0;
+#ifdef USE_DEDUP
+    if (logical >= 0) {
+        if (dedup_send_body(sock, fd, 0, st.st_size) < 0) { close(fd); shutdown(sock, SHUT_RDWR); return -1; }
+        offset = st.st_size;
+    }
+#endif
+    while (offset < st.st_size) {
+        ssize_t n = sendfile(sock, fd, &offset, st.st_size - offset);
+        if (n > 0) __atomic_add_fetch(&metrics.bytes_out, n, __ATOMIC_RELAXED);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            char buffer[CHUNK_SIZE];
+            n = pread(fd, buffer, st.st_size - offset < CHUNK_SIZE ? st.st_size - offset : CHUNK_SIZE, offset);
+            if (n > 0 && send_all(sock, buffer, n, 0) < 0) { close(fd); return -1; }
+            if (n > 0) offset += n;
+        }
+        if (n < 0 && errno != EINVAL && errno != ENOSYS) { close(fd); return -1; }
+        if (n == 0) break;
+    }
+    close(fd);
+
+    char zeros[TAR_BLOCK] = {0};
+    for (uint64_t left = padded - offset; left > 0; ) {
+        size_t n = left < TAR_BLOCK ? left : TAR_BLOCK;
+        if (send_all(sock, zeros, n, 0) < 0) return -1;
+        left -= n;
+    }
+    return 0;
+}
+
+int has_extension(const char *name, const char *ext) {
+    size_t n = strlen(name), e = strlen(ext);
+    return n > e && strcmp(name + n - e, ext) == 0;
+}
+// Namespace index: every stored file (size, mtime) and every directory's sorted file names,
+// kept in one hash table keyed by path relative to base_dir, so listings and existence
+// checks are answered from memory. It is persisted as a snapshot (<base_dir>.index) plus an
+// append-only change log (<base_dir>.index.log); startup loads the snapshot and replays the log,
+// and only a missing snapshot forces a walk of the tree.
+#define INDEX_BUCKETS 4096       // initial hash table size, doubled as the index grows
+#define INDEX_LOG_COMPACT 10000  // log records before they are folded into a new snapshot
+
+typedef struct index_node {
+    char *path;                 // "" is the store root
+    int is_dir;
+    uint64_t size;
+    time_t mtime;
+    const char **names;         // directories: sorted file names, pointing into the file nodes
+    size_t count, capacity;
+    struct index_node *next;    // hash chain
+} index_node;
+
+index_node **index_table;
+size_t index_buckets, index_nodes;
+pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+char index_path[300], index_log_path[300];
+FILE *index_log;
+size_t index_log_records;
+
+// Canonical form of a client-supplied path: no empty, "." or ".." components and no leading
+// or trailing '/'. Returns -1 if the path would leave the store or does not fit.
+int index_normalize(const char *in, char *out, size_t size) {
+    size_t len = 0;
+    out[0] = '\0';
+    while (*in) {
+        while (*in == '/') in++;
+        const char *end = strchr(in, '/');
+        if (!end) end = in + strlen(in);
+        size_t n = end - in;
+        if (n == 2 && in[0] == '.' && in[1] == '.') {
+            if (len == 0) return -1;
+            while (len > 0 && out[len - 1] != '/') len--;
+            if (len > 0) len--;
+            out[len] = '\0';
+        } else if (n > 0 && !(n == 1 && in[0] == '.')) {
+            if (len + (len > 0) + n >= size) return -1;
+            if (len > 0) out[len++] = '/';
+            memcpy(out + len, in, n);
+            out[len += n] = '\0';
+        }
+        in = end;
+    }
+    return 0;
+}
+
+uint64_t index_hash(const char *s) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    while (*s) h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+index_node *index_find(const char *path) {
+    if (!index_table) return NULL;
+    for (index_node *n = index_table[index_hash(path) & (index_buckets - 1)]; n; n = n->next)
+        if (strcmp(n->path, path) == 0) return n;
+    return NULL;
+}
+
+index_node *index_insert(const char *path, int is_dir) {
+    if (index_nodes >= index_buckets) {
+        size_t buckets = index_buckets ? index_buckets * 2 : INDEX_BUCKETS;
+        index_node **table = calloc(buckets, sizeof(*table));
+        if (!table) { perror("calloc failed"); exit(EXIT_FAILURE); }
+        for (size_t i = 0; i < index_buckets; i++) {
+            for (index_node *n = index_table[i], *next; n; n = next) {
+                next = n->next;
+                size_t b = index_hash(n->path) & (buckets - 1);
+                n->next = table[b];
+                table[b] = n;
+            }
+        }
+        free(index_table);
+        index_table = table;
+        index_buckets = buckets;
+    }
+    index_node *node = calloc(1, sizeof(*node));
+    if (!node || !(node->path = strdup(path))) { perror("malloc failed"); exit(EXIT_FAILURE); }
+    node->is_dir = is_dir;
+    size_t b = index_hash(path) & (index_buckets - 1);
+    node->next = index_table[b];
+    index_table[b] = node;
+    index_nodes++;
+    return node;
+}
+
+// Directory node for `path`, created along with its ancestors if missing
+index_node *index_dir(const char *path) {
+    index_node *dir = index_find(path);
+    if (dir) return dir->is_dir ? dir : NULL;
+    if (*path) {
+        char parent[BUFFER_SIZE];
+        const char *slash = strrchr(path, '/');
+        snprintf(parent, sizeof(parent), "%.*s", slash ? (int)(slash - path) : 0, path);
+        if (!index_dir(parent)) return NULL;
+    }
+    return index_insert(path, 1);
+}
+
+// Parent directory of a file node and the slot of its name there (or where it would go)
+index_node *index_parent(index_node *file, size_t *slot, int *found) {
+    char dir_path[BUFFER_SIZE];
+    const char *slash = strrchr(file->path, '/');
+    const char *name = slash ? slash + 1 : file->path;
+    snprintf(dir_path, sizeof(dir_path), "%.*s", slash ? (int)(slash - file->path) : 0, file->path);
+    index_node *dir = index_dir(dir_path);
+    if (!dir) return NULL;
+
+    size_t lo = 0, hi = dir->count;
+    *found = 0;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(dir->names[mid], name);
+        if (c == 0) { *found = 1; lo = mid; break; }
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    *slot = lo;
+    return dir;
+}
+
+void index_apply_add(const char *path, uint64_t size, time_t mtime) {
+    index_node *node = index_find(path);
+    if (node && node->is_dir) return;
+    if (!node) {
+        node = index_insert(path, 0);
+        size_t slot;
+        int found;
+        index_node *dir = index_parent(node, &slot, &found);
+        if (dir && !found) {
+            if (dir->count == dir->capacity) {
+                dir->capacity = dir->capacity ? dir->capacity * 2 : 16;
+                dir->names = realloc(dir->names, dir->capacity * sizeof(char *));
+                if (!dir->names) { perror("realloc failed"); exit(EXIT_FAILURE); }
+            }
+            memmove(dir->names + slot + 1, dir->names + slot, (dir->count - slot) * sizeof(char *));
+            const char *slash = strrchr(node->path, '/');
+            dir->names[slot] = slash ? slash + 1 : node->path;
+            dir->count++;
+        }
+    }
+    node->size = size;
+    node->mtime = mtime;
+}
+
+void index_apply_remove(const char *path) {
+    index_node *node = index_find(path);
+    if (!node || node->is_dir) return;
+    size_t slot;
+    int found;
+    index_node *dir = index_parent(node, &slot, &found);
+    if (dir && found) {
+        memmove(dir->names + slot, dir->names + slot + 1, (dir->count - slot - 1) * sizeof(char *));
+        dir->count--;
+    }
+    index_node **link = &index_table[index_hash(path) & (index_buckets - 1)];
+    while (*link != node) link = &(*link)->next;
+    *link = node->next;
+    index_nodes--;
+    free(node->path);
+    free(node);
+}
+
+// Rewrites the snapshot from memory and starts an empty log (caller holds the write lock)
+void index_save(void) {
+    char tmp_path[sizeof(index_path) + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+    FILE *snap = fopen(tmp_path, "w");
+    if (!snap) { debug_print("Index snapshot failed: %s\n", strerror(errno)); return; }
+    for (size_t i = 0; i < index_buckets; i++) {
+        for (index_node *n = index_table[i]; n; n = n->next) {
+            if (n->is_dir) fprintf(snap, "d %s\n", n->path);
+            else fprintf(snap, "+ %llu %lld %s\n", (unsigned long long)n->size, (long long)n->mtime, n->path);
+        }
+    }
+    int failed = fflush(snap) != 0 || fsync(fileno(snap)) != 0;
+    if (fclose(snap) != 0 || failed || rename(tmp_path, index_path) != 0) {
+        debug_print("Index snapshot failed: %s\n", strerror(errno));
+        remove(tmp_path);
+        return;
+    }
+
+    // Everything logged so far is in the snapshot; replaying it again would be harmless
+    if (index_log) fclose(index_log);
+    index_log = fopen(index_log_path, "w");
+    index_log_records = 0;
+}
+
+// Applies snapshot or log records; a torn last line from a crash is ignored
+int index_replay(const char *file) {
+    FILE *in = fopen(file, "r");
+    if (!in) return -1;
+    char line[BUFFER_SIZE + 64];
+    while (fgets(line, sizeof(line), in)) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') break;
+        line[len - 1] = '\0';
+        unsigned long long size;
+        long long mtime;
+        int at = 0;
+        if (sscanf(line, "+ %llu %lld%n", &size, &mtime, &at) == 2 && line[at] == ' ')
+            index_apply_add(line + at + 1, size, mtime);
+        else if (strncmp(line, "- ", 2) == 0) index_apply_remove(line + 2);
+        else if (strncmp(line, "d ", 2) == 0) index_dir(line + 2);
+    }
+    fclose(in);
+    return 0;
+}
+
+// Walks the store below rel, removing the temp files of uploads a crash cut short (see
+// stage_path()) and, with `add`, indexing every other regular file
+void index_walk(const char *rel, int add) {
+    char dir_path[BUFFER_SIZE];
+    if (snprintf(dir_path, sizeof(dir_path), "%s%s%s", base_dir, *rel ? "/" : "", rel) >= (int)sizeof(dir_path)) return;
+    DIR *dir = opendir(dir_path);
+    if (!dir) return;
+    if (add) index_dir(rel);
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char path[BUFFER_SIZE], full_path[BUFFER_SIZE];
+        if (snprintf(path, sizeof(path), "%s%s%s", rel, *rel ? "/" : "", entry->d_name) >= (int)sizeof(path) ||
+            snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, path) >= (int)sizeof(full_path)) {
+            debug_print("Skipping %s/%s: path too long\n", dir_path, entry->d_name);
+            continue;
+        }
+        struct stat st;
+        // Sweeping alone only needs the type, which readdir() usually has already
+        if (add || entry->d_type == DT_UNKNOWN) {
+            if (lstat(full_path, &st) < 0) continue;
+        } else {
+            st.st_mode = DTTOIF(entry->d_type);
+        }
+        if (S_ISDIR(st.st_mode)) {
+            index_walk(path, add);
+        } else if (!S_ISREG(st.st_mode)) {
+            continue;
+        } else if (has_extension(entry->d_name, ".tmp")) {
+            debug_print("Removing stale upload %s\n", full_path);
+            unlink(full_path);
+        } else if (add) {
+            index_apply_add(path, st.st_size, st.st_mtime);
+        }
+    }
+    closedir(dir);
+}
+
+void index_load(void) {
+    snprintf(index_path, sizeof(index_path), "%s.index", base_dir);
+    snprintf(index_log_path, sizeof(index_log_path), "%s.index.log", base_dir);
+    pthread_rwlock_wrlock(&index_lock);
+    index_dir("");
+    int scan = index_replay(index_path) != 0;
+    if (scan) debug_print("No index snapshot, scanning %s\n", base_dir);
+    else index_replay(index_log_path);
+    index_walk("", scan);
+    index_save();
+    pthread_rwlock_unlock(&index_lock);
+    debug_print("Index loaded: %zu entries\n", index_nodes);
+}
+
+void index_logged(void) {
+    if (index_log) fflush(index_log);
+    if (++index_log_records >= INDEX_LOG_COMPACT) index_save();
+}
+
+void index_add(const char *path, uint64_t size, time_t mtime) {
+    pthread_rwlock_wrlock(&index_lock);
+    index_apply_add(path, size, mtime);
+    if (index_log) fprintf(index_log, "+ %llu %lld %s\n", (unsigned long long)size, (long long)mtime, path);
+    index_logged();
+    pthread_rwlock_unlock(&index_lock);
+    tar_cache_note(path);
+}
+
+void index_remove(const char *path) {
+    pthread_rwlock_wrlock(&index_lock);
+    index_apply_remove(path);
+    if (index_log) fprintf(index_log, "- %s\n", path);
+    index_logged();
+    pthread_rwlock_unlock(&index_lock);
+    tar_cache_note(path);
+}
+
+int index_lookup(const char *path, uint64_t *size, time_t *mtime) {
+    pthread_rwlock_rdlock(&index_lock);
+    index_node *node = index_find(path);
+    int found = node && !node->is_dir;
+    if (found && size) *size = node->size;
+    if (found && mtime) *mtime = node->mtime;
+    pthread_rwlock_unlock(&index_lock);
+    return found;
+}
+
+// Files directly in directory `path` (only names ending in `ext`, if given), sorted and
+// newline-terminated in one malloc'd buffer, or NULL if there is no such directory
+char *index_list(const char *path, const char *ext, size_t *length) {
+    pthread_rwlock_rdlock(&index_lock);
+    index_node *dir = index_find(path);
+    if (!dir || !dir->is_dir) { pthread_rwlock_unlock(&index_lock); return NULL; }
+
+    size_t total = 0;
+    for (size_t i = 0; i < dir->count; i++)
+        if (!ext || has_extension(dir->names[i], ext)) total += strlen(dir->names[i]) + 1;
+    char *list = malloc(total + 1), *p = list;
+    if (!list) { perror("malloc failed"); exit(EXIT_FAILURE); }
+    for (size_t i = 0; i < dir->count; i++) {
+        if (ext && !has_extension(dir->names[i], ext)) continue;
+        size_t n = strlen(dir->names[i]);
+        memcpy(p, dir->names[i], n);
+        p[n] = '\n';
+        p += n + 1;
+    }
+    *p = '\0';
+    pthread_rwlock_unlock(&index_lock);
+    *length = total;
+    return list;
+}
+
+// Every stored file as "<size> <mtime> <path>" lines in one malloc'd buffer (in no particular order)
+char *index_files(size_t *length) {
+    char *list = NULL;
+    FILE *out = open_memstream(&list, length);
+    if (!out) { perror("open_memstream failed"); exit(EXIT_FAILURE); }
+    pthread_rwlock_rdlock(&index_lock);
+    for (size_t i = 0; i < index_buckets; i++)
+        for (index_node *n = index_table[i]; n; n = n->next)
+            if (!n->is_dir) fprintf(out, "%llu %lld %s\n", (unsigned long long)n->size, (long long)n->mtime, n->path);
+    pthread_rwlock_unlock(&index_lock);
+    fclose(out);
+    return list;
+}
+#ifdef USE_DEDUP
+// Dedup storage (build with -DUSE_DEDUP): incoming files are cut into content-defined chunks
+// (gear rolling hash; 16 KB min, ~80 KB average, 256 KB max) so identical data lines up
+// across files regardless of offset. Each chunk is stored once, named by its SHA-256, under
+// <base_dir>.chunks, and the stored file becomes a short text manifest of its chunks.
+// Reference counts are kept in memory and rebuilt from the manifests at startup, which also
+// sweeps chunks that a crash left unreferenced.
+#define CDC_MIN (16 * 1024)
+#define CDC_MAX (256 * 1024)
+#define CDC_MASK 0xffff000000000000ULL  // 16 bits => a cut every ~64 KB past CDC_MIN
+#define CHUNK_BUCKETS 65536              // initial chunk table size, doubled as it grows
+#define MANIFEST_MAGIC "DFSMANIFEST 1 "
+
+enum {CHUNK_READY, CHUNK_WRITING, CHUNK_FAILED};
+
+typedef struct {
+    unsigned char hash[32];
+    uint32_t len;
+} chunk_id;
+
+typedef struct {
+    uint64_t size;
+    size_t count, capacity;
+    chunk_id *chunks;
+} manifest;
+
+typedef struct chunk_ref {
+    unsigned char hash[32];
+    int refs;
+    int state;
+    struct chunk_ref *next;
+} chunk_ref;
+
+chunk_ref **chunk_table;
+size_t chunk_buckets, chunk_count;
+pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t chunk_written = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;  // serialises replacing/removing manifests
+char chunk_dir[300];
+uint64_t gear[256];
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_block(uint32_t h[8], const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+void sha256(const void *data, size_t len, unsigned char out[32]) {
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    const unsigned char *p = data;
+    size_t left = len;
+    for (; left >= 64; p += 64, left -= 64) sha256_block(h, p);
+
+    unsigned char tail[128] = {0};
+    memcpy(tail, p, left);
+    tail[left] = 0x80;
+    size_t tail_len = left < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) tail[tail_len - 1 - i] = bits >> (8 * i);
+    sha256_block(h, tail);
+    if (tail_len == 128) sha256_block(h, tail + 64);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = h[i] >> 24; out[4 * i + 1] = h[i] >> 16; out[4 * i + 2] = h[i] >> 8; out[4 * i + 3] = h[i];
+    }
+}
+
+// Length of the next chunk at the start of p[0..n): the first gear-hash boundary past
+// CDC_MIN, or CDC_MAX / n if none (callers only pass a short buffer at end of stream)
+size_t cdc_cut(const unsigned char *p, size_t n) {
+    if (n <= CDC_MIN) return n;
+    size_t end = n < CDC_MAX ? n : CDC_MAX;
+    uint64_t h = 0;
+    for (size_t i = CDC_MIN; i < end; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CDC_MASK)) return i + 1;
+    }
+    return end;
+}
+
+void chunk_path(const unsigned char *hash, char *out, size_t size) {
+    char hex[65];
+    for (int i = 0; i < 32; i++) sprintf(hex + 2 * i, "%02x", hash[i]);
+    snprintf(out, size, "%s/%.2s/%s", chunk_dir, hex, hex);
+}
+
+size_t chunk_bucket(const unsigned char *hash, size_t buckets) {
+    uint64_t h;
+    memcpy(&h, hash, sizeof(h));
+    return h & (buckets - 1);
+}
+
+chunk_ref *chunk_find(const unsigned char *hash) {
+    if (!chunk_table) return NULL;
+    for (chunk_ref *c = chunk_table[chunk_bucket(hash, chunk_buckets)]; c; c = c->next)
+        if (memcmp(c->hash, hash, 32) == 0) return c;
+    return NULL;
+}
+
+// Takes a reference on a chunk, adding it in `state` if it is new (caller holds chunk_lock)
+chunk_ref *chunk_acquire(const unsigned char *hash, int state, int *created) {
+    chunk_ref *c = chunk_find(hash);
+    *created = c == NULL;
+    if (!c) {
+        if (chunk_count >= chunk_buckets) {
+            size_t buckets = chunk_buckets ? chunk_buckets * 2 : CHUNK_BUCKETS;
+            chunk_ref **table = calloc(buckets, sizeof(*table));
+            if (!table) { perror("calloc failed"); exit(EXIT_FAILURE); }
+            for (size_t i = 0; i < chunk_buckets; i++) {
+                for (chunk_ref *n = chunk_table[i], *next; n; n = next) {
+                    next = n->next;
+                    size_t b = chunk_bucket(n->hash, buckets);
+                    n->next = table[b];
+                    table[b] = n;
+                }
+            }
+            free(chunk_table);
+            chunk_table = table;
+            chunk_buckets = buckets;
+        }
+        c = calloc(1, sizeof(*c));
+        if (!c) { perror("calloc failed"); exit(EXIT_FAILURE); }
+        memcpy(c->hash, hash, 32);
+        c->state = state;
+        size_t b = chunk_bucket(hash, chunk_buckets);
+        c->next = chunk_table[b];
+        chunk_table[b] = c;
+        chunk_count++;
+    }
+    c->refs++;
+    return c;
+}
+
+// Drops a reference; the last one deletes the chunk
+void chunk_release(const unsigned char *hash) {
+    pthread_mutex_lock(&chunk_lock);
+    chunk_ref *c = chunk_find(hash);
+    if (c && --c->refs == 0) {
+        char path[sizeof(chunk_dir) + 80];
+        chunk_path(hash, path, sizeof(path));
+        unlink(path);
+        chunk_ref **link = &chunk_table[chunk_bucket(hash, chunk_buckets)];
+        while (*link != c) link = &(*link)->next;
+        *link = c->next;
+        chunk_count--;
+        free(c);
+    }
+    pthread_mutex_unlock(&chunk_lock);
+}
+
+// Stores one chunk (or just references it if the store already has it) and records it in m
+int chunk_put(manifest *m, const unsigned char *data, size_t len) {
+    if (m->count == m->capacity) {
+        m->capacity = m->capacity ? m->capacity * 2 : 64;
+        m->chunks = realloc(m->chunks, m->capacity * sizeof(chunk_id));
+        if (!m->chunks) { perror("realloc failed"); exit(EXIT_FAILURE); }
+    }
+    chunk_id *id = &m->chunks[m->count];
+    sha256(data, len, id->hash);
+    id->len = len;
+
+    int created;
+    pthread_mutex_lock(&chunk_lock);
+    chunk_ref *c = chunk_acquire(id->hash, CHUNK_WRITING, &created);
+    pthread_mutex_unlock(&chunk_lock);
+    m->count++;
+    m->size += len;
+    if (!created) return 0;
+
+    // Only the thread that added the chunk writes it; others wait for it in chunks_ready()
+    char path[sizeof(chunk_dir) + 80], tmp_path[sizeof(path) + 4];
+    chunk_path(id->hash, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0;
+    for (size_t done = 0; ok && done < len; ) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) ok = 0;
+        else done += n;
+    }
+    if (fd >= 0 && close(fd) != 0) ok = 0;
+    if (ok && rename(tmp_path, path) != 0) ok = 0;
+    if (!ok) {
+        debug_print("Chunk write failed: %s\n", strerror(errno));
+        unlink(tmp_path);
+    }
+
+    pthread_mutex_lock(&chunk_lock);
+    c->state = ok ? CHUNK_READY : CHUNK_FAILED;
+    pthread_cond_broadcast(&chunk_written);
+    pthread_mutex_unlock(&chunk_lock);
+    return ok ? 0 : -1;
+}
+
+// Waits until every chunk of m written by another thread is on disk
+int chunks_ready(const manifest *m) {
+    int rc = 0;
+    pthread_mutex_lock(&chunk_lock);
+    for (size_t i = 0; i < m->count && rc == 0; i++) {
+        chunk_ref *c;
+        while ((c = chunk_find(m->chunks[i].hash)) && c->state == CHUNK_WRITING)
+            pthread_cond_wait(&chunk_written, &chunk_lock);
+        if (!c || c->state == CHUNK_FAILED) rc = -1;
+    }
+    pthread_mutex_unlock(&chunk_lock);
+    return rc;
+}
+
+void manifest_release(const manifest *m) {
+    for (size_t i = 0; i < m->count; i++) chunk_release(m->chunks[i].hash);
+}
+
+void manifest_free(manifest *m) {
+    free(m->chunks);
+    memset(m, 0, sizeof(*m));
+}
+
+// Parses fd as a manifest; returns -1 (m left empty) if it is a plain file
+int manifest_read(int fd, manifest *m) {
+    memset(m, 0, sizeof(*m));
+    char magic[sizeof(MANIFEST_MAGIC) - 1];
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, MANIFEST_MAGIC, sizeof(magic)) != 0)
+        return -1;
+
+    FILE *in = fdopen(dup(fd), "r");
+    if (!in) return -1;
+    rewind(in);  // the dup shares fd's file offset
+    unsigned long long size;
+    char hex[65];
+    unsigned len;
+    int ok = fscanf(in, MANIFEST_MAGIC "%llu\n", &size) == 1;
+    while (ok && fscanf(in, "%64s %u\n", hex, &len) == 2) {
+        if (m->count == m->capacity) {
+            m->capacity = m->capacity ? m->capacity * 2 : 64;
+            m->chunks = realloc(m->chunks, m->capacity * sizeof(chunk_id));
+            if (!m->chunks) { perror("realloc failed"); exit(EXIT_FAILURE); }
+        }
+        chunk_id *id = &m->chunks[m->count++];
+        for (int i = 0; i < 32; i++) ok = ok && sscanf(hex + 2 * i, "%2hhx", &id->hash[i]) == 1;
+        id->len = len;
+        m->size += len;
+    }
+    fclose(in);
+    if (!ok || m->size != size) { manifest_free(m); return -1; }
+    return 0;
+}
+
+// Writes m to path through a temp file, so readers see the old or the new manifest
+int manifest_write(const char *path, const manifest *m) {
+    char tmp_path[BUFFER_SIZE + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) return -1;
+    fprintf(out, MANIFEST_MAGIC "%llu\n", (unsigned long long)m->size);
+    for (size_t i = 0; i < m->count; i++) {
+        for (int j = 0; j < 32; j++) fprintf(out, "%02x", m->chunks[i].hash[j]);
+        fprintf(out, " %u\n", m->chunks[i].len);
+    }
+    if (fclose(out) != 0 || rename(tmp_path, path) != 0) { remove(tmp_path); return -1; }
+    return 0;
+}
+
+// Dedup counterpart of recv_file_stream(): DATA frames are buffered up to CDC_MAX and cut
+// into chunks as they arrive. Same return codes; on failure m's chunks are already released.
+int dedup_recv_file_stream(int sock, manifest *m, char *err, size_t err_size) {
+    unsigned char *buffer = malloc(CDC_MAX);
+    if (!buffer) { perror("malloc failed"); exit(EXIT_FAILURE); }
+    size_t fill = 0;
+    int rc = -1, write_failed = 0;
+    frame_hdr hdr;
+    while (recv_frame_hdr(sock, &hdr) == 0) {
+        if (hdr.opcode == OP_END) {
+            while (fill > 0 && !write_failed) {
+                size_t cut = cdc_cut(buffer, fill);
+                if (chunk_put(m, buffer, cut) < 0) write_failed = 1;
+                memmove(buffer, buffer + cut, fill - cut);
+                fill -= cut;
+            }
+            rc = write_failed ? -3 : 0;
+            break;
+        }
+        if (hdr.opcode == OP_ERROR) {
+            size_t n = (err && hdr.length < err_size - 1) ? hdr.length : (err ? err_size - 1 : 0);
+            if (recv_all(sock, err, n) < 0) break;
+            if (err) err[n] = '\0';
+            rc = skip_payload(sock, hdr.length - n) < 0 ? -1 : -2;
+            break;
+        }
+        if (hdr.opcode != OP_DATA) break;
+        if (hdr.flags & FLAG_LZ4) {
+            unsigned char block[LZ4_BLOCK];
+            long n = recv_lz4(sock, hdr.length, block);
+            if (n == -1) break;
+            if (n == -2) write_failed = 1;
+            for (long used = 0; used < n; ) {
+                size_t k = (size_t)(n - used) < CDC_MAX - fill ? (size_t)(n - used) : CDC_MAX - fill;
+                memcpy(buffer + fill, block + used, k);
+                fill += k;
+                used += k;
+                if (fill == CDC_MAX) {
+                    size_t cut = cdc_cut(buffer, fill);
+                    if (!write_failed && chunk_put(m, buffer, cut) < 0) write_failed = 1;
+                    memmove(buffer, buffer + cut, fill - cut);
+                    fill -= cut;
+                }
+            }
+            continue;
+        }
+
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t n = remaining < CDC_MAX - fill ? remaining : CDC_MAX - fill;
+            if (recv_all(sock, buffer + fill, n) < 0) goto done;
+            fill += n;
+            remaining -= n;
+            if (fill == CDC_MAX) {
+                size_t cut = cdc_cut(buffer, fill);
+                if (!write_failed && chunk_put(m, buffer, cut) < 0) write_failed = 1;
+                memmove(buffer, buffer + cut, fill - cut);
+                fill -= cut;
+            }
+        }
+    }
+done:
+    free(buffer);
+    if (rc != 0) { manifest_release(m); manifest_free(m); }
+    return rc;
+}
+
+// Makes m the content of full_path once its chunks are on disk. Replacing a file releases
+// the chunks of the manifest it overwrites; on failure m's own chunks are released instead.
+int dedup_install(const char *full_path, manifest *m) {
+    manifest old;
+    int rc = chunks_ready(m) < 0 ? -3 : 0;
+    pthread_mutex_lock(&manifest_lock);
+    int fd = open(full_path, O_RDONLY);
+    manifest_read(fd, &old);
+    if (fd >= 0) close(fd);
+    if (rc == 0 && manifest_write(full_path, m) < 0) rc = -3;
+    manifest_release(rc == 0 ? &old : m);
+    pthread_mutex_unlock(&manifest_lock);
+    manifest_free(&old);
+    return rc;
+}
+
+// STORE in dedup mode; returns recv_file_stream() codes and the stored size
+int dedup_store(int sock, const char *full_path, char *err, size_t err_size, uint64_t *size) {
+    manifest m = {0};
+    int rc = dedup_recv_file_stream(sock, &m, err, err_size);
+    if (rc != 0) return rc;
+    rc = dedup_install(full_path, &m);
+    *size = m.size;
+    manifest_free(&m);
+    return rc;
+}
+
+// Stores the plain file src_path (an assembled multi-part upload) as full_path, cutting it
+// into the same chunks a streamed STORE of that content would produce
+int dedup_store_file(const char *src_path, const char *full_path, uint64_t *size) {
+    int fd = open(src_path, O_RDONLY);
+    if (fd < 0) return -3;
+    unsigned char *buffer = malloc(CDC_MAX);
+    if (!buffer) { perror("malloc failed"); exit(EXIT_FAILURE); }
+    manifest m = {0};
+    size_t fill = 0;
+    int rc = 0;
+    while (rc == 0) {
+        ssize_t n = read(fd, buffer + fill, CDC_MAX - fill);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { rc = -3; break; }
+        fill += n;
+        if (n > 0 && fill < CDC_MAX) continue;
+        if (fill == 0) break;
+        size_t cut = cdc_cut(buffer, fill);
+        if (chunk_put(&m, buffer, cut) < 0) rc = -3;
+        memmove(buffer, buffer + cut, fill - cut);
+        fill -= cut;
+    }
+    free(buffer);
+    close(fd);
+    if (rc == 0) rc = dedup_install(full_path, &m);
+    else manifest_release(&m);
+    *size = m.size;
+    manifest_free(&m);
+    return rc;
+}
+
+// Sends `length` bytes of m's content from `offset`, as (part of) the body of a DATA frame
+int dedup_send_chunks(int sock, const manifest *m, uint64_t offset, uint64_t length) {
+    for (size_t i = 0; i < m->count && length > 0; i++) {
+        if (offset >= m->chunks[i].len) { offset -= m->chunks[i].len; continue; }
+        char path[sizeof(chunk_dir) + 80];
+        chunk_path(m->chunks[i].hash, path, sizeof(path));
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) { debug_print("Missing chunk %s\n", path); return -1; }
+        off_t pos = offset, end = m->chunks[i].len - offset < length ? m->chunks[i].len : offset + length;
+        while (pos < end) {
+            ssize_t n = sendfile(sock, fd, &pos, end - pos);
+            if (n > 0) __atomic_add_fetch(&metrics.bytes_out, n, __ATOMIC_RELAXED);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) { close(fd); return -1; }
+        }
+        close(fd);
+        length -= end - offset;
+        offset = 0;
+    }
+    return length == 0 ? 0 : -1;
+}
+
+// Logical size of the file behind fd if it is a manifest, -1 if it is a plain file
+int64_t manifest_size(int fd) {
+    manifest m;
+    if (manifest_read(fd, &m) < 0) return -1;
+    int64_t size = m.size;
+    manifest_free(&m);
+    return size;
+}
+
+// Sends a range of the content of the manifest behind fd as the body of a DATA frame
+int dedup_send_body(int sock, int fd, uint64_t offset, uint64_t length) {
+    manifest m;
+    if (manifest_read(fd, &m) < 0) return -1;
+    int rc = dedup_send_chunks(sock, &m, offset, length);
+    manifest_free(&m);
+    return rc;
+}
+
+// Removes a stored file, releasing its chunks if it is a manifest
+int dedup_remove(const char *full_path) {
+    manifest m;
+    pthread_mutex_lock(&manifest_lock);
+    int fd = open(full_path, O_RDONLY);
+    manifest_read(fd, &m);
+    if (fd >= 0) close(fd);
+    int rc = remove(full_path);
+    if (rc == 0) manifest_release(&m);
+    pthread_mutex_unlock(&manifest_lock);
+    manifest_free(&m);
+    return rc;
+}
+
+// Rebuilds reference counts from the manifests in the index, corrects the sizes of
+// manifests found by a directory walk, and sweeps unreferenced or half-written chunks
+void dedup_load(void) {
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;  // fixed: chunk boundaries must never change
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    snprintf(chunk_dir, sizeof(chunk_dir), "%s.chunks", base_dir);
+    mkdir(chunk_dir, 0755);
+    for (int i = 0; i < 256; i++) {
+        char sub[sizeof(chunk_dir) + 4];
+        snprintf(sub, sizeof(sub), "%s/%02x", chunk_dir, i);
+        mkdir(sub, 0755);
+    }
+
+    size_t manifests = 0;
+    pthread_rwlock_wrlock(&index_lock);
+    for (size_t b = 0; b < index_buckets; b++) {
+        for (index_node *n = index_table[b]; n; n = n->next) {
+            if (n->is_dir) continue;
+            char full_path[BUFFER_SIZE];
+            snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, n->path);
+            manifest m;
+            int fd = open(full_path, O_RDONLY);
+            if (manifest_read(fd, &m) == 0) {
+                int created;
+                for (size_t i = 0; i < m.count; i++) chunk_acquire(m.chunks[i].hash, CHUNK_READY, &created);
+                n->size = m.size;
+                manifests++;
+            }
+            if (fd >= 0) close(fd);
+            manifest_free(&m);
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    size_t swept = 0;
+    for (int i = 0; i < 256; i++) {
+        char sub[sizeof(chunk_dir) + 4];
+        snprintf(sub, sizeof(sub), "%s/%02x", chunk_dir, i);
+        DIR *dir = opendir(sub);
+        if (!dir) continue;
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] == '.') continue;
+            unsigned char hash[32];
+            int ok = strlen(entry->d_name) == 64;
+            for (int j = 0; j < 32 && ok; j++) ok = sscanf(entry->d_name + 2 * j, "%2hhx", &hash[j]) == 1;
+            if (ok && chunk_find(hash)) continue;
+            char path[sizeof(sub) + 256];
+            snprintf(path, sizeof(path), "%s/%s", sub, entry->d_name);
+            if (unlink(path) == 0) swept++;
+        }
+        closedir(dir);
+    }
+    debug_print("Dedup store: %zu manifests, %zu chunks, %zu swept\n", manifests, chunk_count, swept);
+}
+#endif
+
+
+// Tar cache: a repeated SENDTAR should not have to find and stat every file again. The
+// entries of the last archive are kept sorted by path in a refcounted list stamped with the
+// store's tar generation, which every index_add()/index_remove() of a TAR_TYPE file bumps,
+// noting the path. A request at the current generation is served from the list as is (bodies
+// still go out with sendfile()); otherwise the noted paths are merged into a new list, and
+// only when more than TAR_CACHE_CHANGES piled up is it rebuilt from the whole index.
+#define TAR_CACHE_CHANGES 1024
+
+typedef struct {
+    tar_item *items;
+    size_t count;
+    int refs;               // the cache's own reference plus one per archive being sent
+} tar_list;
+
+struct {
+    unsigned long long generation, built;   // built: the generation `list` describes
+    tar_list *list;
+    char *changed[TAR_CACHE_CHANGES];        // paths changed since the list was taken
+    size_t changes;
+    int overflow;
+} tar_cache;
+pthread_mutex_t tar_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t tar_build_lock = PTHREAD_MUTEX_INITIALIZER;  // one list is built at a time
+
+void tar_cache_note(const char *path) {
+    if (!has_extension(path, TAR_TYPE)) return;
+    char *copy = strdup(path);
+    if (!copy) { perror("strdup failed"); exit(EXIT_FAILURE); }
+    pthread_mutex_lock(&tar_cache_lock);
+    tar_cache.generation++;
+    if (tar_cache.changes == TAR_CACHE_CHANGES) tar_cache.overflow = 1;
+    if (tar_cache.overflow) free(copy);
+    else tar_cache.changed[tar_cache.changes++] = copy;
+    pthread_mutex_unlock(&tar_cache_lock);
+}
+
+void tar_list_release(tar_list *list) {
+    pthread_mutex_lock(&tar_cache_lock);
+    int last = --list->refs == 0;
+    pthread_mutex_unlock(&tar_cache_lock);
+    if (!last) return;
+    for (size_t i = 0; i < list->count; i++) free(list->items[i].path);
+    free(list->items);
+    free(list);
+}
+
+int tar_item_cmp(const void *a, const void *b) {
+    return strcmp(((const tar_item *)a)->path, ((const tar_item *)b)->path);
+}
+
+int tar_path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Fills `item` for a stored file from the index (size, mtime) and stat() (mode, owner);
+// -1 if it is not (or no longer) in the store. Takes ownership of `path`.
+int tar_item_load(char *path, tar_item *item) {
+    char full_path[BUFFER_SIZE];
+    snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, path);
+    struct stat st;
+    if (!index_lookup(path, &item->size, &item->mtime) || stat(full_path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        free(path);
+        return -1;
+    }
+    item->path = path;
+    item->mode = st.st_mode & 07777;
+    item->uid = st.st_uid;
+    item->gid = st.st_gid;
+    return 0;
+}
+
+void tar_list_add(tar_list *list, size_t *capacity, tar_item *item) {
+    if (list->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        list->items = realloc(list->items, *capacity * sizeof(tar_item));
+        if (!list->items) { perror("realloc failed"); exit(EXIT_FAILURE); }
+    }
+    list->items[list->count++] = *item;
+}
+
+// A new list of every TAR_TYPE file in the index
+tar_list *tar_list_build(void) {
+    char **paths = NULL;
+    size_t count = 0, capacity = 0;
+    pthread_rwlock_rdlock(&index_lock);
+    for (size_t i = 0; i < index_buckets; i++) {
+        for (index_node *n = index_table[i]; n; n = n->next) {
+            if (n->is_dir || !has_extension(n->path, TAR_TYPE)) continue;
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                paths = realloc(paths, capacity * sizeof(char *));
+                if (!paths) { perror("realloc failed"); exit(EXIT_FAILURE); }
+            }
+            paths[count] = strdup(n->path);
+            if (!paths[count++]) { perror("strdup failed"); exit(EXIT_FAILURE); }
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    qsort(paths, count, sizeof(char *), tar_path_cmp);
+
+    tar_list *list = calloc(1, sizeof(tar_list));
+    if (!list) { perror("calloc failed"); exit(EXIT_FAILURE); }
+    size_t items = 0;
+    for (size_t i = 0; i < count; i++) {
+        tar_item item;
+        if (tar_item_load(paths[i], &item) == 0) tar_list_add(list, &items, &item);
+    }
+    free(paths);
+    return list;
+}
+
+// A new list made of `old` with the `count` changed paths (sorted, possibly repeated)
+// looked up again; only those are stat()ed
+tar_list *tar_list_merge(const tar_list *old, char **changed, size_t count) {
+    tar_list *list = calloc(1, sizeof(tar_list));
+    if (!list) { perror("calloc failed"); exit(EXIT_FAILURE); }
+    size_t items = 0, i = 0, j = 0;
+    while (i < old->count || j < count) {
+        int cmp = i == old->count ? 1 : j == count ? -1 : strcmp(old->items[i].path, changed[j]);
+        if (cmp < 0) {
+            tar_item item = old->items[i++];
+            item.path = strdup(item.path);
+            if (!item.path) { perror("strdup failed"); exit(EXIT_FAILURE); }
+            tar_list_add(list, &items, &item);
+            continue;
+        }
+        if (cmp == 0) i++;  // replaced by the fresh lookup
+        tar_item item;
+        char *path = changed[j++];
+        while (j < count && strcmp(changed[j], path) == 0) free(changed[j++]);
+        if (tar_item_load(path, &item) == 0) tar_list_add(list, &items, &item);
+    }
+    return list;
+}
+
+// The list for the current generation, with a reference the caller must release
+tar_list *tar_cache_get(void) {
+    pthread_mutex_lock(&tar_build_lock);
+    pthread_mutex_lock(&tar_cache_lock);
+    tar_list *old = tar_cache.list;
+    if (old && tar_cache.built == tar_cache.generation) {
+        old->refs++;
+        pthread_mutex_unlock(&tar_cache_lock);
+        pthread_mutex_unlock(&tar_build_lock);
+        __atomic_add_fetch(&metrics.tar_hits, 1, __ATOMIC_RELAXED);
+        return old;
+    }
+    // Changes noted from here on are left for the next request
+    char **changed = malloc(TAR_CACHE_CHANGES * sizeof(char *));
+    if (!changed) { perror("malloc failed"); exit(EXIT_FAILURE); }
+    size_t count = tar_cache.changes;
+    memcpy(changed, tar_cache.changed, count * sizeof(char *));
+    int rebuild = !old || tar_cache.overflow;
+    unsigned long long generation = tar_cache.generation;
+    tar_cache.changes = 0;
+    tar_cache.overflow = 0;
+    if (old) old->refs++;
+    pthread_mutex_unlock(&tar_cache_lock);
+
+    tar_list *list;
+    if (rebuild) {
+        for (size_t i = 0; i < count; i++) free(changed[i]);
+        list = tar_list_build();
+        __atomic_add_fetch(&metrics.tar_rebuilds, 1, __ATOMIC_RELAXED);
+    } else {
+        qsort(changed, count, sizeof(char *), tar_path_cmp);
+        list = tar_list_merge(old, changed, count);
+        __atomic_add_fetch(&metrics.tar_updates, 1, __ATOMIC_RELAXED);
+    }
+    free(changed);
+    list->refs = 2;  // the cache's and the caller's
+
+    pthread_mutex_lock(&tar_cache_lock);
+    tar_cache.list = list;
+    tar_cache.built = generation;
+    pthread_mutex_unlock(&tar_cache_lock);
+    pthread_mutex_unlock(&tar_build_lock);
+    if (old) {
+        tar_list_release(old);  // ours
+        tar_list_release(old);  // the cache's
+    }
+    return list;
+}
+
+// Streams a complete archive of the TAR_TYPE files in the store, then the end-of-archive blocks
+int send_tar_stream(int sock, uint32_t req_id) {
+    tar_list *list = tar_cache_get();
+    int rc = 0;
+    for (size_t i = 0; i < list->count && rc == 0; i++) {
+        char full_path[BUFFER_SIZE];
+        snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, list->items[i].path);
+        rc = tar_send_entry(sock, req_id, full_path, &list->items[i]);
+    }
+    tar_list_release(list);
+    if (rc < 0) {
+        shutdown(sock, SHUT_RDWR);
+        return -1;
+    }
+    char trailer[2 * TAR_BLOCK] = {0};
+    if (send_frame(sock, OP_DATA, FLAG_ENTRY_END, req_id, trailer, sizeof(trailer)) < 0) return -1;
+    return send_frame(sock, OP_END, 0, req_id, NULL, 0);
+}
+
+
+#ifdef USE_IO_URING
+// io_uring storage engine (build with -DUSE_IO_URING). Each worker thread owns a ring with a
+// set of registered buffers. Socket I/O stays in order on the worker while file writes (STORE)
+// and file reads (RETRIEVE) are queued URING_DEPTH deep, so the device sees many
+// outstanding requests instead of one 4 KB syscall at a time. If the kernel refuses to set
+// up a ring the worker silently uses the regular path.
+#define URING_DEPTH 64
+#define URING_BUFFERS 16
+#define URING_BUF_SIZE (256 * 1024)
+
+typedef struct {
+    int fd;
+    int ready;                   // 1 once set up, -1 if io_uring is unavailable
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    char *bufs;                  // URING_BUFFERS * URING_BUF_SIZE, registered with the kernel
+} uring_engine;
+
+__thread uring_engine ring;
+
+int uring_ready(void) {
+    if (ring.ready) return ring.ready > 0;
+    ring.ready = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (fd < 0) {
+        debug_print("io_uring unavailable (%s), using regular I/O\n", strerror(errno));
+        return 0;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+               mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    char *bufs = aligned_alloc(4096, (size_t)URING_BUFFERS * URING_BUF_SIZE);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || !bufs) {
+        debug_print("io_uring setup failed, using regular I/O\n");
+        close(fd);
+        free(bufs);
+        return 0;
+    }
+
+    struct iovec iov[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = bufs + (size_t)i * URING_BUF_SIZE;
+        iov[i].iov_len = URING_BUF_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0) {
+        debug_print("io_uring buffer registration failed (%s), using regular I/O\n", strerror(errno));
+        close(fd);
+        free(bufs);
+        return 0;
+    }
+
+    ring.fd = fd;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.sqes = sqes;
+    ring.bufs = bufs;
+    ring.ready = 1;
+    return 1;
+}
+
+char *uring_buf(int index) {
+    return ring.bufs + (size_t)index * URING_BUF_SIZE;
+}
+
+// Queues a fixed-buffer read or write of `len` bytes at `offset`; `index` comes back as user_data
+void uring_queue(int opcode, int fd, int index, unsigned len, off_t offset) {
+    unsigned tail = *ring.sq_tail;
+    unsigned slot = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)uring_buf(index);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = index;
+    sqe->user_data = index;
+    ring.sq_array[slot] = slot;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
+}
+
+// Submits everything queued and waits for at least `min_complete` completions
+int uring_enter(unsigned min_complete) {
+    while (1) {
+        int n = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, min_complete,
+                        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        ring.to_submit -= n;
+        return 0;
+    }
+}
+
+// Pops one completion if available: returns 1 and fills `index`/`res`, or 0 if the CQ is empty
+int uring_reap(int *index, int *res) {
+    unsigned head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    *index = (int)cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// STORE side of recv_file_stream(): each DATA payload is received in order into a free
+// registered buffer, then written to `fd` asynchronously at its offset.
+int uring_recv_file_stream(int sock, int fd, char *err, size_t err_size) {
+    int free_bufs[URING_BUFFERS], free_count = URING_BUFFERS;
+    unsigned buf_len[URING_BUFFERS];
+    off_t buf_off[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) free_bufs[i] = i;
+
+    off_t offset = 0;
+    int write_failed = 0, rc = -1;
+    frame_hdr hdr;
+    while (1) {
+        if (recv_frame_hdr(sock, &hdr) < 0) break;
+        if (hdr.opcode == OP_END) { rc = 0; break; }
+        if (hdr.opcode == OP_ERROR) {
+            size_t n = (err && hdr.length < err_size - 1) ? hdr.length : (err ? err_size - 1 : 0);
+            if (recv_all(sock, err, n) < 0) break;
+            if (err) err[n] = '\0';
+            rc = skip_payload(sock, hdr.length - n) < 0 ? -1 : -2;
+            break;
+        }
+        if (hdr.opcode != OP_DATA) break;
+        if (hdr.flags & FLAG_LZ4) {
+            // Compressed frames are decoded and written synchronously, beside the queued writes
+            char block[LZ4_BLOCK];
+            long n = recv_lz4(sock, hdr.length, block);
+            if (n == -1) goto drain;
+            if (n < 0 || pwrite(fd, block, n, offset) != n) write_failed = 1;
+            if (n > 0) offset += n;
+            continue;
+        }
+
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            while (free_count == 0) {
+                // All buffers are in flight: wait for writes to finish and recycle them
+                int index, res;
+                if (uring_enter(1) < 0) return -1;
+                while (uring_reap(&index, &res)) {
+                    if (res < 0 || (unsigned)res != buf_len[index]) {
+                        // Short or failed async write: finish it synchronously
+                        unsigned done = res > 0 ? res : 0;
+                        if (res < 0 || pwrite(fd, uring_buf(index) + done, buf_len[index] - done,
+                                              buf_off[index] + done) != (ssize_t)(buf_len[index] - done))
+                            write_failed = 1;
+                    }
+                    free_bufs[free_count++] = index;
+                }
+            }
+
+            int index = free_bufs[--free_count];
+            unsigned n = remaining < URING_BUF_SIZE ? remaining : URING_BUF_SIZE;
+            if (recv_all(sock, uring_buf(index), n) < 0) { free_bufs[free_count++] = index; goto drain; }
+            buf_len[index] = n;
+            buf_off[index] = offset;
+            uring_queue(IORING_OP_WRITE_FIXED, fd, index, n, offset);
+            offset += n;
+            remaining -= n;
+            if (ring.to_submit >= URING_BUFFERS / 4 && uring_enter(0) < 0) return -1;
+        }
+    }
+
+drain:
+    // Wait for every queued write before the caller closes the file
+    while (free_count < URING_BUFFERS) {
+        int index, res;
+        if (uring_enter(1) < 0) return -1;
+        while (uring_reap(&index, &res)) {
+            if (res < 0 || (unsigned)res != buf_len[index]) write_failed = 1;
+            free_bufs[free_count++] = index;
+        }
+    }
+    return (rc == 0 && write_failed) ? -3 : rc;
+}
+
+// RETRIEVE side of send_file_zero_copy(): reads for the next URING_BUFFERS blocks are
+// kept in flight while completed blocks are sent to the socket in file order.
+int uring_send_file(int sock, uint32_t req_id, int fd, off_t offset, off_t size) {
+    int done[URING_BUFFERS], result[URING_BUFFERS];
+    off_t next_read = 0, next_send = 0;
+    int inflight = 0;
+
+    while (next_send < size) {
+        // Keep every buffer that has already been sent busy reading ahead of the send position
+        while (next_read < size && next_read - next_send < (off_t)URING_BUFFERS * URING_BUF_SIZE) {
+            int index = (next_read / URING_BUF_SIZE) % URING_BUFFERS;
+            unsigned len = size - next_read < URING_BUF_SIZE ? size - next_read : URING_BUF_SIZE;
+            done[index] = 0;
+            uring_queue(IORING_OP_READ_FIXED, fd, index, len, offset + next_read);
+            next_read += len;
+            inflight++;
+        }
+
+        int index = (next_send / URING_BUF_SIZE) % URING_BUFFERS;
+        unsigned len = size - next_send < URING_BUF_SIZE ? size - next_send : URING_BUF_SIZE;
+        while (!done[index]) {
+            int i, res;
+            if (uring_enter(1) < 0) goto fail;
+            while (uring_reap(&i, &res)) { done[i] = 1; result[i] = res; inflight--; }
+        }
+        if (result[index] != (int)len) goto fail;  // read error or the file shrank
+        if (send_all(sock, uring_buf(index), len, 0) < 0) goto fail;
+        next_send += len;
+    }
+    return send_frame(sock, OP_END, 0, req_id, NULL, 0);
+
+fail:
+    debug_print("io_uring transfer aborted at offset %lld\n", (long long)(offset + next_send));
+    while (inflight > 0) {
+        int i, res;
+        if (uring_enter(1) < 0) break;
+        while (uring_reap(&i, &res)) inflight--;
+    }
+    shutdown(sock, SHUT_RDWR);
+    return -1;
+}
+#endif
+
+
+// Receives DATA frames until END, writing them to `file` (or discarding them if NULL).
+// Returns 0 on END, -1 on a broken connection, -2 if the peer sent an ERROR frame
+// (its text is copied into `err`) and -3 if the stream was drained but a write failed.
+int recv_file_stream(int sock, FILE *file, char *err, size_t err_size) {
+#ifdef USE_IO_URING
+    if (file && uring_ready()) return uring_recv_file_stream(sock, fileno(file), err, err_size);
+#endif
+    char buffer[CHUNK_SIZE];
+    frame_hdr hdr;
+    int write_failed = 0;
+    while (recv_frame_hdr(sock, &hdr) == 0) {
+        if (hdr.opcode == OP_END) return write_failed ? -3 : 0;
+        if (hdr.opcode == OP_ERROR) {
+            size_t n = (err && hdr.length < err_size - 1) ? hdr.length : (err ? err_size - 1 : 0);
+            if (recv_all(sock, err, n) < 0) return -1;
+            if (err) err[n] = '\0';
+            return skip_payload(sock, hdr.length - n) < 0 ? -1 : -2;
+        }
+        if (hdr.opcode != OP_DATA) return -1;
+        if (hdr.flags & FLAG_LZ4) {
+            long n = recv_lz4(sock, hdr.length, buffer);
+            if (n == -1) return -1;
+            if (n < 0 || (file && !write_failed && fwrite(buffer, 1, n, file) != (size_t)n)) write_failed = 1;
+            continue;
+        }
+
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t n = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+            if (recv_all(sock, buffer, n) < 0) return -1;
+            if (file && !write_failed && fwrite(buffer, 1, n, file) != n) write_failed = 1;
+            remaining -= n;
+        }
+    }
+    return -1;
+}
+
+// Writes all of buf at `offset`; -1 on failure
+int pwrite_all(int fd, const char *buf, size_t n, uint64_t offset) {
+    while (n > 0) {
+        ssize_t w = pwrite(fd, buf, n, offset);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        buf += w; n -= w; offset += w;
+    }
+    return 0;
+}
+
+// recv_file_stream() for one part of a multi-part upload: the data is written to fd at
+// `offset` and must come to exactly `length` bytes, otherwise the result is -3
+int recv_file_stream_at(int sock, int fd, uint64_t offset, uint64_t length, char *err, size_t err_size) {
+    char buffer[CHUNK_SIZE];
+    frame_hdr hdr;
+    uint64_t received = 0;
+    int write_failed = 0;
+    while (recv_frame_hdr(sock, &hdr) == 0) {
+        if (hdr.opcode == OP_END) return (write_failed || received != length) ? -3 : 0;
+        if (hdr.opcode == OP_ERROR) {
+            size_t n = (err && hdr.length < err_size - 1) ? hdr.length : (err ? err_size - 1 : 0);
+            if (recv_all(sock, err, n) < 0) return -1;
+            if (err) err[n] = '\0';
+            return skip_payload(sock, hdr.length - n) < 0 ? -1 : -2;
+        }
+        if (hdr.opcode != OP_DATA) return -1;
+        if (hdr.flags & FLAG_LZ4) {
+            long n = recv_lz4(sock, hdr.length, buffer);
+            if (n == -1) return -1;
+            if (n < 0 || received + n > length || (!write_failed && pwrite_all(fd, buffer, n, offset + received) < 0))
+                write_failed = 1;
+            if (n > 0) received += n;
+            continue;
+        }
+
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t n = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+            if (recv_all(sock, buffer, n) < 0) return -1;
+            if (received + n > length) write_failed = 1;
+            if (!write_failed && pwrite_all(fd, buffer, n, offset + received) < 0) write_failed = 1;
+            received += n;
+            remaining -= n;
+        }
+    }
+    return -1;
+}
+
+#ifdef USE_JOURNAL
+// Write-ahead journal (build with -DUSE_JOURNAL): STORE replies only once the file would
+// survive a crash, without paying an fsync per file. Bodies are received into the staging
+// directory <base_dir>.journal.d and handed to the journal thread, which commits everything
+// staged since its last round as one group: a single syncfs() flushes all of those files,
+// one record per file and a checksummed trailer go to <base_dir>.journal under a single
+// fdatasync(), and only then are the files renamed into place and their STOREs released.
+// The next round's syncfs() makes those renames durable too, so every round rewrites the
+// journal from the start. On startup a journal whose trailer checks out is replayed, a torn
+// one is discarded, and whatever is left in the staging directory is deleted.
+typedef struct journal_entry {
+    const char *staged;         // file to move into place, or NULL if it was written in place
+    const char *full_path, *rel_path;
+    uint64_t size;
+    time_t mtime;
+    int rc, done;               // rc is 0 once the file is durable in place
+    struct journal_entry *next;
+} journal_entry;
+
+char journal_path[300], journal_dir[300];
+int journal_fd = -1;
+unsigned long long journal_seq;
+journal_entry *journal_head, *journal_tail;
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_work = PTHREAD_COND_INITIALIZER, journal_done = PTHREAD_COND_INITIALIZER;
+
+// Writes one round's records and trailer over the old journal; -1 if they may not be on disk
+int journal_write(journal_entry *batch) {
+    char *records = NULL;
+    size_t length = 0, count = 0;
+    FILE *out = open_memstream(&records, &length);
+    if (!out) return -1;
+    for (journal_entry *e = batch; e; e = e->next, count++)
+        fprintf(out, "%s\t%s\n", e->staged ? e->staged : "-", e->rel_path);
+    if (fclose(out) != 0) { free(records); return -1; }
+
+    char trailer[64];
+    int n = snprintf(trailer, sizeof(trailer), "commit %zu %016llx\n", count, (unsigned long long)index_hash(records));
+    int rc = (ftruncate(journal_fd, 0) != 0 || pwrite_all(journal_fd, records, length, 0) < 0 ||
+              pwrite_all(journal_fd, trailer, n, length) < 0 || fdatasync(journal_fd) != 0) ? -1 : 0;
+    free(records);
+    return rc;
+}
+
+void *journal_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&journal_lock);
+        while (!journal_head) pthread_cond_wait(&journal_work, &journal_lock);
+        journal_entry *batch = journal_head;
+        journal_head = journal_tail = NULL;
+        pthread_mutex_unlock(&journal_lock);
+
+        // Flushes this round's files and the previous round's renames in one go
+        int rc = (syncfs(journal_fd) != 0 || journal_write(batch) < 0) ? -1 : 0;
+        if (rc < 0) debug_print("Journal commit failed: %s\n", strerror(errno));
+        __atomic_add_fetch(&metrics.journal_commits, 1, __ATOMIC_RELAXED);
+        for (journal_entry *e = batch; e; e = e->next) {
+            e->rc = rc;
+            if (e->staged && (rc < 0 || rename(e->staged, e->full_path) != 0)) {
+                remove(e->staged);
+                e->rc = -1;
+            }
+            if (e->rc == 0) index_add(e->rel_path, e->size, e->mtime);
+            __atomic_add_fetch(&metrics.journal_files, 1, __ATOMIC_RELAXED);
+        }
+
+        // Waiters cannot return (and take their entries with them) before the unlock
+        pthread_mutex_lock(&journal_lock);
+        for (journal_entry *e = batch; e; e = e->next) e->done = 1;
+        pthread_cond_broadcast(&journal_done);
+        pthread_mutex_unlock(&journal_lock);
+    }
+    return NULL;
+}
+
+// Hands a received file to the journal thread and waits for its group commit
+int journal_commit(const char *staged, const char *full_path, const char *rel_path, uint64_t size, time_t mtime) {
+    journal_entry e = { staged, full_path, rel_path, size, mtime, -1, 0, NULL };
+    pthread_mutex_lock(&journal_lock);
+    if (journal_tail) journal_tail->next = &e;
+    else journal_head = &e;
+    journal_tail = &e;
+    pthread_cond_signal(&journal_work);
+    while (!e.done) pthread_cond_wait(&journal_done, &journal_lock);
+    pthread_mutex_unlock(&journal_lock);
+    return e.rc;
+}
+
+// Replays the last round if its trailer checks out, clears the journal and the staging
+// directory, and starts the journal thread. Runs before part_load(), whose temp files
+// committed uploads may still have to be moved from.
+void journal_load(void) {
+    snprintf(journal_path, sizeof(journal_path), "%s.journal", base_dir);
+    snprintf(journal_dir, sizeof(journal_dir), "%s.journal.d", base_dir);
+    mkdir(journal_dir, 0755);
+    journal_fd = open(journal_path, O_RDWR | O_CREAT, 0644);
+    if (journal_fd < 0) handle_error(errno, "Journal open failed");
+
+    struct stat st;
+    char *text = NULL;
+    ssize_t n = -1;
+    if (fstat(journal_fd, &st) == 0 && (text = malloc(st.st_size + 1))) n = pread(journal_fd, text, st.st_size, 0);
+    size_t replayed = 0, discarded = 0;
+    if (n > 0 && text[n - 1] == '\n') {
+        text[n - 1] = '\0';
+        char *trailer = strrchr(text, '\n');
+        trailer = trailer ? trailer + 1 : text;
+        size_t count;
+        unsigned long long sum;
+        if (sscanf(trailer, "commit %zu %llx", &count, &sum) == 2) {
+            *trailer = '\0';
+            if (index_hash(text) != sum) trailer = NULL;
+        } else {
+            trailer = NULL;
+        }
+        for (char *line = text, *next; trailer && *line; line = next) {
+            next = strchr(line, '\n');
+            *next++ = '\0';
+            char *rel_path = strchr(line, '\t'), full_path[BUFFER_SIZE];
+            if (!rel_path) continue;
+            *rel_path++ = '\0';
+            snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, rel_path);
+            if (strcmp(line, "-") != 0) rename(line, full_path);
+            if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode)) {
+                index_add(rel_path, st.st_size, st.st_mtime);
+                replayed++;
+            }
+        }
+    }
+    free(text);
+    if (syncfs(journal_fd) != 0 || ftruncate(journal_fd, 0) != 0 || fdatasync(journal_fd) != 0)
+        handle_error(errno, "Journal reset failed");
+
+    DIR *dir = opendir(journal_dir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        char path[BUFFER_SIZE];
+        snprintf(path, sizeof(path), "%s/%s", journal_dir, entry->d_name);
+        if (remove(path) == 0) discarded++;
+    }
+    if (dir) closedir(dir);
+    debug_print("Journal: %zu files replayed, %zu uncommitted discarded\n", replayed, discarded);
+
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, journal_main, NULL);
+    if (err) handle_error(err, "pthread_create failed");
+    pthread_detach(tid);
+}
+#endif
+
+#ifndef USE_JOURNAL
+unsigned long long stage_seq;
+#endif
+
+// Where a STORE body is written before store_commit(): a temp file next to the destination
+// (swept by index_walk() if a crash leaves it behind), or with the journal a fresh file in
+// the staging directory. A failed store thus never touches the version already in place.
+// Returns -1 if the name does not fit in `size`.
+int stage_path(const char *full_path, char *path, size_t size) {
+#ifdef USE_JOURNAL
+    (void)full_path;
+    int n = snprintf(path, size, "%s/%llu", journal_dir, __atomic_add_fetch(&journal_seq, 1, __ATOMIC_RELAXED));
+#else
+    int n = snprintf(path, size, "%s.%llu.tmp", full_path, __atomic_add_fetch(&stage_seq, 1, __ATOMIC_RELAXED));
+#endif
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+// Makes a received file part of the store: moves it from `staged` to full_path (NULL if it
+// was written in place) and indexes it. With the journal this returns once it is durable.
+int store_commit(const char *staged, const char *full_path, const char *rel_path, uint64_t size, time_t mtime) {
+#ifdef USE_JOURNAL
+    return journal_commit(staged, full_path, rel_path, size, mtime);
+#else
+    if (staged && strcmp(staged, full_path) != 0 && rename(staged, full_path) != 0) {
+        remove(staged);
+        return -1;
+    }
+    index_add(rel_path, size, mtime);
+    return 0;
+#endif
+}
+
 void create_directory(const char *path) {
     char cmd[BUFFER_SIZE];
-    snprintf(cmd, BUFFER_SIZE, "mkdir -p \"%s/%s\"", base_dir, path);
+    if (snprintf(cmd, BUFFER_SIZE, "mkdir -p \"%s/%s\"", base_dir, path) >= BUFFER_SIZE) return;
     debug_print("Creating directory: %s\n", cmd);
     system(cmd);
 }
 
-void handle_store(int client_sock, const char *rel_dir_path, const char *file_name) {
+// Gives a stored file the mtime S1 chose for it (STORE's optional third argument), so every
+// replica of an upload, and every copy S1's repair pass makes, carries the same one
+void set_mtime(const char *full_path, const char *mtime_arg) {
+    if (!mtime_arg) return;
+    struct timespec times[2] = { { atoll(mtime_arg), 0 }, { atoll(mtime_arg), 0 } };
+    utimensat(AT_FDCWD, full_path, times, 0);
+}
+
+void handle_store(int client_sock, uint32_t req_id, const char *rel_dir_path, const char *file_name, const char *mtime_arg) {
+    char file_path[BUFFER_SIZE], rel_path[BUFFER_SIZE];
+    snprintf(file_path, BUFFER_SIZE, "%s/%s", rel_dir_path, file_name);
+    if (index_normalize(file_path, rel_path, sizeof(rel_path)) < 0 || !*rel_path) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid path");
+        return;
+    }
+
     // Build full directory path: ~/S2/<relative_path>
     char full_dir[BUFFER_SIZE];
     snprintf(full_dir, BUFFER_SIZE, "%s/%s", base_dir, rel_dir_path);
@@ -43,162 +2216,727 @@ void handle_store(int client_sock, const char *rel_dir_path, const char *file_na
     system(mkdir_cmd);
 
     // Send READY acknowledgment to S1
-    const char *ack = "READY";
-    send(client_sock, ack, strlen(ack), 0);
+    send_text(client_sock, OP_RESP, req_id, "READY");
 
     // Construct full file path to save the incoming file
     char full_path[BUFFER_SIZE];
     snprintf(full_path, BUFFER_SIZE, "%s/%s", full_dir, file_name);
     debug_print("Saving PDF to: %s\n", full_path);
 
-    FILE *file = fopen(full_path, "wb");
-    if (!file) handle_error(errno, "PDF file creation failed");
-
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-    int eof_marker = 0;
+#ifdef USE_DEDUP
+    char err[BUFFER_SIZE];
+    uint64_t size;
+    int rc = dedup_store(client_sock, full_path, err, sizeof(err), &size);
+    if (rc != 0) {
+        if (rc != -1) send_text(client_sock, OP_ERROR, req_id, "ERROR: PDF store failed");
+        return;
+    }
+    set_mtime(full_path, mtime_arg);
+    if (store_commit(NULL, full_path, rel_path, size, mtime_arg ? (time_t)atoll(mtime_arg) : time(NULL)) != 0) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: PDF store failed");
+        return;
+    }
+#else
+    char write_path[BUFFER_SIZE];
+    FILE *file = stage_path(full_path, write_path, sizeof(write_path)) == 0 ? fopen(write_path, "wb") : NULL;
+    if (!file) debug_print("PDF file creation failed: %s\n", strerror(errno));
 
     // Receive file content from S1
-    while ((bytes_received = recv(client_sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        if (strstr(buffer, "EOF_FILE_TRANSFER")) {
-            eof_marker = 1;
-            bytes_received -= 17;  // Trim off EOF marker
-        }
-        if (bytes_received > 0) {
-            fwrite(buffer, 1, bytes_received, file);
-        }
-        if (eof_marker) break;
+    char err[BUFFER_SIZE];
+    int rc = recv_file_stream(client_sock, file, err, sizeof(err));
+    if (file && fclose(file) != 0 && rc == 0) rc = -3;
+    if (!file || rc != 0) {
+        if (file) remove(write_path);
+        if (rc != -1) send_text(client_sock, OP_ERROR, req_id, "ERROR: PDF store failed");
+        return;
     }
 
-    fclose(file);
+    // Send confirmation to S1 once the file is in place
+    set_mtime(write_path, mtime_arg);
+    struct stat st;
+    if (stat(write_path, &st) != 0 || store_commit(write_path, full_path, rel_path, st.st_size, st.st_mtime) != 0) {
+        remove(write_path);
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: PDF store failed");
+        return;
+    }
     debug_print("Stored PDF file successfully: %s\n", full_path);
-
-    // Send confirmation to S1
-    const char *confirm = "STORAGE_SUCCESS";
-    send(client_sock, confirm, strlen(confirm), 0);
+#endif
+    send_text(client_sock, OP_RESP, req_id, "STORAGE_SUCCESS");
 }
 
 
-void handle_retrieve(int client_sock, const char *path) {
+// Optional "<offset> [<length>]" arguments of a ranged download; -1 if malformed
+int parse_range(const char *offset_arg, const char *length_arg, uint64_t *offset, int64_t *length) {
+    char *end;
+    *offset = 0;
+    *length = -1;
+    if (offset_arg) {
+        errno = 0;
+        *offset = strtoull(offset_arg, &end, 10);
+        if (errno || *end || !isdigit((unsigned char)*offset_arg)) return -1;
+    }
+    if (length_arg) {
+        errno = 0;
+        unsigned long long n = strtoull(length_arg, &end, 10);
+        if (errno || *end || !isdigit((unsigned char)*length_arg) || n > INT64_MAX) return -1;
+        *length = n;
+    }
+    return 0;
+}
+
+void handle_retrieve(int client_sock, uint32_t req_id, const char *path, const char *offset_arg, const char *length_arg, int compress) {
     char full_path[BUFFER_SIZE];
     snprintf(full_path, BUFFER_SIZE, "%s/%s", base_dir, path);
-    FILE *file = fopen(full_path, "rb");
-    if (!file) {
-        send(client_sock, "ERROR: PDF not found", 22, 0);
+    char rel_path[BUFFER_SIZE];
+    int fd = -1;
+    if (index_normalize(path, rel_path, sizeof(rel_path)) == 0 && index_lookup(rel_path, NULL, NULL))
+        fd = open(full_path, O_RDONLY);
+    if (fd < 0) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: PDF not found");
         return;
     }
 
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        send(client_sock, buffer, bytes_read, 0);
+    uint64_t offset;
+    int64_t length;
+    if (parse_range(offset_arg, length_arg, &offset, &length) < 0)
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid range");
+    else
+        send_file_zero_copy(client_sock, req_id, fd, offset, length, compress);
+    close(fd);
+}
+
+// STAT: size and mtime from the index, so clients can tell whether a partial download is current
+void handle_stat(int client_sock, uint32_t req_id, const char *path) {
+    char rel_path[BUFFER_SIZE], reply[64];
+    uint64_t size;
+    time_t mtime;
+    if (index_normalize(path, rel_path, sizeof(rel_path)) < 0 || !index_lookup(rel_path, &size, &mtime)) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: PDF not found");
+        return;
     }
-    send(client_sock, "EOF_FILE_TRANSFER", 17, 0);
-    fclose(file);
+    snprintf(reply, sizeof(reply), "SIZE %llu MTIME %lld", (unsigned long long)size, (long long)mtime);
+    send_text(client_sock, OP_RESP, req_id, reply);
 }
 
-void handle_delete(int client_sock, const char *path) {
-    char full_path[BUFFER_SIZE];
-    snprintf(full_path, BUFFER_SIZE, "%s/%s", base_dir, path);
-    if (remove(full_path)) {
-        send(client_sock, "ERROR: PDF delete failed", 25, 0);
-    } else {
-        send(client_sock, "DELETE_SUCCESS", 14, 0);
+// Multi-part uploads (PSTART/PPART/PCOMMIT/PABORT from S1): a large file arrives as
+// fixed-size parts over several connections at once. Each part is written at its own offset
+// into a temp file under <base_dir>.parts, and the file is moved into place only once every
+// part is in. Sessions live in memory; temp files left over from a restart are cleared.
+#define PART_SESSIONS 64        // uploads in progress at once
+#define PART_IDLE_SECS 600      // an upload untouched for this long is dropped
+#define PART_MAX_COUNT 65536    // parts per upload
+
+typedef struct {
+    char id[40];                // empty if the slot is free
+    char rel_path[BUFFER_SIZE]; // destination, relative to the store
+    int fd;
+    uint64_t size, part_size;
+    uint32_t parts, done;
+    unsigned char *state;       // per part: 0 missing, 1 being written, 2 written
+    int writers;
+    time_t touched;
+} part_upload;
+
+part_upload part_uploads[PART_SESSIONS];
+pthread_mutex_t part_lock = PTHREAD_MUTEX_INITIALIZER;
+char part_dir[300];
+
+void part_temp_path(const char *id, char *path, size_t size) {
+    snprintf(path, size, "%s/%s", part_dir, id);
+}
+
+// Frees a slot nobody is writing to, deleting its temp file if it is still open (part_lock held)
+void part_discard(part_upload *u) {
+    if (u->fd >= 0) {
+        char path[BUFFER_SIZE];
+        part_temp_path(u->id, path, sizeof(path));
+        close(u->fd);
+        remove(path);
     }
+    free(u->state);
+    u->state = NULL;
+    u->fd = -1;
+    u->id[0] = '\0';
 }
 
-void handle_list(int client_sock, const char *path) {
-    char full_path[BUFFER_SIZE];
-    snprintf(full_path, BUFFER_SIZE, "%s/%s", base_dir, path);
-    DIR *dir = opendir(full_path);
-    if (!dir) {
-        send(client_sock, "ERROR: Directory not found", 26, 0);
-        return;
+part_upload *part_find(const char *id) {
+    for (int i = 0; i < PART_SESSIONS; i++)
+        if (part_uploads[i].id[0] && strcmp(part_uploads[i].id, id) == 0) return &part_uploads[i];
+    return NULL;
+}
+
+// Opens upload `id` of `size` bytes for rel_path; returns NULL or the reason it was refused
+const char *part_begin(const char *id, const char *rel_path, uint64_t size, uint64_t part_size) {
+    if (!*id || strlen(id) >= sizeof(part_uploads[0].id) || strchr(id, '/') || id[0] == '.')
+        return "ERROR: Invalid upload id";
+    if (part_size == 0 || size / part_size + (size % part_size != 0) > PART_MAX_COUNT)
+        return "ERROR: Invalid part size";
+    if (strlen(base_dir) + 1 + strlen(rel_path) >= BUFFER_SIZE) return "ERROR: Invalid path";
+
+    pthread_mutex_lock(&part_lock);
+    time_t now = time(NULL);
+    part_upload *slot = NULL;
+    for (int i = 0; i < PART_SESSIONS; i++) {
+        part_upload *u = &part_uploads[i];
+        if (u->id[0] && u->writers == 0 && now - u->touched > PART_IDLE_SECS) part_discard(u);
+        if (!u->id[0] && !slot) slot = u;
+    }
+    const char *err = part_find(id) ? "ERROR: Upload already exists" : !slot ? "ERROR: Too many uploads" : NULL;
+    if (!err) {
+        char path[BUFFER_SIZE];
+        part_temp_path(id, path, sizeof(path));
+        slot->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (slot->fd < 0 || ftruncate(slot->fd, size) != 0) {
+            if (slot->fd >= 0) { close(slot->fd); remove(path); }
+            err = "ERROR: Upload creation failed";
+        }
+    }
+    if (!err) {
+        snprintf(slot->id, sizeof(slot->id), "%s", id);
+        snprintf(slot->rel_path, sizeof(slot->rel_path), "%s", rel_path);
+        slot->size = size;
+        slot->part_size = part_size;
+        slot->parts = size / part_size + (size % part_size != 0);
+        slot->done = 0;
+        slot->state = calloc(slot->parts + 1, 1);
+        if (!slot->state) { perror("calloc failed"); exit(EXIT_FAILURE); }
+        slot->writers = 0;
+        slot->touched = now;
+    }
+    pthread_mutex_unlock(&part_lock);
+    return err;
+}
+
+// Claims part `index` for writing; NULL if there is no such part or it is being written.
+// A part that was already written may be sent again (e.g. after a lost reply).
+part_upload *part_claim(const char *id, uint32_t index) {
+    pthread_mutex_lock(&part_lock);
+    part_upload *u = part_find(id);
+    if (u && (index >= u->parts || u->state[index] == 1)) u = NULL;
+    if (u) {
+        if (u->state[index] == 2) u->done--;
+        u->state[index] = 1;
+        u->writers++;
+        u->touched = time(NULL);
+    }
+    pthread_mutex_unlock(&part_lock);
+    return u;
+}
+
+void part_finish(part_upload *u, uint32_t index, int ok) {
+    pthread_mutex_lock(&part_lock);
+    u->state[index] = ok ? 2 : 0;
+    if (ok) u->done++;
+    u->writers--;
+    u->touched = time(NULL);
+    pthread_mutex_unlock(&part_lock);
+}
+
+// Takes a complete upload out of the table, leaving its temp file for the caller to move
+// into place; returns NULL or the reason it cannot be committed yet
+const char *part_take(const char *id, char *rel_path, size_t rel_size, char *temp_path, size_t temp_size) {
+    pthread_mutex_lock(&part_lock);
+    part_upload *u = part_find(id);
+    const char *err = !u ? "ERROR: Unknown upload" : (u->writers || u->done != u->parts) ? "ERROR: Upload incomplete" : NULL;
+    if (!err) {
+        snprintf(rel_path, rel_size, "%s", u->rel_path);
+        part_temp_path(u->id, temp_path, temp_size);
+        close(u->fd);
+        u->fd = -1;
+        part_discard(u);
     }
+    pthread_mutex_unlock(&part_lock);
+    return err;
+}
+
+// Drops an upload and its temp file; returns NULL or the reason it cannot be dropped now
+const char *part_abort(const char *id) {
+    pthread_mutex_lock(&part_lock);
+    part_upload *u = part_find(id);
+    const char *err = !u ? "ERROR: Unknown upload" : u->writers ? "ERROR: Upload busy" : NULL;
+    if (!err) part_discard(u);
+    pthread_mutex_unlock(&part_lock);
+    return err;
+}
 
+// Clears temp files of uploads that were in progress when the server stopped
+void part_load(void) {
+    snprintf(part_dir, sizeof(part_dir), "%s.parts", base_dir);
+    mkdir(part_dir, 0755);
+    DIR *dir = opendir(part_dir);
     struct dirent *entry;
-    char list[BUFFER_SIZE * 10] = "";
-    while ((entry = readdir(dir))) {
-        if (entry->d_type == DT_REG) {
-            strcat(list, entry->d_name);
-            strcat(list, "\n");
-        }
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        char path[BUFFER_SIZE];
+        snprintf(path, sizeof(path), "%s/%s", part_dir, entry->d_name);
+        remove(path);
     }
-    closedir(dir);
-    send(client_sock, list, strlen(list), 0);
+    if (dir) closedir(dir);
+}
+
+// Decimal argument of a command; -1 if malformed
+int parse_u64(const char *arg, uint64_t *value) {
+    char *end;
+    errno = 0;
+    *value = strtoull(arg, &end, 10);
+    return (errno || *end || !isdigit((unsigned char)*arg)) ? -1 : 0;
+}
+
+void handle_part_start(int client_sock, uint32_t req_id, const char *id, const char *path, const char *size_arg, const char *part_size_arg) {
+    char rel_path[BUFFER_SIZE];
+    uint64_t size, part_size;
+    const char *err = NULL;
+    if (index_normalize(path, rel_path, sizeof(rel_path)) < 0 || !*rel_path) err = "ERROR: Invalid path";
+    else if (parse_u64(size_arg, &size) < 0 || parse_u64(part_size_arg, &part_size) < 0) err = "ERROR: Invalid size";
+    else err = part_begin(id, rel_path, size, part_size);
+    send_text(client_sock, err ? OP_ERROR : OP_RESP, req_id, err ? err : "UPLOAD_READY");
 }
 
-void handle_sendtar(int client_sock, const char *filetype) {
-    if (strcmp(filetype, ".pdf") != 0) {
-        send(client_sock, "ERROR: Unsupported filetype for tar", 35, 0);
+// PPART: READY, then the part's DATA frames, then PART_SUCCESS once it is written
+void handle_part(int client_sock, uint32_t req_id, const char *id, const char *index_arg) {
+    uint64_t index;
+    part_upload *u = NULL;
+    if (parse_u64(index_arg, &index) == 0 && index < PART_MAX_COUNT) u = part_claim(id, index);
+    if (!u) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Unknown upload part");
         return;
     }
+    send_text(client_sock, OP_RESP, req_id, "READY");
 
-    char tar_cmd[BUFFER_SIZE];
-    snprintf(tar_cmd, sizeof(tar_cmd),
-             "find %s -type f -name '*.pdf' | tar -cf /tmp/pdf.tar -T -", base_dir);
-    int status = system(tar_cmd);
-    if (status != 0) {
-        send(client_sock, "ERROR: Failed to create tar", 28, 0);
+    uint64_t offset = index * u->part_size;
+    uint64_t length = u->size - offset < u->part_size ? u->size - offset : u->part_size;
+    char err[BUFFER_SIZE];
+    int rc = recv_file_stream_at(client_sock, u->fd, offset, length, err, sizeof(err));
+    part_finish(u, index, rc == 0);
+    if (rc == 0) send_text(client_sock, OP_RESP, req_id, "PART_SUCCESS");
+    else if (rc != -1) send_text(client_sock, OP_ERROR, req_id, "ERROR: Part store failed");
+}
+
+void handle_part_commit(int client_sock, uint32_t req_id, const char *id) {
+    char rel_path[BUFFER_SIZE], temp_path[BUFFER_SIZE], full_path[BUFFER_SIZE];
+    const char *err = part_take(id, rel_path, sizeof(rel_path), temp_path, sizeof(temp_path));
+    if (err) {
+        send_text(client_sock, OP_ERROR, req_id, err);
         return;
     }
-
-    FILE *tarfile = fopen("/tmp/pdf.tar", "rb");
-    if (!tarfile) {
-        send(client_sock, "ERROR: Tar file not found", 25, 0);
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, rel_path) >= (int)sizeof(full_path)) {
+        remove(temp_path);
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Invalid path");
+        return;
+    }
+    char *slash = strrchr(rel_path, '/');
+    if (slash) { *slash = '\0'; create_directory(rel_path); *slash = '/'; }
+#ifdef USE_DEDUP
+    uint64_t size;
+    int rc = dedup_store_file(temp_path, full_path, &size);
+    remove(temp_path);
+    if (rc != 0 || store_commit(NULL, full_path, rel_path, size, time(NULL)) != 0) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Commit failed");
+        return;
+    }
+#else
+    struct stat st;
+    if (stat(temp_path, &st) != 0 || store_commit(temp_path, full_path, rel_path, st.st_size, st.st_mtime) != 0) {
+        remove(temp_path);
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Commit failed");
         return;
     }
+#endif
+    send_text(client_sock, OP_RESP, req_id, "STORAGE_SUCCESS");
+}
 
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, tarfile)) > 0) {
-        send(client_sock, buffer, bytes_read, 0);
+void handle_part_abort(int client_sock, uint32_t req_id, const char *id) {
+    const char *err = part_abort(id);
+    send_text(client_sock, err ? OP_ERROR : OP_RESP, req_id, err ? err : "ABORTED");
+}
+
+// Removes a stored file; in dedup mode its chunks are released too
+int remove_stored(const char *full_path) {
+#ifdef USE_DEDUP
+    return dedup_remove(full_path);
+#else
+    return remove(full_path);
+#endif
+}
+
+void handle_delete(int client_sock, uint32_t req_id, const char *path) {
+    char full_path[BUFFER_SIZE];
+    snprintf(full_path, BUFFER_SIZE, "%s/%s", base_dir, path);
+    char rel_path[BUFFER_SIZE];
+    if (index_normalize(path, rel_path, sizeof(rel_path)) < 0 || !index_lookup(rel_path, NULL, NULL) || remove_stored(full_path)) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: PDF delete failed");
+    } else {
+        index_remove(rel_path);
+        send_text(client_sock, OP_RESP, req_id, "DELETE_SUCCESS");
     }
-    send(client_sock, "EOF_FILE_TRANSFER", 17, 0);
-    fclose(tarfile);
 }
 
-void process_client(int client_sock) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read = recv(client_sock, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes_read <= 0) {
-        debug_print("Connection error: %s\n", strerror(errno));
-        close(client_sock);
+void handle_list(int client_sock, uint32_t req_id, const char *path) {
+    char rel_path[BUFFER_SIZE];
+    size_t length;
+    char *list = NULL;
+    if (index_normalize(path, rel_path, sizeof(rel_path)) == 0) list = index_list(rel_path, NULL, &length);
+    if (!list) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Directory not found");
+        return;
+    }
+    send_frame(client_sock, OP_RESP, 0, req_id, list, length);
+    free(list);
+}
+
+// FILES: the whole store, for S1 to find files that belong on another shard or replica
+void handle_files(int client_sock, uint32_t req_id) {
+    size_t length;
+    char *list = index_files(&length);
+    send_frame(client_sock, OP_RESP, 0, req_id, list, length);
+    free(list);
+}
+
+void handle_sendtar(int client_sock, uint32_t req_id, const char *filetype) {
+    if (strcmp(filetype, TAR_TYPE) != 0) {
+        send_text(client_sock, OP_ERROR, req_id, "ERROR: Unsupported filetype for tar");
         return;
     }
-    buffer[bytes_read] = '\0';
+    send_tar_stream(client_sock, req_id);
+}
 
+// Runs one command on a worker thread. Connections stay open for further commands
+// (S1 pools them); a handler that loses its peer leaves the socket for epoll to reap.
+void process_command(int client_sock, frame_hdr *hdr, char *buffer) {
     debug_print("Command received: %s\n", buffer);
 
-    char cmd[20], arg1[BUFFER_SIZE], arg2[BUFFER_SIZE];
-    int args_parsed = sscanf(buffer, "%s %s %s", cmd, arg1, arg2);
+    char cmd[20] = "", arg1[BUFFER_SIZE], arg2[BUFFER_SIZE], arg3[BUFFER_SIZE], arg4[BUFFER_SIZE];
+    int args_parsed = sscanf(buffer, "%19s %s %s %s %s", cmd, arg1, arg2, arg3, arg4);
 
-    if (strcmp(cmd, "STORE") == 0 && args_parsed == 3) {
-        handle_store(client_sock, arg1, arg2);
+    if (hdr->opcode != OP_CMD) {
+        send_text(client_sock, OP_ERROR, hdr->req_id, "ERROR: Expected command");
+    } else if (strcmp(cmd, "PING") == 0) {
+        send_text(client_sock, OP_RESP, hdr->req_id, "PONG");
+    } else if (strcmp(cmd, "HELLO") == 0) {
+        send_text(client_sock, OP_RESP, hdr->req_id, "HELLO lz4");
+    } else if (strcmp(cmd, "STATS") == 0) {
+        handle_stats(client_sock, hdr->req_id);
+    } else if (strcmp(cmd, "STORE") == 0 && (args_parsed == 3 || args_parsed == 4)) {
+        handle_store(client_sock, hdr->req_id, arg1, arg2, args_parsed == 4 ? arg3 : NULL);
     } else if (strcmp(cmd, "RETRIEVE") == 0 && args_parsed >= 2) {
-        handle_retrieve(client_sock, arg1);
+        handle_retrieve(client_sock, hdr->req_id, arg1, args_parsed >= 3 ? arg2 : NULL, args_parsed >= 4 ? arg3 : NULL,
+                        (hdr->flags & FLAG_LZ4) && !has_extension(arg1, ".zip"));
+    } else if (strcmp(cmd, "STAT") == 0 && args_parsed >= 2) {
+        handle_stat(client_sock, hdr->req_id, arg1);
+    } else if (strcmp(cmd, "PSTART") == 0 && args_parsed == 5) {
+        handle_part_start(client_sock, hdr->req_id, arg1, arg2, arg3, arg4);
+    } else if (strcmp(cmd, "PPART") == 0 && args_parsed == 3) {
+        handle_part(client_sock, hdr->req_id, arg1, arg2);
+    } else if (strcmp(cmd, "PCOMMIT") == 0 && args_parsed == 2) {
+        handle_part_commit(client_sock, hdr->req_id, arg1);
+    } else if (strcmp(cmd, "PABORT") == 0 && args_parsed == 2) {
+        handle_part_abort(client_sock, hdr->req_id, arg1);
     } else if (strcmp(cmd, "DELETE") == 0 && args_parsed >= 2) {
-        handle_delete(client_sock, arg1);
+        handle_delete(client_sock, hdr->req_id, arg1);
     } else if (strcmp(cmd, "LIST") == 0 && args_parsed >= 2) {
-        handle_list(client_sock, arg1);
+        handle_list(client_sock, hdr->req_id, arg1);
+    } else if (strcmp(cmd, "FILES") == 0) {
+        handle_files(client_sock, hdr->req_id);
     } else if (strcmp(cmd, "SENDTAR") == 0 && args_parsed >= 2) {
-        handle_sendtar(client_sock, arg1);
+        handle_sendtar(client_sock, hdr->req_id, arg1);
     } else {
-        const char *err = "ERROR: Invalid command";
-        send(client_sock, err, strlen(err), 0);
+        send_text(client_sock, OP_ERROR, hdr->req_id, "ERROR: Invalid command");
+    }
+}
+
+// Request scheduling: one epoll thread accepts connections and assembles command frames
+// without blocking; complete commands go onto a bounded queue drained by a fixed pool of
+// workers. When the queue is full the command is refused with "ERROR: Server busy" so a
+// burst of STOREs is pushed back to S1 instead of piling up unbounded work on the disk.
+typedef enum {CONN_READ_HDR, CONN_READ_CMD, CONN_BUSY} conn_state;
+
+typedef struct connection {
+    int fd;
+    conn_state state;
+    unsigned char raw[FRAME_HDR_SIZE];
+    size_t have;                 // bytes of the header or command read so far
+    frame_hdr hdr;
+    char cmd[BUFFER_SIZE];
+    struct connection *next;     // work queue link
+} connection;
+
+int epoll_fd;
+int worker_count;
+int active_connections;
+int queue_capacity = QUEUE_CAPACITY;
+
+connection *queue_head, *queue_tail;
+int queue_length;
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+void close_connection(connection *conn) {
+    close(conn->fd);
+    free(conn);
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+}
+
+// Connections are registered one-shot so that exactly one thread owns a connection at a time
+void arm_connection(connection *conn, int op) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn };
+    if (epoll_ctl(epoll_fd, op, conn->fd, &ev) < 0) {
+        debug_print("epoll_ctl failed: %s\n", strerror(errno));
+        close_connection(conn);
+    }
+}
+
+// Returns -1 without queueing when the queue is at capacity
+int queue_push(connection *conn) {
+    conn->next = NULL;
+    pthread_mutex_lock(&queue_lock);
+    if (queue_length >= queue_capacity) {
+        pthread_mutex_unlock(&queue_lock);
+        return -1;
+    }
+    if (queue_tail) queue_tail->next = conn; else queue_head = conn;
+    queue_tail = conn;
+    queue_length++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
+
+connection *queue_pop(void) {
+    pthread_mutex_lock(&queue_lock);
+    while (!queue_head) pthread_cond_wait(&queue_cond, &queue_lock);
+    connection *conn = queue_head;
+    queue_head = conn->next;
+    if (!queue_head) queue_tail = NULL;
+    queue_length--;
+    pthread_mutex_unlock(&queue_lock);
+    return conn;
+}
+
+void reset_connection(connection *conn) {
+    conn->state = CONN_READ_HDR;
+    conn->have = 0;
+    arm_connection(conn, EPOLL_CTL_MOD);
+}
+
+void *worker_main(void *arg) {
+    (void)arg;
+    while (1) {
+        connection *conn = queue_pop();
+        uint64_t started = now_us();
+        command_metric *metric = metric_for(conn->cmd);
+        command_failed = 0;
+        process_command(conn->fd, &conn->hdr, conn->cmd);
+        metric_record(metric, started, command_failed);
+        // A failed transfer leaves the socket closed or shut down; epoll reports that as EOF
+        reset_connection(conn);
     }
+    return NULL;
+}
+
+// Advances a connection's read state machine with whatever bytes are already available
+void on_readable(connection *conn) {
+    while (1) {
+        if (conn->state == CONN_READ_CMD && conn->have == conn->hdr.length) {
+            conn->cmd[conn->have] = '\0';
+            conn->state = CONN_BUSY;
+            if (queue_push(conn) < 0) {
+                debug_print("Work queue full, refusing: %s\n", conn->cmd);
+                __atomic_add_fetch(&metrics.rejected, 1, __ATOMIC_RELAXED);
+                send_text(conn->fd, OP_ERROR, conn->hdr.req_id, "ERROR: Server busy");
+                reset_connection(conn);
+            }
+            return;
+        }
+
+        char *dst = conn->state == CONN_READ_HDR ? (char *)conn->raw + conn->have : conn->cmd + conn->have;
+        size_t want = conn->state == CONN_READ_HDR ? FRAME_HDR_SIZE - conn->have : conn->hdr.length - conn->have;
+        ssize_t n = recv(conn->fd, dst, want, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            arm_connection(conn, EPOLL_CTL_MOD);
+            return;
+        }
+        if (n <= 0) {
+            close_connection(conn);
+            return;
+        }
+        __atomic_add_fetch(&metrics.bytes_in, n, __ATOMIC_RELAXED);
+        conn->have += n;
 
-    close(client_sock);
+        if (conn->state == CONN_READ_HDR && conn->have == FRAME_HDR_SIZE) {
+            if (decode_frame_hdr(conn->raw, &conn->hdr) < 0 || conn->hdr.length >= BUFFER_SIZE) {
+                debug_print("Dropping connection that sent an invalid frame\n");
+                close_connection(conn);
+                return;
+            }
+            conn->state = CONN_READ_CMD;
+            conn->have = 0;
+        }
+    }
 }
 
-int main() {
-    int server_fd, new_socket;
+void accept_connections(int server_fd) {
     struct sockaddr_in address;
-    snprintf(base_dir, sizeof(base_dir), "%s/%s", getenv("HOME"), BASE_DIR_NAME);
-    int opt = 1;
     socklen_t addrlen = sizeof(address);
+    int fd;
+    while ((fd = accept(server_fd, (struct sockaddr *)&address, &addrlen)) >= 0 || errno == EINTR) {
+        if (fd < 0) continue;
+        debug_print("New connection from %s:%d\n", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+        connection *conn = calloc(1, sizeof(*conn));
+        if (!conn) { close(fd); continue; }
+        conn->fd = fd;
+        conn->state = CONN_READ_HDR;
+        __atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+        arm_connection(conn, EPOLL_CTL_ADD);
+        addrlen = sizeof(address);
+    }
+}
+
+// Renders every metric in the Prometheus text exposition format
+void metrics_header(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_value(FILE *out, const char *name, const char *type, const char *help, unsigned long long value) {
+    metrics_header(out, name, type, help);
+    fprintf(out, "%s{server=\"%s\"} %llu\n", name, server_name, value);
+}
+
+char *metrics_text(size_t *length) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    size_t commands = sizeof(command_metrics) / sizeof(command_metrics[0]);
+    char *text = NULL;
+    FILE *out = open_memstream(&text, length);
+    if (!out) return NULL;
+
+    metrics_header(out, "dfs_requests_total", "counter", "Commands completed.");
+    for (size_t i = 0; i < commands; i++)
+        fprintf(out, "dfs_requests_total{server=\"%s\",command=\"%s\"} %llu\n", server_name, command_metrics[i].name,
+                __atomic_load_n(&command_metrics[i].count, __ATOMIC_RELAXED));
+    metrics_header(out, "dfs_request_errors_total", "counter", "Commands that replied with an error.");
+    for (size_t i = 0; i < commands; i++)
+        fprintf(out, "dfs_request_errors_total{server=\"%s\",command=\"%s\"} %llu\n", server_name, command_metrics[i].name,
+                __atomic_load_n(&command_metrics[i].errors, __ATOMIC_RELAXED));
+    metrics_header(out, "dfs_request_duration_seconds", "summary", "Command latency, from the complete command frame to the last reply byte.");
+    for (size_t i = 0; i < commands; i++) {
+        const command_metric *m = &command_metrics[i];
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            fprintf(out, "dfs_request_duration_seconds{server=\"%s\",command=\"%s\",quantile=\"%g\"} %.6f\n",
+                    server_name, m->name, quantiles[q], metric_quantile(m, quantiles[q]) / 1e6);
+        fprintf(out, "dfs_request_duration_seconds_sum{server=\"%s\",command=\"%s\"} %.6f\n", server_name, m->name,
+                __atomic_load_n(&m->sum_us, __ATOMIC_RELAXED) / 1e6);
+        fprintf(out, "dfs_request_duration_seconds_count{server=\"%s\",command=\"%s\"} %llu\n", server_name, m->name,
+                __atomic_load_n(&m->count, __ATOMIC_RELAXED));
+    }
+    metrics_header(out, "dfs_request_duration_max_seconds", "gauge", "Slowest command since startup.");
+    for (size_t i = 0; i < commands; i++)
+        fprintf(out, "dfs_request_duration_max_seconds{server=\"%s\",command=\"%s\"} %.6f\n", server_name, command_metrics[i].name,
+                __atomic_load_n(&command_metrics[i].max_us, __ATOMIC_RELAXED) / 1e6);
+
+    metrics_value(out, "dfs_received_bytes_total", "counter", "Bytes read from sockets.",
+                  __atomic_load_n(&metrics.bytes_in, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_sent_bytes_total", "counter", "Bytes written to sockets.",
+                  __atomic_load_n(&metrics.bytes_out, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_connections_active", "gauge", "Open connections from S1.",
+                  __atomic_load_n(&active_connections, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_requests_rejected_total", "counter", "Commands refused with \"Server busy\".",
+                  __atomic_load_n(&metrics.rejected, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_tar_cache_hits_total", "counter", "Archives sent from an up-to-date tar cache.",
+                  __atomic_load_n(&metrics.tar_hits, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_tar_cache_updates_total", "counter", "Archives that only had the files changed since the last one looked up again.",
+                  __atomic_load_n(&metrics.tar_updates, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_tar_cache_rebuilds_total", "counter", "Archives listed from the whole index.",
+                  __atomic_load_n(&metrics.tar_rebuilds, __ATOMIC_RELAXED));
+#ifdef USE_JOURNAL
+    metrics_value(out, "dfs_journal_commits_total", "counter", "Journal group commits (one syncfs and one fdatasync each).",
+                  __atomic_load_n(&metrics.journal_commits, __ATOMIC_RELAXED));
+    metrics_value(out, "dfs_journal_files_total", "counter", "Files that went through the journal.",
+                  __atomic_load_n(&metrics.journal_files, __ATOMIC_RELAXED));
+#endif
+
+    if (fclose(out) != 0) { free(text); return NULL; }
+    return text;
+}
+
+// STATS: this server's metrics as Prometheus text
+void handle_stats(int client_sock, uint32_t req_id) {
+    size_t length = 0;
+    char *text = metrics_text(&length);
+    if (text) send_frame(client_sock, OP_RESP, 0, req_id, text, length);
+    else send_text(client_sock, OP_ERROR, req_id, "ERROR: Out of memory");
+    free(text);
+}
+
+// Prometheus endpoint: every connection to 127.0.0.1:metrics_port gets one HTTP/1.0 response
+// holding metrics_text(), whatever it asked for, so scrapers need no frame protocol
+void *metrics_main(void *arg) {
+    int server_fd = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) sleep(1);
+            continue;
+        }
+        struct timeval tv = { .tv_sec = 2 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        char request[BUFFER_SIZE];
+        size_t have = 0;
+        ssize_t n;
+        while (have < sizeof(request) - 1 && (n = recv(fd, request + have, sizeof(request) - 1 - have, 0)) > 0) {
+            have += n;
+            request[have] = '\0';
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+        }
+
+        size_t length = 0;
+        char *text = metrics_text(&length);
+        char head[128];
+        int head_len = snprintf(head, sizeof(head), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\n\r\n", text ? "200 OK" : "500 Internal Server Error", text ? length : 0);
+        if (send_all(fd, head, head_len, text ? MSG_MORE : 0) == 0 && text) send_all(fd, text, length, 0);
+        free(text);
+        close(fd);
+    }
+    return NULL;
+}
+
+void metrics_start(void) {
+    int opt = 1;
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(metrics_port) };
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    pthread_t tid;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 16) < 0 ||
+        pthread_create(&tid, NULL, metrics_main, (void *)(intptr_t)fd) != 0) {
+        debug_print("Metrics endpoint disabled: %s\n", strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+// Usage: S2 [worker_threads] [queue_capacity]
+int main(int argc, char *argv[]) {
+    int server_fd;
+    struct sockaddr_in address;
+    signal(SIGPIPE, SIG_IGN);  // sendfile() has no MSG_NOSIGNAL; treat dead peers as EPIPE
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_count = (cores > 0 ? cores : 1) * WORKERS_PER_CORE + WORKERS_PER_DISK;
+    if (argc > 1 && atoi(argv[1]) > 0) worker_count = atoi(argv[1]);
+    if (argc > 2 && atoi(argv[2]) > 0) queue_capacity = atoi(argv[2]);
+    if (argc > 3 && atoi(argv[3]) > 0 && atoi(argv[3]) != PORT) {
+        // Another shard of the same type: its own port, store and metrics port
+        listen_port = atoi(argv[3]);
+        metrics_port = listen_port + 100;
+        snprintf(server_name, sizeof(server_name), "%s-%d", BASE_DIR_NAME, listen_port);
+    }
+    snprintf(base_dir, sizeof(base_dir), "%s/%s", getenv("HOME"), server_name);
+    int opt = 1;
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
         handle_error(errno, "Socket creation failed");
 
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
@@ -206,37 +2944,46 @@ int main() {
 
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    address.sin_port = htons(listen_port);
 
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
         handle_error(errno, "Bind failed");
 
-    if (listen(server_fd, 5) < 0)
+    if (listen(server_fd, SOMAXCONN) < 0)
         handle_error(errno, "Listen failed");
 
-    debug_print("S2 PDF Server listening on port %d\n", PORT);
-    create_directory("");
+    if ((epoll_fd = epoll_create1(0)) < 0)
+        handle_error(errno, "epoll_create1 failed");
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0)
+        handle_error(errno, "epoll_ctl failed");
 
-    while (1) {
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen)) < 0) {
-            debug_print("Accept error: %s\n", strerror(errno));
-            continue;
-        }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_t tid;
+        int err = pthread_create(&tid, NULL, worker_main, NULL);
+        if (err) handle_error(err, "pthread_create failed");
+        pthread_detach(tid);
+    }
 
-        debug_print("New connection from %s:%d\n",
-                    inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+    debug_print("S2 PDF Server listening on port %d (%d workers, queue %d)\n", listen_port, worker_count, queue_capacity);
+    create_directory("");
+    index_load();
+#ifdef USE_JOURNAL
+    journal_load();
+#endif
+    part_load();
+    metrics_start();
+#ifdef USE_DEDUP
+    dedup_load();
+#endif
 
-        pid_t pid = fork();
-        if (pid < 0) {
-            debug_print("Fork failed: %s\n", strerror(errno));
-            close(new_socket);
-        } else if (pid == 0) {
-            close(server_fd);
-            process_client(new_socket);
-            exit(EXIT_SUCCESS);
-        } else {
-            close(new_socket);
-            waitpid(-1, NULL, WNOHANG);
+    struct epoll_event events[64];
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, 64, -1);
+        if (n < 0 && errno != EINTR) handle_error(errno, "epoll_wait failed");
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) accept_connections(server_fd);
+            else on_readable(events[i].data.ptr);
         }
     }
 
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Downloads one .pdf through w25clients until S1's hot-object cache serves it: the second
+# downlf must copy the file into the cache and the third must be a hit. Runs S1-S4 from
+# bin_dir (where S1, S2, S3, S4 and client were built) with a scratch HOME.
+# Usage: tests/cache_hit.sh [bin_dir]
+bin=$(cd "${1:-.}" && pwd)
+work=$(mktemp -d)
+trap 'kill $pids 2>/dev/null; rm -rf "$work"' EXIT
+export HOME="$work"
+cd "$work" || exit 1
+
+pids=
+for s in S2 S3 S4; do "$bin/$s" > "$s.log" 2>&1 & pids="$pids $!"; done
+sleep 0.5
+"$bin/S1" > S1.log 2>&1 & pids="$pids $!"
+sleep 0.5
+
+head -c 100000 /dev/urandom > hot.pdf
+client() { printf '%s\nexit\n' "$1" | "$bin/client" 2>&1; }
+counters() { client cachestats | grep -o 'hits [0-9]* misses [0-9]* fills [0-9]*'; }
+
+client "uploadf hot.pdf ~S1/cache/hot.pdf" > /dev/null
+for i in 1 2; do client "downlf ~S1/cache/hot.pdf" > /dev/null; done
+after_two=$(counters)
+client "downlf ~S1/cache/hot.pdf" > /dev/null
+after_three=$(counters)
+
+fail=0
+[ "$after_two" = "hits 0 misses 2 fills 1" ] || { echo "after two downloads: $after_two"; fail=1; }
+[ "$after_three" = "hits 1 misses 2 fills 1" ] || { echo "after three downloads: $after_three"; fail=1; }
+cmp -s hot.pdf downloads/hot.pdf || { echo "downloaded file differs"; fail=1; }
+[ $fail = 0 ] && echo "cache_hit: ok"
+exit $fail